@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "bench.h"
+
+// The driver code in spi.cpp watches this to know when to quit, see fbcp-ili9341.cpp
+volatile bool programRunning = true;
+
+#if defined(__x86_64__) || defined(__i386__)
+const char *cycleCounterUnit = "cycles";
+
+uint64_t ReadCycleCounter() {
+    return __rdtsc();
+}
+#else
+const char *cycleCounterUnit = "cpu nsecs";
+
+uint64_t ReadCycleCounter() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+uint64_t WallClockUsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+typedef struct Benchmark {
+    const char *name;
+    const char *description;
+    BenchmarkFunction run;
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    {"spi", "Polled SPI task throughput for different task mixes: bytes/s, tasks/s and CPU cost per byte", SPIThroughputBenchmark},
+    {"dma", "Polled SPI vs DMA throughput and CPU usage by task payload size, to find where DMA starts to pay off", DMABenchmark},
+    {"kpump", "Kernel module task pump: interrupt driven vs the old 1 msec timer, bus idle time against the emulated SPI peripheral", KernelPumpBenchmark},
+    {"ring", "SPI task queue alone: tasks/s and nsecs/task by task and batch size, and a check that every task arrives intact", RingBenchmark},
+    {"pipeline", "Frame pipeline: wall and CPU time per frame for full screen and UI-sized changes, by number of worker threads", PipelineBenchmark},
+    {"pixels", "Vectorized vs scalar pixel kernels: RGB565 conversion and changed pixel searches in Mpixels/s, and a check that they agree", PixelKernelsBenchmark},
+    {"rotate", "Cost of rotating the frame in software (DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE): blocked vs pixel by pixel vs no rotation", RotateBenchmark},
+    {"scale", "Capture of 640x480 and 1280x720 sources cropped or scaled to the display, in ms/frame, and checks of the scaling filter", ScaleBenchmark},
+    {"pacing", "Frame pacing against simulated 60/30/24fps and static sources: captures per frame, missed frames and latency vs capturing every slot", PacingBenchmark},
+    {"interlace", "Source frames per second shown for full screen and UI-sized changes, with interlacing never, adaptive or always", InterlaceBenchmark},
+    {"supersede", "How far the display lags behind a source that outruns the bus, with and without superseding stale writes in the SPI queue", SupersedeBenchmark},
+    {"tearing", "Torn pixel writes against a simulated TE signal: no sync vs waiting for vblank vs racing the beam, and the throughput cost", TearingBenchmark},
+    {"scroll", "Scrolling console and list content: bytes per frame and frames/s shown with and without hardware vertical scrolling", ScrollBenchmark},
+    {"compound", "Command-heavy streams of small spans: tasks/s and commands/s with and without packing the cursor commands into compound tasks", CompoundTaskBenchmark},
+};
+
+int main(int argc, char **argv) {
+    const int numBenchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    if (argc >= 2) {
+        for (int i = 0; i < numBenchmarks; ++i)
+            if (!strcmp(argv[1], benchmarks[i].name))
+                return benchmarks[i].run(argc - 2, argv + 2);
+        printf("Unknown benchmark \"%s\"\n\n", argv[1]);
+    }
+    printf("Usage: %s <benchmark> [args]\n\nAvailable benchmarks:\n", argv[0]);
+    for (int i = 0; i < numBenchmarks; ++i)
+        printf("  %-12s %s\n", benchmarks[i].name, benchmarks[i].description);
+    return 1;
+}
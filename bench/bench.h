@@ -0,0 +1,30 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Benchmarks are run as "bench <name> [args]", each benchmark receives the arguments after its name.
+typedef int (*BenchmarkFunction)(int argc, char **argv);
+
+// Returns a free-running counter of CPU cycles on x86 (TSC), or CPU time in nanoseconds on platforms where user space cannot read
+// a cycle counter. cycleCounterUnit names which one it is, for printing.
+uint64_t ReadCycleCounter(void);
+extern const char *cycleCounterUnit;
+
+// Wall clock in microseconds, for measuring benchmark durations (tick() is the driver's clock, but it is only usable after InitSPI())
+uint64_t WallClockUsecs(void);
+
+// Defined in the individual bench/*.cpp files:
+int SPIThroughputBenchmark(int argc, char **argv);
+int DMABenchmark(int argc, char **argv);
+int KernelPumpBenchmark(int argc, char **argv);
+int RingBenchmark(int argc, char **argv);
+int PipelineBenchmark(int argc, char **argv);
+int PixelKernelsBenchmark(int argc, char **argv);
+int RotateBenchmark(int argc, char **argv);
+int ScaleBenchmark(int argc, char **argv);
+int PacingBenchmark(int argc, char **argv);
+int InterlaceBenchmark(int argc, char **argv);
+int SupersedeBenchmark(int argc, char **argv);
+int TearingBenchmark(int argc, char **argv);
+int ScrollBenchmark(int argc, char **argv);
+int CompoundTaskBenchmark(int argc, char **argv);
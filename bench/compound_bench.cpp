@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "../command_table.h"
+#include "../display.h"
+#include "bench.h"
+
+// Queues command-heavy streams through QueueWritePixels(), the way the frame path does, with the SPI thread started by InitSPI()
+// running them, once with every command as a task of its own and once with the cursor commands packed into compound tasks (see
+// BeginCompoundTask()). Each span lands away from the previous one, so that it needs both cursor commands. Runs at the modeled bus
+// speed and, with SPI_EMULATION, with an infinitely fast bus, where the per task overhead of the queue is all that is left.
+
+typedef struct CompoundResult {
+    uint64_t spans;
+    uint64_t tasks; // Queued: 3 per span unpacked, 2 packed
+    uint64_t bytes; // Command + payload bytes of all tasks
+} CompoundResult;
+
+// Queues spans of the given width until the given time has passed, and waits for the SPI thread to send them out
+static uint64_t RunSpans(int width, uint64_t minDurationUsecs, CompoundResult *result) {
+    DisplayCursorState cursor;
+    InvalidateDisplayCursor(&cursor);
+    const uint64_t t0 = WallClockUsecs();
+    uint32_t i = 0;
+    do {
+        BeginTaskBatch();
+        for (int n = 0; n < 256; ++n, ++i) {
+            // Steps that never land on the same column or row as the span before, nor where its write left off
+            const int x = (i * 37) % (DISPLAY_WIDTH - width), y = (i * 13) % DISPLAY_HEIGHT;
+            uint32_t bytes = 0;
+            SPITask *task = QueueWritePixels(&cursor, x, y, x + width - 1, y, &bytes);
+            memset(task->data, (uint8_t) i, task->size);
+            CommitTask(task);
+            result->bytes += bytes;
+        }
+        EndTaskBatch();
+    } while (WallClockUsecs() - t0 < minDurationUsecs);
+    while (!SPITaskQueueDrained()) usleep(100);
+    result->spans += i;
+    result->tasks += (uint64_t) i * (packCompoundTasks ? 2 : 3);
+    return WallClockUsecs() - t0;
+}
+
+static void RunStream(int width, const char *busName, uint64_t minDurationUsecs) {
+    for (int packed = 0; packed < 2; ++packed) {
+        packCompoundTasks = packed;
+        CompoundResult result = {};
+        const uint64_t c0 = ReadCycleCounter();
+        const uint64_t elapsed = RunSpans(width, minDurationUsecs, &result);
+        const uint64_t cycles = ReadCycleCounter() - c0;
+        const double secs = elapsed / 1e6;
+        printf("%5d px  %-10s %-8s %12.0f %12.0f %12.0f %10.3f %12.0f\n", width, busName, packed ? "packed" : "single",
+               result.spans / secs, result.tasks / secs, 3 * result.spans / secs, result.bytes / secs / 1e6,
+               (double) cycles / (3 * result.spans));
+    }
+}
+
+int CompoundTaskBenchmark(int argc, char **argv) {
+    uint64_t minDurationUsecs = (argc >= 1) ? (uint64_t) (atof(argv[0]) * 1e6) : 1000000;
+
+    InitSPI();
+
+    printf("%-9s %-10s %-8s %12s %12s %12s %10s %12s\n", "span", "bus", "commands", "spans/sec", "tasks/sec", "commands/sec",
+           "MB/sec", cycleCounterUnit);
+    printf("%-9s %-10s %-8s %12s %12s %12s %10s %12s\n", "", "", "", "", "", "", "", "per command");
+    const int widths[] = {1, 8, 32};
+    for (int i = 0; i < 3; ++i) {
+#ifdef SPI_EMULATION
+        char busName[32];
+        SetEmulatedCoreFrequency(EMULATED_CORE_FREQUENCY_HZ);
+        snprintf(busName, sizeof(busName), "%.1fMHz", 8 * 1e3 / EmulatedNsecsPerByte());
+        RunStream(widths[i], busName, minDurationUsecs);
+        SetEmulatedCoreFrequency(0);
+        RunStream(widths[i], "unlimited", minDurationUsecs);
+#else
+        RunStream(widths[i], "hardware", minDurationUsecs);
+#endif
+    }
+    packCompoundTasks = true;
+
+    DeinitSPI();
+    return 0;
+}
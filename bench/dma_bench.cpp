@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "../dma.h"
+#include "../display.h"
+#include "bench.h"
+
+// Sends pixel write tasks of increasing payload size, once with polled SPI and once with DMA, to find the task size at which DMA
+// starts to pay off (DMA_IS_FASTER_THAN_POLLED_SPI). Besides throughput, reports how much CPU time the process spent per second of
+// wall time, since freeing the CPU while the bus is busy is the other half of what DMA buys.
+
+#ifdef USE_DMA_TRANSFERS
+
+static uint64_t ProcessCPUUsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+typedef struct TransferResult {
+    double bytesPerSec;
+    double cpuPercent;
+} TransferResult;
+
+static TransferResult RunTransfers(uint32_t payloadBytes, uint64_t minDurationUsecs) {
+    uint64_t bytes = 0;
+    uint64_t t0 = WallClockUsecs();
+    uint64_t cpu0 = ProcessCPUUsecs();
+    uint64_t elapsed;
+    do {
+        SPITask *task = AllocTask(payloadBytes);
+        task->cmd = DISPLAY_WRITE_PIXELS;
+        memset(task->data, (uint8_t) bytes, payloadBytes);
+        CommitTask(task);
+        bytes += payloadBytes + 1;
+        elapsed = WallClockUsecs() - t0;
+    } while (elapsed < minDurationUsecs);
+    while (!SPITaskQueueDrained())
+        usleep(100);
+    elapsed = WallClockUsecs() - t0;
+
+    TransferResult result;
+    result.bytesPerSec = bytes * 1e6 / elapsed;
+    result.cpuPercent = (ProcessCPUUsecs() - cpu0) * 100.0 / elapsed;
+    return result;
+}
+
+int DMABenchmark(int argc, char **argv) {
+    uint64_t minDurationUsecs = (argc >= 1) ? (uint64_t) (atof(argv[0]) * 1e6) : 500000;
+    static const uint32_t payloadSizes[] = {8, 32, 64, 100, 140, 200, 400, 1024, 4096, SPI_MAX_PIXEL_TASK_BYTES};
+
+    InitSPI();
+
+    printf("%-14s %12s %10s %12s %10s\n", "payload bytes", "polled MB/s", "polled CPU", "DMA MB/s", "DMA CPU");
+    uint32_t crossover = 0;
+    for (uint32_t i = 0; i < sizeof(payloadSizes) / sizeof(payloadSizes[0]); ++i) {
+        dmaMinTaskBytes = 0xFFFFFFFFu;
+        TransferResult polled = RunTransfers(payloadSizes[i], minDurationUsecs);
+        dmaMinTaskBytes = 0;
+        TransferResult dma = RunTransfers(payloadSizes[i], minDurationUsecs);
+        printf("%-14u %12.3f %9.1f%% %12.3f %9.1f%%\n", payloadSizes[i], polled.bytesPerSec / 1e6, polled.cpuPercent,
+               dma.bytesPerSec / 1e6, dma.cpuPercent);
+        if (!crossover && dma.bytesPerSec >= polled.bytesPerSec) crossover = payloadSizes[i];
+    }
+    dmaMinTaskBytes = DMA_IS_FASTER_THAN_POLLED_SPI;
+
+    if (crossover) printf("\nDMA matches polled SPI throughput from %u byte payloads on (DMA_IS_FASTER_THAN_POLLED_SPI=%u)\n",
+                          crossover, DMA_IS_FASTER_THAN_POLLED_SPI);
+    else printf("\nDMA did not match polled SPI throughput at any of the tested payload sizes\n");
+#ifdef SPI_EMULATION
+    printf("DMA totals: %llu control blocks run, %llu bytes written to the TX FIFO\n",
+           (unsigned long long) emulatedSPIStatistics.dmaControlBlocks,
+           (unsigned long long) emulatedSPIStatistics.dmaBytesToFIFO);
+#endif
+
+    DeinitSPI();
+    return 0;
+}
+
+#else
+
+int DMABenchmark(int argc, char **argv) {
+    printf("This benchmark needs a build with -DUSE_DMA_TRANSFERS=ON\n");
+    return 1;
+}
+
+#endif
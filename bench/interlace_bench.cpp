@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "../display.h"
+#include "../diff.h"
+#include "../framebuffer.h"
+#include "../pipeline.h"
+#include "../scaler.h"
+#include "../util.h"
+#include "bench.h"
+
+// Feeds a source that updates at TARGET_FRAME_RATE through the frame pipeline and the SPI thread, in real time against the emulated
+// bus, the way the main loop does, with interlacing never, adaptive (see pipeline.h) or always. The source either changes the whole
+// screen every frame, like video or a game, or a few UI-sized areas. Reports how many source frames per second reach the display,
+// how many of those were interlaced, how many left out fields were sent while the bus would have been idle, and bus throughput.
+
+#ifdef SPI_EMULATION
+
+// The source cycles through this many frames. With two, every other frame would be the same as the field that an interlaced
+// update leaves out, and half of the screen would never change.
+#define NUM_FRAMES 3
+
+static void FillRandom(uint32_t *pixels, int width, int x0, int y0, int x1, int y1) {
+    for (int y = y0; y < y1; ++y)
+        for (int x = x0; x < x1; ++x)
+            pixels[y * width + x] = (uint32_t) rand();
+}
+
+typedef struct InterlaceResult {
+    double framesPerSec; // Source frames that were captured and queued to the display
+    double interlaced; // Percentage of them that were interlaced
+    double leftOutFieldsPerSec; // Fields sent when the bus went idle after an interlaced frame
+    double megabytesPerSec; // Queued to the bus
+} InterlaceResult;
+
+static InterlaceResult RunSource(uint32_t *frames[NUM_FRAMES], int interlacing, double seconds) {
+    frameInterlacing = interlacing;
+    while (!SPITaskQueueDrained()) usleep(1000);
+
+    const uint64_t interval = 1000000 / TARGET_FRAME_RATE;
+    const uint64_t start = tick(), end = start + (uint64_t) (seconds * 1e6);
+    uint64_t slot = start;
+    uint32_t shown = 0, leftOutFields = 0;
+    FrameDiffStatistics stats = {};
+    for (;;) {
+        if (SendLeftOutFieldWhenBusIdle(slot, &stats)) ++leftOutFields;
+        uint64_t now = tick();
+        if (now >= end) break;
+        if (slot > now) usleep(slot - now);
+        sourceFramebuffer.pixels = (uint8_t *) frames[shown % NUM_FRAMES];
+        RunFramePipeline(&stats);
+        ++shown;
+        // Source frames that came and went while the pipeline was blocked on a full queue are never seen
+        slot = MAX(slot + interval, tick());
+    }
+    const double elapsed = (tick() - start) / 1e6;
+
+    InterlaceResult result;
+    result.framesPerSec = shown / elapsed;
+    result.interlaced = shown ? 100.0 * stats.interlacedFrames / shown : 0;
+    result.leftOutFieldsPerSec = leftOutFields / elapsed;
+    result.megabytesPerSec = stats.bytesTransmitted / elapsed / 1e6;
+    return result;
+}
+
+int InterlaceBenchmark(int argc, char **argv) {
+    double seconds = (argc >= 1) ? atof(argv[0]) : 3.0;
+
+    InitSPI();
+    InitDiff();
+    uint32_t *frames[NUM_FRAMES];
+    for (int i = 0; i < NUM_FRAMES; ++i) frames[i] = (uint32_t *) malloc(FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint32_t));
+    SourceFramebuffer &fb = sourceFramebuffer;
+    fb.width = FRAME_WIDTH;
+    fb.height = FRAME_HEIGHT;
+    fb.bitsPerPixel = 32;
+    fb.stride = FRAME_WIDTH * sizeof(uint32_t);
+    fb.redShift = 16;
+    fb.greenShift = 8;
+    fb.blueShift = 0;
+    FitFramebufferToDisplay();
+    InitFramePipeline(-1);
+
+    const double fullFrameMsecs = FRAME_WIDTH * FRAME_HEIGHT * SPI_BYTESPERPIXEL * NOMINAL_SPI_USECS_PER_BYTE / 1e3;
+    printf("%.1f seconds per run, source updates at %d fps, a full %dx%d frame takes %.1f ms on the bus\n", seconds,
+           TARGET_FRAME_RATE, FRAME_WIDTH, FRAME_HEIGHT, fullFrameMsecs);
+    printf("%-10s %-12s %14s %12s %18s %10s\n", "changes", "interlacing", "frames/s shown", "interlaced", "idle fields sent/s",
+           "MB/s");
+    const char *workloads[] = {"full", "ui"};
+    const char *modes[] = {"never", "adaptive", "always"};
+    const int interlacing = frameInterlacing;
+    for (int w = 0; w < 2; ++w) {
+        srand(1);
+        FillRandom(frames[0], FRAME_WIDTH, 0, 0, FRAME_WIDTH, FRAME_HEIGHT);
+        for (int i = 1; i < NUM_FRAMES; ++i) {
+            if (w == 0) FillRandom(frames[i], FRAME_WIDTH, 0, 0, FRAME_WIDTH, FRAME_HEIGHT);
+            else {
+                // A text caret row, a progress bar and a clock in different parts of the screen, as in the pipeline benchmark
+                uint32_t *f = frames[i];
+                memcpy(f, frames[0], FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint32_t));
+                FillRandom(f, FRAME_WIDTH, FRAME_WIDTH / 8, FRAME_HEIGHT / 4, FRAME_WIDTH * 7 / 8, FRAME_HEIGHT / 4 + FRAME_HEIGHT / 20);
+                FillRandom(f, FRAME_WIDTH, 0, FRAME_HEIGHT * 3 / 4, FRAME_WIDTH / 2, FRAME_HEIGHT * 3 / 4 + FRAME_HEIGHT / 16);
+                FillRandom(f, FRAME_WIDTH, FRAME_WIDTH * 3 / 4, 0, FRAME_WIDTH, FRAME_HEIGHT / 10);
+            }
+        }
+        for (int mode = INTERLACING_NEVER; mode <= INTERLACING_ALWAYS; ++mode) {
+            InterlaceResult r = RunSource(frames, mode, seconds);
+            printf("%-10s %-12s %14.1f %11.1f%% %18.1f %10.2f\n", workloads[w], modes[mode], r.framesPerSec, r.interlaced,
+                   r.leftOutFieldsPerSec, r.megabytesPerSec);
+        }
+    }
+    frameInterlacing = interlacing;
+
+    while (!SPITaskQueueDrained()) usleep(1000);
+    DeinitFramePipeline();
+    sourceFramebuffer.pixels = 0;
+    DeinitSourceScaler();
+    for (int i = 0; i < NUM_FRAMES; ++i) free(frames[i]);
+    DeinitDiff();
+    DeinitSPI();
+    return 0;
+}
+
+#else
+
+int InterlaceBenchmark(int argc, char **argv) {
+    printf("This benchmark runs against the emulated SPI peripheral, build with -DSPI_EMULATION=ON\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "../command_table.h"
+#include "../dma.h"
+#include "../spi_pump.h"
+#include "bench.h"
+
+// Runs the task pump of the kernel module (spi_pump.h) in user space against the emulated SPI peripheral, and compares it with the
+// jiffies timer pump that the module used before: every 1 msec, run up to 500 tasks with polled SPI. A thread that watches the
+// emulated interrupt line stands in for the interrupt controller, and the producer kicks the pump like the SPI_BUS_IOCTL_KICK ioctl
+// does. Two workloads:
+//  - streaming, where the producer keeps the queue full, so any time the bus spends idle is overhead of the pump,
+//  - single spans queued at random times, measuring how long it takes from committing the tasks until they have all been sent.
+
+#ifdef SPI_EMULATION
+
+static volatile bool pumpRunning = false;
+static SPIPump pump;
+static pthread_mutex_t pumpLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t timerTicks = 0;
+
+// The kernel module before: PumpSPI() from a timer that re-arms itself 1 msec (one jiffy at HZ=1000) after each run.
+static void *TimerPumpThread(void *unused) {
+    while (pumpRunning) {
+        usleep(1000);
+        ++timerTicks;
+        if (SPITaskQueueDrained()) continue;
+        BEGIN_SPI_COMMUNICATION();
+        for (int i = 0; i < 500; ++i) {
+            SPITask *task = GetTask();
+            if (!task) break;
+            RunSPITask(task);
+            DoneTask(task);
+        }
+        END_SPI_COMMUNICATION();
+    }
+    return 0;
+}
+
+// Runs the interrupt handler of the kernel module whenever the emulated SPI0 interrupt line is asserted.
+static void *InterruptThread(void *unused) {
+    while (pumpRunning) {
+        if (EmulatedSPIInterruptPending()) {
+            pthread_mutex_lock(&pumpLock);
+            ++spiTaskMemory->interruptsRaised;
+            SPIPumpService(&pump, tick());
+            pthread_mutex_unlock(&pumpLock);
+        } else
+            sched_yield();
+    }
+    return 0;
+}
+
+// Queues a cursor window and a pixel write of the given size, and kicks the pump if the queue had run empty, like
+// WakeSPITaskConsumer() does for clients of the kernel module.
+static uint32_t QueueSpan(int width, int y, bool kick) {
+    BeginTaskBatch();
+    BeginCompoundTask();
+    QueueCommandWords(DISPLAY_SET_CURSOR_X, 0, width - 1);
+    QueueCommandWords(DISPLAY_SET_CURSOR_Y, y, DISPLAY_HEIGHT - 1);
+    EndCompoundTask();
+    SPITask *task = AllocTask(width * SPI_BYTESPERPIXEL);
+    task->cmd = DISPLAY_WRITE_PIXELS;
+    memset(task->data, (uint8_t) y, task->size);
+    CommitTask(task);
+    if (EndTaskBatch() && kick) {
+        pthread_mutex_lock(&pumpLock);
+        SPIPumpKick(&pump, tick());
+        pthread_mutex_unlock(&pumpLock);
+    }
+    return 2 * (8 + 1) + task->size + 1;
+}
+
+static pthread_t StartPump(bool interruptDriven) {
+    ResetSPITaskQueue();
+    spiTaskMemory->interruptsRaised = 0;
+    SPIPumpInit(&pump, tick());
+    timerTicks = 0;
+    BEGIN_SPI_COMMUNICATION();
+    pumpRunning = true;
+    pthread_t thread;
+    pthread_create(&thread, NULL, interruptDriven ? InterruptThread : TimerPumpThread, NULL);
+    return thread;
+}
+
+static void StopPump(pthread_t thread, bool interruptDriven) {
+    pumpRunning = false;
+    pthread_join(thread, NULL);
+    if (interruptDriven)
+        printf("   %u interrupts, %u kicks (%u restarted an idle pump), %.1f msecs idle with the queue empty\n",
+               spiTaskMemory->interruptsRaised, pump.kicks, pump.kicksWhileIdle, pump.idleUsecs / 1e3);
+    else
+        printf("   %u timer ticks\n", timerTicks);
+}
+
+static void RunStream(const char *pumpName, bool interruptDriven, int spanWidth, uint64_t durationUsecs) {
+    pthread_t thread = StartPump(interruptDriven);
+    uint64_t busNsecs0 = emulatedSPIStatistics.busActiveNsecs;
+    uint64_t bytes = 0;
+    uint64_t t0 = WallClockUsecs();
+    for (int y = 0; WallClockUsecs() - t0 < durationUsecs; y = (y + 1) % DISPLAY_HEIGHT)
+        bytes += QueueSpan(spanWidth, y, interruptDriven);
+    while (!SPITaskQueueDrained())
+        usleep(100);
+    uint64_t elapsed = WallClockUsecs() - t0;
+
+    double busIdle = 1.0 - (emulatedSPIStatistics.busActiveNsecs - busNsecs0) / (elapsed * 1e3);
+    printf("%-6s %-10s %-7d %10.3f %9.1f%%", pumpName, "stream", spanWidth * SPI_BYTESPERPIXEL, bytes / (elapsed / 1e6) / 1e6,
+           100.0 * busIdle);
+    StopPump(thread, interruptDriven);
+}
+
+static void RunSingleSpans(const char *pumpName, bool interruptDriven, int spanWidth, uint64_t durationUsecs) {
+    pthread_t thread = StartPump(interruptDriven);
+    uint64_t latencySum = 0, latencyMax = 0;
+    uint32_t spans = 0;
+    uint32_t seed = 1;
+    uint64_t t0 = WallClockUsecs();
+    while (WallClockUsecs() - t0 < durationUsecs) {
+        seed = seed * 1103515245u + 12345u;
+        usleep((seed >> 16) % 2000); // Random phase against the 1 msec timer
+        uint64_t start = WallClockUsecs();
+        QueueSpan(spanWidth, spans % DISPLAY_HEIGHT, interruptDriven);
+        while (!SPITaskQueueDrained())
+            sched_yield();
+        uint64_t latency = WallClockUsecs() - start;
+        latencySum += latency;
+        latencyMax = MAX(latencyMax, latency);
+        ++spans;
+    }
+    uint32_t bytes = 2 * (8 + 1) + spanWidth * SPI_BYTESPERPIXEL + 1;
+    printf("%-6s %-10s %-7d %4.0f/%4.0f/%4.0f usecs", pumpName, "single", spanWidth * SPI_BYTESPERPIXEL,
+           bytes * EmulatedNsecsPerByte() / 1e3, (double) latencySum / spans, (double) latencyMax);
+    StopPump(thread, interruptDriven);
+}
+
+int KernelPumpBenchmark(int argc, char **argv) {
+    uint64_t durationUsecs = (argc >= 1) ? (uint64_t) (atof(argv[0]) * 1e6) : 1000000;
+
+    // Set up the peripheral and the task queue like InitSPI() does, but without starting the SPI thread, the pumps below
+    // consume the queue instead.
+    ResetSPIEmulation();
+    spi = &emulatedSPIRegisters;
+    gpio = &emulatedGPIORegisters;
+    spi->cs = BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
+    spi->clk = SPI_BUS_CLOCK_DIVISOR;
+    spi->dlen = 2; // 8 clocks per byte, see UNLOCK_FAST_8_CLOCKS_SPI() in spi.cpp
+    spiTaskMemory = (SharedMemory *) calloc(1, SHARED_MEMORY_SIZE);
+#ifdef USE_DMA_TRANSFERS
+    dmaMinTaskBytes = 0xFFFFFFFFu; // Both pumps send with polled SPI
+#endif
+
+    printf("SPI bus clocked at %.2f MHz\n", 8 * 1e3 / EmulatedNsecsPerByte());
+    printf("%-6s %-10s %-7s %10s %10s\n", "pump", "workload", "payload", "MB/sec", "bus idle");
+    const int spanWidths[] = {8, 64, DISPLAY_WIDTH};
+    for (int i = 0; i < 3; ++i) {
+        RunStream("timer", false, spanWidths[i], durationUsecs);
+        RunStream("irq", true, spanWidths[i], durationUsecs);
+    }
+    printf("\n%-6s %-10s %-7s %s\n", "pump", "workload", "payload", "bus time/average/max latency to send the span");
+    for (int i = 0; i < 3; ++i) {
+        RunSingleSpans("timer", false, spanWidths[i], durationUsecs);
+        RunSingleSpans("irq", true, spanWidths[i], durationUsecs);
+    }
+
+    free(spiTaskMemory);
+    spiTaskMemory = 0;
+    return 0;
+}
+
+#else
+
+int KernelPumpBenchmark(int argc, char **argv) {
+    printf("This benchmark runs against the emulated SPI peripheral, build with -DSPI_EMULATION=ON\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "../config.h"
+#include "../display.h"
+#include "../pacing.h"
+#include "../util.h"
+#include "bench.h"
+
+// Runs the frame pacing of pacing.cpp against simulated sources in virtual time, with captures that take CAPTURE_USECS each, and
+// compares it to sleeping for 1/TARGET_FRAME_RATE seconds after each capture, the way the main loop used to. For sources that update at common
+// rates, with and without jitter, and for a static screen, reports captures per second, captures per new frame, frames that were
+// replaced before being captured, and the latency from the arrival of a frame to its capture.
+
+#define CAPTURE_USECS 3000
+
+typedef struct SimulatedSource {
+    const char *name;
+    double fps; // 0 for a static screen, which changes once at the start
+    double jitterUsecs; // Arrivals are spread by up to this much around the steady rate
+} SimulatedSource;
+
+typedef struct PacingResult {
+    double capturesPerSec;
+    double capturesPerFrame;
+    double missedFrames; // Percentage of source frames never captured
+    double latencyMsecs; // Mean time from arrival of a frame to the capture that found it
+    double busy; // Percentage of time capturing
+} PacingResult;
+
+// Time at which source frame k arrives
+static uint64_t FrameArrival(const SimulatedSource &src, int64_t k) {
+    if (src.fps == 0) return (k == 0) ? 1000 : UINT64_MAX;
+    const double t = 1000 + k * 1e6 / src.fps;
+    const double jitter = src.jitterUsecs * (((uint32_t) (k * 2654435761u) >> 16) / 65536.0 - 0.5);
+    return (uint64_t) (t + jitter);
+}
+
+static PacingResult Simulate(const SimulatedSource &src, bool paced, int seconds) {
+    const uint64_t duration = (uint64_t) seconds * 1000000;
+    InitFramePacing(0);
+    FramePacingStatistics stats = {};
+    int64_t seen = -1; // Latest source frame captured
+    int64_t latest = -1; // Latest source frame that has arrived
+    uint32_t captures = 0, frames = 0;
+    double latencySum = 0;
+    uint64_t now = 0;
+    while (now < duration) {
+        const uint64_t t = paced ? MAX(NextFrameCaptureTime(), now) : now + 1000000 / TARGET_FRAME_RATE;
+        while (FrameArrival(src, latest + 1) <= t) ++latest;
+        const bool changed = latest > seen;
+        if (changed) {
+            latencySum += t - FrameArrival(src, latest);
+            ++frames;
+            seen = latest;
+        }
+        ++captures;
+        now = t + CAPTURE_USECS;
+        FrameCaptured(t, now, changed, &stats);
+    }
+    PacingResult r;
+    r.capturesPerSec = captures / (double) seconds;
+    r.capturesPerFrame = frames ? (double) captures / frames : 0;
+    r.missedFrames = (latest >= 0) ? 100.0 * (latest + 1 - frames) / (latest + 1) : 0;
+    r.latencyMsecs = frames ? latencySum / frames / 1000 : 0;
+    r.busy = 100.0 * captures * CAPTURE_USECS / duration;
+    return r;
+}
+
+int PacingBenchmark(int argc, char **argv) {
+    int seconds = (argc >= 1) ? atoi(argv[0]) : 20;
+
+    static const SimulatedSource sources[] = {
+        {"60fps", 60, 0}, {"30fps", 30, 0}, {"24fps", 24, 0}, {"20fps", 20, 0}, {"50fps", 50, 0},
+        {"30fps, 2ms jitter", 30, 2000}, {"60fps, 2ms jitter", 60, 2000}, {"static", 0, 0},
+    };
+    printf("%d virtual seconds per source, %d fps target, captures take %.1f ms\n", seconds, TARGET_FRAME_RATE, CAPTURE_USECS / 1e3);
+    printf("%-20s %-10s %12s %14s %10s %14s %8s\n", "source", "pacing", "captures/s", "captures/frame", "missed", "latency ms",
+           "busy");
+    for (uint32_t i = 0; i < sizeof(sources) / sizeof(sources[0]); ++i) {
+        for (int paced = 0; paced < 2; ++paced) {
+            PacingResult r = Simulate(sources[i], paced, seconds);
+            printf("%-20s %-10s %12.1f %14.2f %9.1f%% %14.2f %7.1f%%\n", sources[i].name, paced ? "paced" : "fixed sleep",
+                   r.capturesPerSec, r.capturesPerFrame, r.missedFrames, r.latencyMsecs, r.busy);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "../display.h"
+#include "../diff.h"
+#include "../framebuffer.h"
+#include "../pipeline.h"
+#include "../scaler.h"
+#include "bench.h"
+
+// Runs the frame pipeline (see pipeline.h) against the task queue alone, with a consumer thread that takes the tasks off without
+// sending them anywhere, so the figures are the CPU cost of turning source frames into SPI tasks. The source framebuffer flips
+// between two 32bpp frames that differ either everywhere or only in a few UI-sized areas. Reports wall time and CPU time per frame,
+// the latter summed over the main thread and the pipeline workers, for each number of workers.
+
+#ifdef SPI_EMULATION
+
+static bool consumerRunning = false; // Accessed with __atomic builtins
+static uint64_t consumerCpuNsecs = 0;
+
+static uint64_t CpuNsecs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *ConsumerThread(void *unused) {
+    for (;;) {
+        SPITask *task = GetTask();
+        if (!task) {
+            if (!__atomic_load_n(&consumerRunning, __ATOMIC_ACQUIRE) && SPITaskQueueDrained()) break;
+            uint32_t head = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED);
+            struct timespec timeout = {0, 1000000};
+            syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, head, &timeout, 0, 0);
+            continue;
+        }
+        DoneTask(task);
+    }
+    consumerCpuNsecs = CpuNsecs(CLOCK_THREAD_CPUTIME_ID);
+    return 0;
+}
+
+static void FillRandom(uint32_t *pixels, int width, int x0, int y0, int x1, int y1) {
+    for (int y = y0; y < y1; ++y)
+        for (int x = x0; x < x1; ++x)
+            pixels[y * width + x] = (uint32_t) rand();
+}
+
+typedef struct PipelineResult {
+    double wallMsecsPerFrame;
+    double cpuMsecsPerFrame;
+    double bytesPerFrame;
+} PipelineResult;
+
+static PipelineResult RunPipeline(uint32_t *frames[2], int numWorkers, int numFrames) {
+    ResetSPITaskQueue();
+    InvalidateDisplayCursor(&displayCursor);
+    memset(framebuffer[1], 0, FRAME_STRIDE * FRAME_HEIGHT * sizeof(uint16_t));
+    InitFramePipeline(numWorkers);
+    __atomic_store_n(&consumerRunning, true, __ATOMIC_RELEASE);
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, ConsumerThread, NULL);
+
+    FrameDiffStatistics stats = {};
+    uint64_t t0 = WallClockUsecs();
+    uint64_t cpu0 = CpuNsecs(CLOCK_PROCESS_CPUTIME_ID);
+    for (int i = 0; i < numFrames; ++i) {
+        sourceFramebuffer.pixels = (uint8_t *) frames[i & 1];
+        RunFramePipeline(&stats);
+    }
+    __atomic_store_n(&consumerRunning, false, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0);
+    pthread_join(consumer, NULL);
+    // Worker threads are joined before taking the process CPU time, but their time is still counted in it
+    DeinitFramePipeline();
+    uint64_t cpu = CpuNsecs(CLOCK_PROCESS_CPUTIME_ID) - cpu0 - consumerCpuNsecs;
+    uint64_t elapsed = WallClockUsecs() - t0;
+
+    PipelineResult result;
+    result.wallMsecsPerFrame = elapsed / 1e3 / numFrames;
+    result.cpuMsecsPerFrame = cpu / 1e6 / numFrames;
+    result.bytesPerFrame = (double) stats.bytesTransmitted / numFrames;
+    return result;
+}
+
+int PipelineBenchmark(int argc, char **argv) {
+    int numFrames = (argc >= 1) ? atoi(argv[0]) : 200;
+    int maxWorkers = (argc >= 2) ? atoi(argv[1]) : 4;
+    if (maxWorkers > MAX_FRAME_PIPELINE_WORKERS) maxWorkers = MAX_FRAME_PIPELINE_WORKERS;
+
+    spiTaskMemory = (SharedMemory *) calloc(1, SHARED_MEMORY_SIZE);
+    InitDiff();
+    uint32_t *frames[2];
+    for (int i = 0; i < 2; ++i) frames[i] = (uint32_t *) malloc(FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint32_t));
+    SourceFramebuffer &fb = sourceFramebuffer;
+    fb.width = FRAME_WIDTH;
+    fb.height = FRAME_HEIGHT;
+    fb.bitsPerPixel = 32;
+    fb.stride = FRAME_WIDTH * sizeof(uint32_t);
+    fb.redShift = 16;
+    fb.greenShift = 8;
+    fb.blueShift = 0;
+    FitFramebufferToDisplay();
+    // Adaptive interlacing would depend on how far the consumer thread lags, so every run would do a different amount of work
+    const int interlacing = frameInterlacing;
+    frameInterlacing = INTERLACING_NEVER;
+
+    printf("%d frames of %dx%d per run, worker threads are in addition to the main thread\n", numFrames, FRAME_WIDTH, FRAME_HEIGHT);
+    printf("%-10s %-8s %14s %14s %14s\n", "changes", "workers", "wall ms/frame", "cpu ms/frame", "bytes/frame");
+    const char *workloads[] = {"full", "ui"};
+    for (int w = 0; w < 2; ++w) {
+        srand(1);
+        FillRandom(frames[0], FRAME_WIDTH, 0, 0, FRAME_WIDTH, FRAME_HEIGHT);
+        if (w == 0) FillRandom(frames[1], FRAME_WIDTH, 0, 0, FRAME_WIDTH, FRAME_HEIGHT);
+        else {
+            // About 10% of the screen: a text caret row, a progress bar and a clock in different parts of the screen
+            memcpy(frames[1], frames[0], FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint32_t));
+            FillRandom(frames[1], FRAME_WIDTH, FRAME_WIDTH / 8, FRAME_HEIGHT / 4, FRAME_WIDTH * 7 / 8, FRAME_HEIGHT / 4 + FRAME_HEIGHT / 20);
+            FillRandom(frames[1], FRAME_WIDTH, 0, FRAME_HEIGHT * 3 / 4, FRAME_WIDTH / 2, FRAME_HEIGHT * 3 / 4 + FRAME_HEIGHT / 16);
+            FillRandom(frames[1], FRAME_WIDTH, FRAME_WIDTH * 3 / 4, 0, FRAME_WIDTH, FRAME_HEIGHT / 10);
+        }
+        for (int workers = 0; workers <= maxWorkers; ++workers) {
+            PipelineResult r = RunPipeline(frames, workers, numFrames);
+            printf("%-10s %-8d %14.3f %14.3f %14.0f\n", workloads[w], workers, r.wallMsecsPerFrame, r.cpuMsecsPerFrame,
+                   r.bytesPerFrame);
+        }
+    }
+
+    frameInterlacing = interlacing;
+    sourceFramebuffer.pixels = 0;
+    DeinitSourceScaler();
+    for (int i = 0; i < 2; ++i) free(frames[i]);
+    DeinitDiff();
+    free(spiTaskMemory);
+    spiTaskMemory = 0;
+    return 0;
+}
+
+#else
+
+int PipelineBenchmark(int argc, char **argv) {
+    printf("This benchmark runs against the emulated SPI peripheral, build with -DSPI_EMULATION=ON (works on a Pi too)\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "../config.h"
+#include "../pixels.h"
+#include "../diff.h"
+#include "bench.h"
+
+// Compares the vectorized pixel kernels in pixels.cpp against their scalar reference versions: Mpixels/sec of source pixel
+// conversion to RGB565 and of the searches for changed pixels that the diff runs on every row, over frames of the display's size.
+// Also checks that both versions give the same results, on random data and on rows with changes at every possible offset.
+
+static int mismatches = 0;
+
+static void Mismatch(const char *kernel, int width, int x) {
+    if (mismatches++ < 5) printf("%s differs from its scalar version, width %d, at %d\n", kernel, width, x);
+}
+
+typedef void (*ConvertFunction)(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte);
+
+static double BenchConvert(ConvertFunction convert, const uint8_t *src, int bytesPerPixel, uint8_t *dst, int frames) {
+    uint64_t t0 = WallClockUsecs();
+    for (int f = 0; f < frames; ++f)
+        for (int y = 0; y < FRAME_HEIGHT; ++y)
+            convert(src + y * FRAME_WIDTH * bytesPerPixel, dst + y * FRAME_WIDTH * 2, FRAME_WIDTH, false);
+    return (double) frames * FRAME_WIDTH * FRAME_HEIGHT / (WallClockUsecs() - t0);
+}
+
+static void CheckConvert(const char *name, ConvertFunction convert, ConvertFunction reference, const uint8_t *src) {
+    uint8_t a[2 * 64], b[2 * 64];
+    for (int redInLowByte = 0; redInLowByte < 2; ++redInLowByte)
+        for (int width = 0; width <= 64; ++width) {
+            convert(src, a, width, redInLowByte);
+            reference(src, b, width, redInLowByte);
+            for (int x = 0; x < width; ++x)
+                if (a[2 * x] != b[2 * x] || a[2 * x + 1] != b[2 * x + 1]) {
+                    Mismatch(name, width, x);
+                    break;
+                }
+        }
+}
+
+typedef int (*SearchFunction)(const uint16_t *a, const uint16_t *b, int x, int width);
+
+static void CheckSearches(const uint16_t *a, const uint16_t *b, int width) {
+    static const SearchFunction kernels[] = {FindFirstChangedPixel, FindFirstUnchangedPixel, FindChangedPixelsEnd};
+    static const SearchFunction references[] = {FindFirstChangedPixelScalar, FindFirstUnchangedPixelScalar,
+                                                FindChangedPixelsEndScalar};
+    static const char *names[] = {"FindFirstChangedPixel", "FindFirstUnchangedPixel", "FindChangedPixelsEnd"};
+    for (int k = 0; k < 3; ++k)
+        for (int x = 0; x <= width; ++x)
+            if (kernels[k](a, b, x, width) != references[k](a, b, x, width)) Mismatch(names[k], width, x);
+}
+
+// The per-row searches of DiffFramebufferRowsToSpans(), without the span bookkeeping. Returns the number of changed pixels.
+static uint32_t DiffRows(const uint16_t *newFrame, const uint16_t *prevFrame, bool scalar) {
+    uint32_t changedPixels = 0;
+    for (int y = 0; y < FRAME_HEIGHT; ++y) {
+        const uint16_t *a = newFrame + y * FRAME_STRIDE, *b = prevFrame + y * FRAME_STRIDE;
+        if (scalar) {
+            for (int x = FindFirstChangedPixelScalar(a, b, 0, FRAME_WIDTH); x < FRAME_WIDTH;) {
+                int endX = FindFirstUnchangedPixelScalar(a, b, x, FRAME_WIDTH);
+                changedPixels += endX - x;
+                x = FindFirstChangedPixelScalar(a, b, endX, FRAME_WIDTH);
+            }
+        } else {
+            int changedEndX = FindChangedPixelsEnd(a, b, 0, FRAME_WIDTH);
+            for (int x = changedEndX ? FindFirstChangedPixel(a, b, 0, changedEndX) : changedEndX; x < changedEndX;) {
+                int endX = FindFirstUnchangedPixel(a, b, x, changedEndX);
+                changedPixels += endX - x;
+                x = (endX < changedEndX) ? FindFirstChangedPixel(a, b, endX, changedEndX) : changedEndX;
+            }
+        }
+    }
+    return changedPixels;
+}
+
+static void BenchDiff(const char *name, const uint16_t *newFrame, const uint16_t *prevFrame, int frames) {
+    double rate[2];
+    uint32_t changed[2];
+    for (int scalar = 0; scalar < 2; ++scalar) {
+        uint64_t t0 = WallClockUsecs();
+        for (int f = 0; f < frames; ++f) changed[scalar] = DiffRows(newFrame, prevFrame, scalar);
+        rate[scalar] = (double) frames * FRAME_WIDTH * FRAME_HEIGHT / (WallClockUsecs() - t0);
+    }
+    if (changed[0] != changed[1]) Mismatch(name, FRAME_WIDTH, -1);
+    printf("%-28s %14.1f %14.1f %9.2fx\n", name, rate[1], rate[0], rate[0] / rate[1]);
+}
+
+int PixelKernelsBenchmark(int argc, char **argv) {
+    int frames = (argc >= 1) ? atoi(argv[0]) : 200;
+    mismatches = 0;
+
+    const int numPixels = FRAME_WIDTH * FRAME_HEIGHT;
+    uint8_t *src = (uint8_t *) malloc(numPixels * 4);
+    uint8_t *dst = (uint8_t *) malloc(numPixels * 2);
+    uint16_t *frame[2] = {(uint16_t *) malloc(numPixels * 2), (uint16_t *) malloc(numPixels * 2)};
+    srand(1);
+    for (int i = 0; i < numPixels * 4; ++i) src[i] = (uint8_t) rand();
+
+    // Correctness first: conversions of every short width, and searches on rows with a single change at each offset, and with
+    // random sparse changes.
+    CheckConvert("ConvertXRGB8888ToRGB565BE", ConvertXRGB8888ToRGB565BE, ConvertXRGB8888ToRGB565BEScalar, src);
+    CheckConvert("ConvertRGB888ToRGB565BE", ConvertRGB888ToRGB565BE, ConvertRGB888ToRGB565BEScalar, src);
+    uint16_t a[64], b[64];
+    memset(b, 0, sizeof(b));
+    for (int width = 0; width <= 64; ++width)
+        for (int changed = -1; changed < width; ++changed) {
+            memset(a, 0, sizeof(a));
+            if (changed >= 0) a[changed] = 1;
+            CheckSearches(a, b, width);
+            for (int i = 0; i < 64; ++i) a[i] = (i == changed) ? 0 : 1;
+            CheckSearches(a, b, width);
+        }
+    for (int i = 0; i < 1000; ++i) {
+        for (int x = 0; x < 64; ++x) a[x] = (rand() % 4 == 0);
+        CheckSearches(a, b, 64);
+    }
+
+    printf("Pixel kernels built for %s, Mpixels/sec over %d frames of %dx%d\n", pixelKernelsIsa, frames, FRAME_WIDTH,
+           FRAME_HEIGHT);
+    printf("%-28s %14s %14s %10s\n", "kernel", "scalar", pixelKernelsIsa, "speedup");
+    double scalar = BenchConvert(ConvertXRGB8888ToRGB565BEScalar, src, 4, dst, frames);
+    double vectorized = BenchConvert(ConvertXRGB8888ToRGB565BE, src, 4, dst, frames);
+    printf("%-28s %14.1f %14.1f %9.2fx\n", "convert XRGB8888", scalar, vectorized, vectorized / scalar);
+    scalar = BenchConvert(ConvertRGB888ToRGB565BEScalar, src, 3, dst, frames);
+    vectorized = BenchConvert(ConvertRGB888ToRGB565BE, src, 3, dst, frames);
+    printf("%-28s %14.1f %14.1f %9.2fx\n", "convert RGB888", scalar, vectorized, vectorized / scalar);
+
+    // Diff workloads: an unchanged frame, a frame where ~10% of the rows have a short change in the middle (e.g. a text cursor or
+    // a clock), a frame where every pixel changed, and one where every fourth pixel changed
+    for (int i = 0; i < numPixels; ++i) frame[0][i] = frame[1][i] = (uint16_t) rand();
+    BenchDiff("diff unchanged", frame[0], frame[1], frames);
+    for (int y = 0; y < FRAME_HEIGHT; y += 10)
+        for (int x = FRAME_WIDTH / 2; x < FRAME_WIDTH / 2 + 24; ++x) frame[0][y * FRAME_STRIDE + x] ^= 1;
+    BenchDiff("diff small changes", frame[0], frame[1], frames);
+    for (int i = 0; i < numPixels; ++i) frame[0][i] = (uint16_t) ~frame[1][i];
+    BenchDiff("diff all changed", frame[0], frame[1], frames);
+    for (int i = 0; i < numPixels; ++i) frame[0][i] = (i % 4) ? frame[1][i] : (uint16_t) ~frame[1][i];
+    BenchDiff("diff every 4th changed", frame[0], frame[1], frames);
+
+    free(src);
+    free(dst);
+    free(frame[0]);
+    free(frame[1]);
+    if (mismatches) {
+        printf("FAILED: %d mismatches between the vectorized and scalar kernels\n", mismatches);
+        return 1;
+    }
+    printf("Vectorized kernels match their scalar versions\n");
+    return 0;
+}
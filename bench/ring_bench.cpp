@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "bench.h"
+
+// Exercises the SPI task queue on its own: the main thread produces tasks through AllocTask/CommitTask, and a consumer thread that
+// sleeps on the queue like SPIThread() does takes them off with GetTask/DoneTask, without sending anything. Each task carries a
+// sequence number and a pattern derived from it, which the consumer checks, so this doubles as a stress test of the queue
+// synchronization: build with -DTHREAD_SANITIZER=ON to run it under ThreadSanitizer. Reports tasks/sec and nsecs/task of the queue
+// alone, for different task sizes and publish batch sizes (see BeginTaskBatch()).
+
+#ifdef SPI_EMULATION
+
+static bool consumerRunning = false; // Accessed with __atomic builtins
+static uint64_t tasksConsumed = 0;
+static uint64_t corruptTasks = 0;
+static uint32_t consumerSleeps = 0;
+
+static inline uint8_t PatternByte(uint32_t seq, uint32_t i) {
+    return (uint8_t) (seq * 31 + i);
+}
+
+static void *ConsumerThread(void *unused) {
+    uint32_t expectedSeq = 0;
+    for (;;) {
+        SPITask *task = GetTask();
+        if (!task) {
+            if (!__atomic_load_n(&consumerRunning, __ATOMIC_ACQUIRE) && SPITaskQueueDrained()) break;
+            // Same protocol as SPIThread(): sleep until queueTail moves away from the head we found the queue empty at. The
+            // timeout is for the quit request, which may come just before we go to sleep.
+            uint32_t head = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED);
+            struct timespec timeout = {0, 1000000};
+            syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, head, &timeout, 0, 0);
+            ++consumerSleeps;
+            continue;
+        }
+        bool ok = task->cmd == (uint8_t) (1 + expectedSeq % 255);
+        if (task->size >= sizeof(uint32_t)) {
+            uint32_t seq;
+            memcpy(&seq, task->data, sizeof(seq));
+            ok = ok && seq == expectedSeq;
+            for (uint32_t i = sizeof(uint32_t); i < task->size; ++i)
+                ok = ok && task->data[i] == PatternByte(expectedSeq, i);
+        }
+        if (!ok && corruptTasks++ < 5)
+            printf("Task %u is corrupt: cmd=%u, %u bytes at offset %u\n", expectedSeq, task->cmd, task->size,
+                   (uint32_t) ((uint8_t *) task - spiTaskMemory->buffer));
+        ++expectedSeq;
+        ++tasksConsumed;
+        DoneTask(task);
+    }
+    return 0;
+}
+
+// Returns the payload size of the given task: fixed if taskBytes is nonzero, otherwise pseudorandom from a command-only task up to
+// a full pixel task, to stress wrapping around the end of the ring at all kinds of offsets.
+static uint32_t TaskBytes(uint32_t seq, uint32_t taskBytes) {
+    if (taskBytes) return taskBytes;
+    uint32_t r = seq * 2654435761u;
+    return (r >> 28) < 12 ? (r >> 8) % 64 : (r >> 8) % SPI_MAX_PIXEL_TASK_BYTES;
+}
+
+typedef struct RingResult {
+    double tasksPerSec;
+    double nsecsPerTask;
+    uint32_t producerStalls;
+    uint32_t consumerSleeps;
+} RingResult;
+
+static RingResult RunRing(uint32_t numTasks, uint32_t taskBytes, int batchSize) {
+    ResetSPITaskQueue();
+    tasksConsumed = 0;
+    consumerSleeps = 0;
+    __atomic_store_n(&consumerRunning, true, __ATOMIC_RELEASE);
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, ConsumerThread, NULL);
+
+    uint64_t t0 = WallClockUsecs();
+    for (uint32_t seq = 0; seq < numTasks; ++seq) {
+        if (batchSize > 1 && seq % batchSize == 0) BeginTaskBatch();
+        SPITask *task = AllocTask(TaskBytes(seq, taskBytes));
+        task->cmd = (uint8_t) (1 + seq % 255);
+        if (task->size >= sizeof(uint32_t)) {
+            memcpy(task->data, &seq, sizeof(seq));
+            for (uint32_t i = sizeof(uint32_t); i < task->size; ++i)
+                task->data[i] = PatternByte(seq, i);
+        }
+        CommitTask(task);
+        if (batchSize > 1 && (seq % batchSize == (uint32_t) batchSize - 1 || seq + 1 == numTasks)) EndTaskBatch();
+    }
+    __atomic_store_n(&consumerRunning, false, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0);
+    pthread_join(consumer, NULL);
+    uint64_t elapsed = WallClockUsecs() - t0;
+
+    if (tasksConsumed != numTasks) {
+        printf("Consumer got %llu tasks out of %u!\n", (unsigned long long) tasksConsumed, numTasks);
+        ++corruptTasks;
+    }
+    RingResult result;
+    result.tasksPerSec = numTasks * 1e6 / elapsed;
+    result.nsecsPerTask = elapsed * 1e3 / numTasks;
+    result.producerStalls = spiTaskMemory->producerStalls;
+    result.consumerSleeps = consumerSleeps;
+    return result;
+}
+
+int RingBenchmark(int argc, char **argv) {
+    uint32_t numTasks = (argc >= 1) ? (uint32_t) atoi(argv[0]) : 2000000;
+
+    spiTaskMemory = (SharedMemory *) calloc(1, SHARED_MEMORY_SIZE);
+    corruptTasks = 0;
+
+    printf("%u tasks per run through a %u byte queue\n", numTasks, (uint32_t) SPI_QUEUE_SIZE);
+    printf("%-10s %-6s %14s %12s %14s %14s\n", "payload", "batch", "tasks/sec", "nsecs/task", "producer waits",
+           "consumer sleeps");
+    static const uint32_t taskBytes[] = {0/*mixed*/, 1, 8, 64, 1024};
+    static const int batchSizes[] = {1, 8, 64};
+    for (uint32_t i = 0; i < sizeof(taskBytes) / sizeof(taskBytes[0]); ++i)
+        for (uint32_t j = 0; j < sizeof(batchSizes) / sizeof(batchSizes[0]); ++j) {
+            // Large tasks are mostly memory bandwidth, so run fewer of them
+            uint32_t tasks = taskBytes[i] >= 1024 || !taskBytes[i] ? numTasks / 16 : numTasks;
+            RingResult r = RunRing(tasks, taskBytes[i], batchSizes[j]);
+            char payload[16];
+            if (taskBytes[i]) snprintf(payload, sizeof(payload), "%u", taskBytes[i]);
+            else snprintf(payload, sizeof(payload), "mixed");
+            printf("%-10s %-6d %14.0f %12.1f %14u %14u\n", payload, batchSizes[j], r.tasksPerSec, r.nsecsPerTask,
+                   r.producerStalls, r.consumerSleeps);
+        }
+
+    free(spiTaskMemory);
+    spiTaskMemory = 0;
+    if (corruptTasks) {
+        printf("FAILED: %llu tasks arrived corrupted or out of order\n", (unsigned long long) corruptTasks);
+        return 1;
+    }
+    printf("All tasks arrived intact and in order\n");
+    return 0;
+}
+
+#else
+
+int RingBenchmark(int argc, char **argv) {
+    printf("This benchmark runs against the emulated SPI peripheral, build with -DSPI_EMULATION=ON (works on a Pi too)\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "../config.h"
+#include "../pixels.h"
+#include "bench.h"
+
+// Measures what rotating the frame in software (DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) adds to the capture of a frame: a 480x320
+// XRGB8888 source converted to RGB565 as is, rotated with the blocked kernel, and rotated pixel by pixel in display scan order,
+// which reads the source a column at a time. Also checks that the blocked rotations by 90 and 270 degrees give the same pixels as
+// the simple ones, on sizes that are not multiples of the block size too.
+
+#define SOURCE_WIDTH 480
+#define SOURCE_HEIGHT 320
+
+static int mismatches = 0;
+
+static void CheckRotation(const uint8_t *src, int width, int height) {
+    uint8_t *a = (uint8_t *) malloc(width * height * 2), *b = (uint8_t *) malloc(width * height * 2);
+    for (int redInLowByte = 0; redInLowByte < 2; ++redInLowByte) {
+        // Rotate the whole image, and then a band of columns into the middle of the rotated image, like the frame pipeline does
+        RotateXRGB8888ToRGB565BE(src, width * 4, height, 0, width, a, height * 2, redInLowByte);
+        RotateXRGB8888ToRGB565BE(src, width * 4, height, width / 3, width / 2, a + width / 3 * height * 2, height * 2, redInLowByte);
+        RotateXRGB8888ToRGB565BEScalar(src, width * 4, height, 0, width, b, height * 2, redInLowByte);
+        if (memcmp(a, b, width * height * 2) && mismatches++ < 5)
+            printf("Rotation of %dx%d differs from its scalar version\n", width, height);
+        // The 270 degree rotation (DISPLAY_ROTATE_180_DEGREES) puts the same band of columns in reverse order
+        Rotate270XRGB8888ToRGB565BE(src, width * 4, height, 0, width, a, height * 2, redInLowByte);
+        Rotate270XRGB8888ToRGB565BE(src, width * 4, height, width / 3, width / 2, a + (width - width / 2) * height * 2, height * 2,
+                                    redInLowByte);
+        Rotate270XRGB8888ToRGB565BEScalar(src, width * 4, height, 0, width, b, height * 2, redInLowByte);
+        if (memcmp(a, b, width * height * 2) && mismatches++ < 5)
+            printf("270 degree rotation of %dx%d differs from its scalar version\n", width, height);
+    }
+    free(a);
+    free(b);
+}
+
+typedef struct CaptureResult {
+    double msecsPerFrame;
+    double mpixelsPerSec;
+} CaptureResult;
+
+static CaptureResult BenchCapture(int mode, const uint8_t *src, uint8_t *dst, int frames) {
+    uint64_t t0 = WallClockUsecs();
+    for (int f = 0; f < frames; ++f) {
+        if (mode == 0) {
+            for (int y = 0; y < SOURCE_HEIGHT; ++y)
+                ConvertXRGB8888ToRGB565BE(src + y * SOURCE_WIDTH * 4, dst + y * SOURCE_WIDTH * 2, SOURCE_WIDTH, false);
+        } else if (mode == 1) {
+            RotateXRGB8888ToRGB565BE(src, SOURCE_WIDTH * 4, SOURCE_HEIGHT, 0, SOURCE_WIDTH, dst, SOURCE_HEIGHT * 2, false);
+        } else if (mode == 2) {
+            Rotate270XRGB8888ToRGB565BE(src, SOURCE_WIDTH * 4, SOURCE_HEIGHT, 0, SOURCE_WIDTH, dst, SOURCE_HEIGHT * 2, false);
+        } else {
+            RotateXRGB8888ToRGB565BEScalar(src, SOURCE_WIDTH * 4, SOURCE_HEIGHT, 0, SOURCE_WIDTH, dst, SOURCE_HEIGHT * 2, false);
+        }
+    }
+    uint64_t elapsed = WallClockUsecs() - t0;
+    CaptureResult result;
+    result.msecsPerFrame = elapsed / 1e3 / frames;
+    result.mpixelsPerSec = (double) frames * SOURCE_WIDTH * SOURCE_HEIGHT / elapsed;
+    return result;
+}
+
+int RotateBenchmark(int argc, char **argv) {
+    int frames = (argc >= 1) ? atoi(argv[0]) : 500;
+    mismatches = 0;
+
+    uint8_t *src = (uint8_t *) malloc(SOURCE_WIDTH * SOURCE_HEIGHT * 4);
+    uint8_t *dst = (uint8_t *) malloc(SOURCE_WIDTH * SOURCE_HEIGHT * 2);
+    srand(1);
+    for (int i = 0; i < SOURCE_WIDTH * SOURCE_HEIGHT * 4; ++i) src[i] = (uint8_t) rand();
+
+    static const int sizes[][2] = {{SOURCE_WIDTH, SOURCE_HEIGHT}, {8, 8}, {17, 9}, {1, 23}, {477, 317}};
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) CheckRotation(src, sizes[i][0], sizes[i][1]);
+
+    printf("Capture of a %dx%d XRGB8888 frame to RGB565, %s kernels, %d frames\n", SOURCE_WIDTH, SOURCE_HEIGHT, pixelKernelsIsa,
+           frames);
+    printf("%-26s %12s %14s %10s\n", "capture", "ms/frame", "Mpixels/sec", "vs as is");
+    static const char *modes[] = {"as is", "rotated, blocked", "rotated 270, blocked", "rotated, pixel by pixel"};
+    CaptureResult unrotated = {};
+    for (int mode = 0; mode < 4; ++mode) {
+        CaptureResult r = BenchCapture(mode, src, dst, frames);
+        if (mode == 0) unrotated = r;
+        printf("%-26s %12.3f %14.1f %9.2fx\n", modes[mode], r.msecsPerFrame, r.mpixelsPerSec,
+               r.msecsPerFrame / unrotated.msecsPerFrame);
+    }
+
+    free(src);
+    free(dst);
+    if (mismatches) {
+        printf("FAILED: %d rotations differ from the scalar version\n", mismatches);
+        return 1;
+    }
+    printf("Blocked rotation matches the scalar version\n");
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "../config.h"
+#include "../diff.h"
+#include "../framebuffer.h"
+#include "../scaler.h"
+#include "bench.h"
+
+// Measures the capture of a 32bpp source framebuffer that differs in size from the display: the crop or scale of scaler.cpp plus the
+// conversion to RGB565, in ms per frame, for the usual 640x480 and 1280x720 sources, a source of half the display size (a whole
+// factor enlargement) and one of the display's own size for reference. Also checks the coefficient tables, that a single color
+// source scales to that same color, and that the two-channels-at-a-time filter agrees with a channel by channel evaluation.
+
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+// The source is fitted onto the display as it is before the rotation
+#define TARGET_WIDTH DISPLAY_DRAWABLE_HEIGHT
+#define TARGET_HEIGHT DISPLAY_DRAWABLE_WIDTH
+#else
+#define TARGET_WIDTH DISPLAY_DRAWABLE_WIDTH
+#define TARGET_HEIGHT DISPLAY_DRAWABLE_HEIGHT
+#endif
+
+static int failures = 0;
+
+static void Failure(const char *what, int width, int height) {
+    if (failures++ < 5) printf("%dx%d source: %s\n", width, height, what);
+}
+
+static void SetSource(uint32_t *pixels, int width, int height) {
+    SourceFramebuffer &fb = sourceFramebuffer;
+    fb.pixels = (uint8_t *) pixels;
+    fb.width = width;
+    fb.height = height;
+    fb.bitsPerPixel = 32;
+    fb.stride = width * sizeof(uint32_t);
+    fb.redShift = 16;
+    fb.greenShift = 8;
+    fb.blueShift = 0;
+    FitFramebufferToDisplay();
+}
+
+static bool CheckAxis(const ScaleAxis &axis, int srcSize, int dstSize) {
+    for (int i = 0; i < dstSize; ++i) {
+        int sum = 0;
+        for (int t = 0; t < axis.taps[i]; ++t) sum += axis.weights[i * axis.maxTaps + t];
+        if (sum != 256 || axis.taps[i] < 1 || axis.taps[i] > axis.maxTaps || axis.first[i] < 0 ||
+            axis.first[i] + axis.taps[i] > srcSize)
+            return false;
+    }
+    return true;
+}
+
+// Evaluates pixel (x, y) of the scaled image one channel at a time, with the same two rounding steps as the filter
+static uint32_t ReferencePixel(const uint32_t *src, int srcWidth, int x, int y) {
+    const ScaleAxis &h = sourceScaler.horizontal, &v = sourceScaler.vertical;
+    uint32_t px = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t sum = 0;
+        for (int th = 0; th < h.taps[x]; ++th) {
+            uint32_t column = 0;
+            for (int tv = 0; tv < v.taps[y]; ++tv)
+                column += ((src[(v.first[y] + tv) * srcWidth + h.first[x] + th] >> shift) & 0xFF) * v.weights[y * v.maxTaps + tv];
+            sum += ((column + 128) >> 8) * h.weights[x * h.maxTaps + th];
+        }
+        px |= ((sum + 128) >> 8) << shift;
+    }
+    return px;
+}
+
+static void CheckScaling(uint32_t *src, int width, int height) {
+    SetSource(src, width, height);
+    const SourceScaler &s = sourceScaler;
+    if (s.mode == SCALING_NONE) return;
+    if (!CheckAxis(s.horizontal, s.srcWidth, s.width) || !CheckAxis(s.vertical, s.srcHeight, s.height))
+        Failure("coefficient table out of bounds or weights do not add up to 256", width, height);
+
+    for (int i = 0; i < width * height; ++i) src[i] = 0x00C0FFEE;
+    ScaleSourceRegion(0, s.width, 0, s.height);
+    const uint32_t *scaled = (const uint32_t *) s.pixels;
+    for (int i = 0; i < s.width * s.height; ++i)
+        if (scaled[i] != 0x00C0FFEE) {
+            Failure("single color source does not scale to the same color", width, height);
+            break;
+        }
+
+    for (int i = 0; i < width * height; ++i) src[i] = (uint32_t) rand();
+    // In two halves, like two bands of the frame pipeline would
+    ScaleSourceRegion(0, s.width, 0, s.height / 2);
+    ScaleSourceRegion(0, s.width, s.height / 2, s.height);
+    for (int y = 0; y < s.height; ++y)
+        for (int x = 0; x < s.width; ++x) {
+            uint32_t ref = (s.mode == SCALING_FILTERED) ? ReferencePixel(src, width, x, y)
+                                                          : src[s.vertical.first[y] * width + s.horizontal.first[x]];
+            if (scaled[y * s.width + x] != ref) {
+                Failure("scaled pixel differs from the channel by channel reference", width, height);
+                return;
+            }
+        }
+}
+
+int ScaleBenchmark(int argc, char **argv) {
+    int frames = (argc >= 1) ? atoi(argv[0]) : 200;
+    failures = 0;
+
+    static const int sizes[][2] = {{640, 480}, {1280, 720}, {TARGET_WIDTH / 2, TARGET_HEIGHT / 2}, {TARGET_WIDTH, TARGET_HEIGHT}};
+    const int numSizes = sizeof(sizes) / sizeof(sizes[0]);
+    uint32_t *src = (uint32_t *) malloc(1280 * 720 * sizeof(uint32_t));
+    uint16_t *frame = (uint16_t *) calloc(FRAME_STRIDE * FRAME_HEIGHT, sizeof(uint16_t));
+    srand(1);
+
+    static const int checkSizes[][2] = {{640, 480}, {1280, 720}, {TARGET_WIDTH / 2, TARGET_HEIGHT / 2}, {97, 61}, {1000, 17}, {3, 500}};
+    for (uint32_t i = 0; i < sizeof(checkSizes) / sizeof(checkSizes[0]); ++i) CheckScaling(src, checkSizes[i][0], checkSizes[i][1]);
+
+    printf("Capture of a 32bpp source onto the %dx%d display, %d frames\n", DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT, frames);
+    printf("%-12s %-20s %-20s %-18s %12s\n", "source", "part shown", "scaled to", "scaling", "ms/frame");
+    for (int i = 0; i < numSizes; ++i) {
+        for (int p = 0; p < sizes[i][0] * sizes[i][1]; ++p) src[p] = (uint32_t) rand();
+        SetSource(src, sizes[i][0], sizes[i][1]);
+        const SourceScaler &s = sourceScaler;
+        uint64_t t0 = WallClockUsecs();
+        for (int f = 0; f < frames; ++f) CaptureFramebufferFrame(frame, FRAME_STRIDE);
+        double msecs = (WallClockUsecs() - t0) / 1e3 / frames;
+
+        static const char *modes[] = {"none", "nearest neighbour", "filtered"};
+        char source[32], shown[32], scaled[32];
+        snprintf(source, sizeof(source), "%dx%d", sizes[i][0], sizes[i][1]);
+        snprintf(shown, sizeof(shown), "%dx%d at %d,%d", s.srcWidth, s.srcHeight, s.srcX, s.srcY);
+        snprintf(scaled, sizeof(scaled), "%dx%d at %d,%d", s.width, s.height, s.x, s.y);
+        printf("%-12s %-20s %-20s %-18s %12.3f\n", source, shown, scaled, modes[s.mode], msecs);
+    }
+
+    sourceFramebuffer.pixels = 0;
+    DeinitSourceScaler();
+    free(src);
+    free(frame);
+    if (failures) {
+        printf("FAILED: %d scaling checks\n", failures);
+        return 1;
+    }
+    printf("Scaling checks passed\n");
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "../display.h"
+#include "../diff.h"
+#include "../framebuffer.h"
+#include "../pipeline.h"
+#include "../scaler.h"
+#include "../scroll.h"
+#include "../util.h"
+#include "bench.h"
+
+// Feeds a source that scrolls through a long page of text at TARGET_FRAME_RATE through the frame pipeline and the SPI thread, in
+// real time against the emulated bus, with and without hardware vertical scrolling (see scroll.h). The page scrolls along the rows
+// of the panel, which with DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE are the columns of the source. Workloads: a console that scrolls by
+// a line of text per frame, a list that scrolls smoothly a few rows per frame, and the console under a status bar that stays put.
+// Reports the source frames per second that reach the display, the bytes sent per frame and how many frames scrolled the display.
+
+#if defined(SPI_EMULATION) && defined(HARDWARE_VERTICAL_SCROLLING)
+
+#define LINE_HEIGHT 16
+#define PAGE_LINES 200
+#define STATUS_BAR_ROWS 24
+
+static uint32_t *page = 0; // PAGE_LINES lines of text, FRAME_WIDTH pixels wide, in frame orientation
+
+static void MakePage() {
+    page = (uint32_t *) malloc(PAGE_LINES * LINE_HEIGHT * FRAME_WIDTH * sizeof(uint32_t));
+    srand(1);
+    for (int line = 0; line < PAGE_LINES; ++line) {
+        // Glyph-like specks on a dark background, with a blank gap between the lines and lines of random length
+        const int length = FRAME_WIDTH / 4 + rand() % (FRAME_WIDTH * 3 / 4);
+        for (int y = 0; y < LINE_HEIGHT; ++y) {
+            uint32_t *row = page + (line * LINE_HEIGHT + y) * FRAME_WIDTH;
+            for (int x = 0; x < FRAME_WIDTH; ++x)
+                row[x] = (y >= 2 && y < LINE_HEIGHT - 2 && x < length && rand() % 3 == 0) ? 0xC0C0C0 : 0x101020;
+        }
+    }
+}
+
+// Puts a pixel at frame coordinates x, y into the source framebuffer, which is rotated onto the frame with
+// DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE (see ConvertFramebufferRows())
+static inline void PutFramePixel(uint32_t *source, int x, int y, uint32_t color) {
+#if defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && defined(DISPLAY_ROTATE_180_DEGREES)
+    source[x * FRAME_HEIGHT + FRAME_HEIGHT - 1 - y] = color;
+#elif defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE)
+    source[(FRAME_WIDTH - 1 - x) * FRAME_HEIGHT + y] = color;
+#else
+    source[y * FRAME_WIDTH + x] = color;
+#endif
+}
+
+// Shows the page scrolled down to the given row, with a status bar on top if asked for
+static void ShowPage(uint32_t *source, int pageRow, bool statusBar, uint32_t frame) {
+    for (int y = 0; y < FRAME_HEIGHT; ++y) {
+        const uint32_t *row = page + ((pageRow + y) % (PAGE_LINES * LINE_HEIGHT)) * FRAME_WIDTH;
+        for (int x = 0; x < FRAME_WIDTH; ++x)
+            PutFramePixel(source, x, y, !statusBar || y >= STATUS_BAR_ROWS ? row[x] : (x < (int) (frame % FRAME_WIDTH)) ? 0x30A050 : 0x3050A0);
+    }
+}
+
+typedef struct ScrollResult {
+    double framesPerSec; // Source frames that were captured and queued
+    double bytesPerFrame; // Queued to the bus
+    double scrolledFrames; // Percentage of the frames that scrolled the display
+} ScrollResult;
+
+static ScrollResult RunSource(uint32_t *source, int rowsPerFrame, bool statusBar, bool scroll, double seconds) {
+    detectScrolling = scroll;
+    while (!SPITaskQueueDrained()) usleep(1000);
+
+    const uint64_t interval = 1000000 / TARGET_FRAME_RATE;
+    const uint64_t start = tick(), end = start + (uint64_t) (seconds * 1e6);
+    uint64_t slot = start;
+    uint32_t shown = 0;
+    FrameDiffStatistics stats = {};
+    while (tick() < end) {
+        ShowPage(source, shown * rowsPerFrame, statusBar, shown);
+        uint64_t now = tick();
+        if (slot > now) usleep(slot - now);
+        RunFramePipeline(&stats);
+        ++shown;
+        slot = MAX(slot + interval, tick());
+    }
+    const double elapsed = (tick() - start) / 1e6;
+
+    ScrollResult result;
+    result.framesPerSec = shown / elapsed;
+    result.bytesPerFrame = shown ? (double) stats.bytesTransmitted / shown : 0;
+    result.scrolledFrames = shown ? 100.0 * stats.scrolls / shown : 0;
+    return result;
+}
+
+int ScrollBenchmark(int argc, char **argv) {
+    double seconds = (argc >= 1) ? atof(argv[0]) : 3.0;
+
+    InitSPI();
+    InitDiff();
+    MakePage();
+    uint32_t *source = (uint32_t *) calloc(FRAME_WIDTH * FRAME_HEIGHT, sizeof(uint32_t));
+    SourceFramebuffer &fb = sourceFramebuffer;
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+    fb.width = FRAME_HEIGHT;
+    fb.height = FRAME_WIDTH;
+#else
+    fb.width = FRAME_WIDTH;
+    fb.height = FRAME_HEIGHT;
+#endif
+    fb.pixels = (uint8_t *) source;
+    fb.bitsPerPixel = 32;
+    fb.stride = fb.width * sizeof(uint32_t);
+    fb.redShift = 16;
+    fb.greenShift = 8;
+    fb.blueShift = 0;
+    FitFramebufferToDisplay();
+    SetDiffRegion(capturedRegion.x, capturedRegion.endX, capturedRegion.y, capturedRegion.endY);
+    InitScrolling(capturedRegion.y, capturedRegion.endY);
+    InitFramePipeline(-1);
+
+    const double fullFrameBytes = FRAME_WIDTH * FRAME_HEIGHT * SPI_BYTESPERPIXEL;
+    printf("%.1f seconds per run, source updates at %d fps, a full %dx%d frame is %.0f bytes and takes %.1f ms on the bus\n", seconds,
+           TARGET_FRAME_RATE, FRAME_WIDTH, FRAME_HEIGHT, fullFrameBytes, fullFrameBytes * NOMINAL_SPI_USECS_PER_BYTE / 1e3);
+    printf("%-12s %-8s %10s %14s %14s %10s\n", "content", "scroll", "frames/s", "bytes/frame", "% of full", "scrolled");
+    const char *workloads[] = {"console", "list", "console+bar"};
+    const int rowsPerFrame[] = {LINE_HEIGHT, 4, LINE_HEIGHT};
+    for (int w = 0; w < 3; ++w)
+        for (int scroll = 0; scroll < 2; ++scroll) {
+            ScrollResult r = RunSource(source, rowsPerFrame[w], w == 2, scroll, seconds);
+            printf("%-12s %-8s %10.1f %14.0f %13.1f%% %9.1f%%\n", workloads[w], scroll ? "hw" : "no", r.framesPerSec, r.bytesPerFrame,
+                   100.0 * r.bytesPerFrame / fullFrameBytes, r.scrolledFrames);
+        }
+    detectScrolling = true;
+
+    while (!SPITaskQueueDrained()) usleep(1000);
+    DeinitFramePipeline();
+    sourceFramebuffer.pixels = 0;
+    DeinitSourceScaler();
+    free(source);
+    free(page);
+    page = 0;
+    DeinitDiff();
+    DeinitSPI();
+    return 0;
+}
+
+#elif defined(SPI_EMULATION)
+
+int ScrollBenchmark(int argc, char **argv) {
+    printf("Hardware vertical scrolling is not available when the display controller flips the orientation or rotates the display "
+           "by 180 degrees, build for a portrait display without DISPLAY_ROTATE_180_DEGREES, or without -DSINGLE_CORE_BOARD=ON to "
+           "flip the orientation in software\n");
+    return 1;
+}
+
+#else
+
+int ScrollBenchmark(int argc, char **argv) {
+    printf("This benchmark runs against the emulated SPI peripheral, build with -DSPI_EMULATION=ON\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "../command_table.h"
+#include "../display.h"
+#include "bench.h"
+
+// Pushes synthetic task mixes through the real AllocTask/CommitTask path, with the SPI thread started by InitSPI() running them
+// like it does in the driver. When built with SPI_EMULATION, this runs against the software register model, both at the modeled
+// bus speed and with an infinitely fast bus, the latter measuring the pure CPU overhead of the driver code. On a Pi, this drives
+// the actual display.
+
+typedef struct TaskMixResult {
+    uint64_t tasks;
+    uint64_t bytes; // Command + payload bytes of all tasks
+} TaskMixResult;
+
+static void RunTask(SPITask *task, TaskMixResult *result) {
+    CommitTask(task);
+    ++result->tasks;
+    result->bytes += task->PayloadSize() + 1;
+}
+
+static void SetCursor(int x0, int y0, int x1, int y1, TaskMixResult *result) {
+    QueueCommandWords(DISPLAY_SET_CURSOR_X, x0, x1);
+    QueueCommandWords(DISPLAY_SET_CURSOR_Y, y0, y1);
+    result->tasks += 2;
+    result->bytes += 2 * COMMAND_WORDS_QUEUED_BYTES(2);
+}
+
+static void WritePixels(int numPixels, uint8_t color, TaskMixResult *result) {
+    SPITask *task = AllocTask(numPixels * SPI_BYTESPERPIXEL);
+    task->cmd = DISPLAY_WRITE_PIXELS;
+    memset(task->data, color, task->size);
+    RunTask(task, result);
+}
+
+// Full screen update, sent row by row like ClearScreen() does
+static void FullFrameMix(uint32_t frame, TaskMixResult *result) {
+    for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+        SetCursor(0, y, DISPLAY_WIDTH - 1, DISPLAY_HEIGHT - 1, result);
+        WritePixels(DISPLAY_WIDTH, (uint8_t) frame, result);
+    }
+}
+
+// Desktop/UI style update: ~5% of the screen changes, in short horizontal spans scattered over the screen
+static void UISpansMix(uint32_t frame, TaskMixResult *result) {
+    uint32_t seed = frame * 2654435761u + 1;
+    int pixelsLeft = DISPLAY_WIDTH * DISPLAY_HEIGHT / 20;
+    while (pixelsLeft > 0) {
+        seed = seed * 1103515245u + 12345u;
+        int width = 8 + (seed >> 16) % 57;
+        int x = (seed >> 8) % (DISPLAY_WIDTH - width);
+        int y = (seed >> 4) % DISPLAY_HEIGHT;
+        SetCursor(x, y, DISPLAY_WIDTH - 1, DISPLAY_HEIGHT - 1, result);
+        WritePixels(width, (uint8_t) frame, result);
+        pixelsLeft -= width;
+    }
+}
+
+// Command-heavy stream: cursor windows followed by single pixel writes, the worst case for per-task overhead
+static void CommandHeavyMix(uint32_t frame, TaskMixResult *result) {
+    for (int i = 0; i < 1000; ++i) {
+        SetCursor(i % DISPLAY_WIDTH, (i + frame) % DISPLAY_HEIGHT, DISPLAY_WIDTH - 1, DISPLAY_HEIGHT - 1, result);
+        WritePixels(1, (uint8_t) frame, result);
+    }
+}
+
+// Waits until the SPI thread has sent out all queued tasks
+static void WaitForQueueToDrain() {
+    while (!SPITaskQueueDrained())
+        usleep(100);
+}
+
+typedef struct TaskMix {
+    const char *name;
+    void (*run)(uint32_t frame, TaskMixResult *result);
+} TaskMix;
+
+static const TaskMix taskMixes[] = {
+    {"full-frame", FullFrameMix},
+    {"ui-spans", UISpansMix},
+    {"command-heavy", CommandHeavyMix},
+};
+
+static void RunTaskMix(const TaskMix &mix, const char *busName, uint64_t minDurationUsecs) {
+    TaskMixResult result = {};
+    uint32_t frames = 0;
+#ifdef SPI_EMULATION
+    uint64_t busBytes0 = emulatedSPIStatistics.bytesClocked;
+#endif
+    uint64_t t0 = WallClockUsecs();
+    uint64_t c0 = ReadCycleCounter();
+    uint64_t elapsed;
+    do {
+        mix.run(frames++, &result);
+        elapsed = WallClockUsecs() - t0;
+    } while (elapsed < minDurationUsecs);
+    WaitForQueueToDrain();
+    elapsed = WallClockUsecs() - t0;
+    uint64_t cycles = ReadCycleCounter() - c0;
+
+    double secs = elapsed / 1e6;
+    printf("%-14s %-10s %7u %10.3f %12.0f %12.2f", mix.name, busName, frames, result.bytes / secs / 1e6,
+           result.tasks / secs, (double) cycles / result.bytes);
+#ifdef SPI_EMULATION
+    // Whatever wall time was not spent clocking out bytes is the fixed per-task overhead that SPI_TASK_OVERHEAD_BYTES models,
+    // as long as the main thread produces tasks faster than the bus sends them out.
+    double nsecsPerByte = EmulatedNsecsPerByte();
+    if (nsecsPerByte > 0.0) {
+        double idleNsecs = elapsed * 1e3 - (emulatedSPIStatistics.bytesClocked - busBytes0) * nsecsPerByte;
+        printf(" %12.1f", idleNsecs / nsecsPerByte / result.tasks);
+    }
+#endif
+    printf("\n");
+}
+
+int SPIThroughputBenchmark(int argc, char **argv) {
+    uint64_t minDurationUsecs = (argc >= 1) ? (uint64_t) (atof(argv[0]) * 1e6) : 1000000;
+
+    InitSPI();
+
+    printf("%-14s %-10s %7s %10s %12s %12s %12s\n", "task mix", "bus", "frames", "MB/sec", "tasks/sec", cycleCounterUnit,
+           "idle bytes");
+    printf("%-14s %-10s %7s %10s %12s %12s %12s\n", "", "", "", "", "", "per byte", "per task");
+    const int numMixes = sizeof(taskMixes) / sizeof(taskMixes[0]);
+    for (int i = 0; i < numMixes; ++i) {
+#ifdef SPI_EMULATION
+        char busName[32];
+        SetEmulatedCoreFrequency(EMULATED_CORE_FREQUENCY_HZ);
+        snprintf(busName, sizeof(busName), "%.1fMHz", 8 * 1e3 / EmulatedNsecsPerByte());
+        RunTaskMix(taskMixes[i], busName, minDurationUsecs);
+        SetEmulatedCoreFrequency(0);
+        RunTaskMix(taskMixes[i], "unlimited", minDurationUsecs);
+#else
+        RunTaskMix(taskMixes[i], "hardware", minDurationUsecs);
+#endif
+    }
+
+#ifdef SPI_EMULATION
+    printf("\nBus totals: %llu bytes clocked (%llu with D/C low), %llu D/C toggles, %llu TX FIFO overruns\n",
+           (unsigned long long) emulatedSPIStatistics.bytesClocked,
+           (unsigned long long) emulatedSPIStatistics.commandBytesClocked,
+           (unsigned long long) emulatedSPIStatistics.dataControlToggles,
+           (unsigned long long) emulatedSPIStatistics.fifoOverruns);
+#endif
+    printf("Main thread waited for room in the SPI queue %u times, %.3f seconds in total\n", spiTaskMemory->producerStalls,
+           spiTaskMemory->producerStallUsecs / 1e6);
+
+    DeinitSPI();
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "../display.h"
+#include "../diff.h"
+#include "../framebuffer.h"
+#include "../pipeline.h"
+#include "../scaler.h"
+#include "../util.h"
+#include "bench.h"
+
+// Feeds a source that updates at TARGET_FRAME_RATE, faster than the emulated bus can keep up with, through the frame pipeline and
+// the SPI thread in real time, with and without superseding stale writes in the queue (see supersedeStaleWrites). Interlacing is
+// off, so that the queue backs up. The source either changes the whole screen every frame, or a few UI-sized areas. Reports how far
+// behind the source the display runs (the bus time of what is queued when a frame has been queued), and the bytes superseded.
+
+#ifdef SPI_EMULATION
+
+#define NUM_FRAMES 3
+
+static void FillRandom(uint32_t *pixels, int width, int x0, int y0, int x1, int y1) {
+    for (int y = y0; y < y1; ++y)
+        for (int x = x0; x < x1; ++x)
+            pixels[y * width + x] = (uint32_t) rand();
+}
+
+typedef struct SupersedeResult {
+    double framesPerSec; // Source frames that were captured and queued
+    double meanLatencyMsecs, maxLatencyMsecs; // Bus time of the queue after each frame was queued
+    double supersededMegabytesPerSec;
+    double sentMegabytesPerSec; // Bytes that went out on the bus
+} SupersedeResult;
+
+static SupersedeResult RunSource(uint32_t *frames[NUM_FRAMES], bool supersede, double seconds) {
+    supersedeStaleWrites = supersede;
+    while (!SPITaskQueueDrained()) usleep(1000);
+
+    const uint64_t interval = 1000000 / TARGET_FRAME_RATE;
+    const uint64_t start = tick(), end = start + (uint64_t) (seconds * 1e6);
+    const uint32_t superseded0 = spiTaskMemory->spiBytesSuperseded;
+    const uint32_t done0 = __atomic_load_n(&spiTaskMemory->spiBytesDone, __ATOMIC_RELAXED);
+    const uint32_t skipped0 = __atomic_load_n(&spiTaskMemory->spiBytesSkipped, __ATOMIC_RELAXED);
+    uint64_t slot = start;
+    uint32_t shown = 0;
+    double latencySum = 0, maxLatency = 0;
+    FrameDiffStatistics stats = {};
+    while (tick() < end) {
+        uint64_t now = tick();
+        if (slot > now) usleep(slot - now);
+        sourceFramebuffer.pixels = (uint8_t *) frames[shown % NUM_FRAMES];
+        RunFramePipeline(&stats);
+        ++shown;
+        const double latency = SPIBytesQueued() * NOMINAL_SPI_USECS_PER_BYTE / 1e3;
+        latencySum += latency;
+        maxLatency = MAX(maxLatency, latency);
+        slot = MAX(slot + interval, tick());
+    }
+    const double elapsed = (tick() - start) / 1e6;
+
+    SupersedeResult result;
+    result.framesPerSec = shown / elapsed;
+    result.meanLatencyMsecs = shown ? latencySum / shown : 0;
+    result.maxLatencyMsecs = maxLatency;
+    result.supersededMegabytesPerSec = (uint32_t) (spiTaskMemory->spiBytesSuperseded - superseded0) / elapsed / 1e6;
+    const uint32_t skipped = __atomic_load_n(&spiTaskMemory->spiBytesSkipped, __ATOMIC_ACQUIRE);
+    const uint32_t done = __atomic_load_n(&spiTaskMemory->spiBytesDone, __ATOMIC_RELAXED);
+    result.sentMegabytesPerSec = (uint32_t) (done - done0 - (skipped - skipped0)) / elapsed / 1e6;
+    return result;
+}
+
+int SupersedeBenchmark(int argc, char **argv) {
+    double seconds = (argc >= 1) ? atof(argv[0]) : 3.0;
+
+    InitSPI();
+    InitDiff();
+    uint32_t *frames[NUM_FRAMES];
+    for (int i = 0; i < NUM_FRAMES; ++i) frames[i] = (uint32_t *) malloc(FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint32_t));
+    SourceFramebuffer &fb = sourceFramebuffer;
+    fb.width = FRAME_WIDTH;
+    fb.height = FRAME_HEIGHT;
+    fb.bitsPerPixel = 32;
+    fb.stride = FRAME_WIDTH * sizeof(uint32_t);
+    fb.redShift = 16;
+    fb.greenShift = 8;
+    fb.blueShift = 0;
+    FitFramebufferToDisplay();
+    InitFramePipeline(-1);
+    const int interlacing = frameInterlacing;
+    frameInterlacing = INTERLACING_NEVER;
+
+    const double fullFrameMsecs = FRAME_WIDTH * FRAME_HEIGHT * SPI_BYTESPERPIXEL * NOMINAL_SPI_USECS_PER_BYTE / 1e3;
+    printf("%.1f seconds per run, source updates at %d fps, a full %dx%d frame takes %.1f ms on the bus\n", seconds,
+           TARGET_FRAME_RATE, FRAME_WIDTH, FRAME_HEIGHT, fullFrameMsecs);
+    printf("%-10s %-10s %10s %16s %16s %18s %12s\n", "changes", "supersede", "frames/s", "mean latency ms", "max latency ms",
+           "superseded MB/s", "sent MB/s");
+    const char *workloads[] = {"full", "ui"};
+    for (int w = 0; w < 2; ++w) {
+        srand(1);
+        FillRandom(frames[0], FRAME_WIDTH, 0, 0, FRAME_WIDTH, FRAME_HEIGHT);
+        for (int i = 1; i < NUM_FRAMES; ++i) {
+            if (w == 0) FillRandom(frames[i], FRAME_WIDTH, 0, 0, FRAME_WIDTH, FRAME_HEIGHT);
+            else {
+                // A text caret row, a progress bar and a clock in different parts of the screen, as in the pipeline benchmark
+                uint32_t *f = frames[i];
+                memcpy(f, frames[0], FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint32_t));
+                FillRandom(f, FRAME_WIDTH, FRAME_WIDTH / 8, FRAME_HEIGHT / 4, FRAME_WIDTH * 7 / 8, FRAME_HEIGHT / 4 + FRAME_HEIGHT / 20);
+                FillRandom(f, FRAME_WIDTH, 0, FRAME_HEIGHT * 3 / 4, FRAME_WIDTH / 2, FRAME_HEIGHT * 3 / 4 + FRAME_HEIGHT / 16);
+                FillRandom(f, FRAME_WIDTH, FRAME_WIDTH * 3 / 4, 0, FRAME_WIDTH, FRAME_HEIGHT / 10);
+            }
+        }
+        for (int supersede = 0; supersede < 2; ++supersede) {
+            SupersedeResult r = RunSource(frames, supersede, seconds);
+            printf("%-10s %-10s %10.1f %16.1f %16.1f %18.2f %12.2f\n", workloads[w], supersede ? "yes" : "no", r.framesPerSec,
+                   r.meanLatencyMsecs, r.maxLatencyMsecs, r.supersededMegabytesPerSec, r.sentMegabytesPerSec);
+        }
+    }
+    frameInterlacing = interlacing;
+    supersedeStaleWrites = true;
+
+    while (!SPITaskQueueDrained()) usleep(1000);
+    DeinitFramePipeline();
+    sourceFramebuffer.pixels = 0;
+    DeinitSourceScaler();
+    for (int i = 0; i < NUM_FRAMES; ++i) free(frames[i]);
+    DeinitDiff();
+    DeinitSPI();
+    return 0;
+}
+
+#else
+
+int SupersedeBenchmark(int argc, char **argv) {
+    printf("This benchmark runs against the emulated SPI peripheral, build with -DSPI_EMULATION=ON\n");
+    return 1;
+}
+
+#endif
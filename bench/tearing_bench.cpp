@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../spi.h"
+#include "../dma.h"
+#include "../display.h"
+#include "../tearing.h"
+#include "../util.h"
+#include "bench.h"
+
+// Streams pixel writes that each cover a band of the native rows of the panel, top to bottom over and over like video, against the
+// emulated SPI peripheral and a simulated panel that raises its tearing effect (TE) line at the start of each refresh. The writes
+// are sent without synchronization, after waiting for the TE edge (vsync-then-send), and beam raced with WaitUntilTearFree() (see
+// tearing.h). For each, reports the bus throughput, the share of writes that the simulated beam crossed while they were being sent
+// (i.e. tore), and how long each write was held back on average.
+
+#ifdef SPI_EMULATION
+
+// Any free pin will do, the simulated panel drives it
+#define TE_PIN 27
+#define PANEL_REFRESH_HZ 61.7
+#define PANEL_VBLANK_USECS 250
+
+#define SYNC_OFF 0
+#define SYNC_VSYNC 1
+#define SYNC_BEAM_RACING 2
+
+static bool consumerRunning = false;
+static int syncMode = SYNC_OFF;
+static int bandRows = 0;
+static uint32_t writes = 0, tornWrites = 0;
+static uint64_t heldUsecs = 0;
+
+// The display rectangle whose pixels are on native rows a..b
+static void NativeRowsToDisplayRect(int a, int b, int *x0, int *y0, int *x1, int *y1) {
+#ifdef DISPLAY_ROTATE_180_DEGREES_IN_HARDWARE
+    const int top = DISPLAY_NATIVE_HEIGHT - 1 - b, bottom = DISPLAY_NATIVE_HEIGHT - 1 - a;
+#else
+    const int top = a, bottom = b;
+#endif
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_HARDWARE
+    *x0 = top, *x1 = bottom, *y0 = 0, *y1 = DISPLAY_HEIGHT - 1;
+#else
+    *x0 = 0, *x1 = DISPLAY_WIDTH - 1, *y0 = top, *y1 = bottom;
+#endif
+}
+
+static bool BeamOnRows(uint64_t usecs, int a, int b) {
+    const int row = EmulatedPanelScanline(usecs);
+    return row >= a && row <= b;
+}
+
+// Whether the simulated beam crossed the native rows a..b while they were being written from start to end, by the same rule that
+// WaitUntilTearFree() avoids: the beam may not be on the rows at all, or if the write runs in the scan order, not enter them.
+static bool BeamCrossed(uint64_t start, uint64_t end, int a, int b) {
+    bool wasOnRows = BeamOnRows(start, a, b);
+#ifdef TEARING_EFFECT_WRITES_CROSS_SCAN_ORDER
+    if (wasOnRows) return true;
+#endif
+    for (uint64_t t = start + 10; t <= end; t += 10) {
+        const bool onRows = BeamOnRows(t, a, b);
+        if (onRows && !wasOnRows) return true;
+        wasOnRows = onRows;
+    }
+    return false;
+}
+
+static void *ConsumerThread(void *unused) {
+    int band = 0;
+    while (__atomic_load_n(&consumerRunning, __ATOMIC_RELAXED)) {
+        SPITask *task = GetTask();
+        if (!task) {
+            usleep(20);
+            continue;
+        }
+        const bool pixels = task->cmd == DISPLAY_WRITE_PIXELS;
+        const uint64_t ready = tick();
+        if (syncMode == SYNC_BEAM_RACING) WaitUntilTearFree(task);
+        else if (syncMode == SYNC_VSYNC && pixels) {
+            while (GET_GPIO(TE_PIN)) /*nop*/;
+            while (!GET_GPIO(TE_PIN)) /*nop*/;
+        }
+        const uint64_t start = tick();
+        RunSPITask(task);
+        const uint64_t end = tick();
+        DoneTask(task);
+        if (!pixels) continue;
+        const int a = band * bandRows, b = MIN(a + bandRows, DISPLAY_NATIVE_HEIGHT) - 1;
+        band = (b + 1 < DISPLAY_NATIVE_HEIGHT) ? band + 1 : 0;
+        ++writes;
+        if (BeamCrossed(start, end, a, b)) ++tornWrites;
+        heldUsecs += start - ready;
+    }
+    return 0;
+}
+
+static void RunStream(int mode, int rows, uint64_t durationUsecs) {
+    ResetSPITaskQueue();
+    InvalidateDisplayCursor(&displayCursor);
+    syncMode = mode;
+    bandRows = rows;
+    writes = tornWrites = 0;
+    heldUsecs = 0;
+    consumerRunning = true;
+    pthread_t thread;
+    pthread_create(&thread, NULL, ConsumerThread, NULL);
+
+    const uint64_t busNsecs0 = emulatedSPIStatistics.busActiveNsecs;
+    const uint64_t t0 = WallClockUsecs();
+    for (int a = 0; WallClockUsecs() - t0 < durationUsecs; a = (a + rows < DISPLAY_NATIVE_HEIGHT) ? a + rows : 0) {
+        int x0, y0, x1, y1;
+        NativeRowsToDisplayRect(a, MIN(a + rows, DISPLAY_NATIVE_HEIGHT) - 1, &x0, &y0, &x1, &y1);
+        // One write per band, so that the consumer can tell which band each write is. No DISPLAY_WRITE_PIXELS_CONTINUE, since the
+        // next band does not continue from where this one leaves off, and force a fresh window with each band for the same reason.
+        InvalidateDisplayCursor(&displayCursor);
+        SPITask *task = QueueWritePixels(&displayCursor, x0, y0, x1, y1, 0);
+        memset(task->data, a, task->size);
+        CommitTask(task);
+    }
+    while (!SPITaskQueueDrained()) usleep(100);
+    const uint64_t elapsed = WallClockUsecs() - t0;
+    __atomic_store_n(&consumerRunning, false, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+
+    static const char *modes[] = {"off", "vsync", "beam racing"};
+    const uint32_t bandBytes = rows * DISPLAY_NATIVE_WIDTH * SPI_BYTESPERPIXEL;
+    printf("%-12s %5d %10.1f %12.3f %10.1f%% %12.2f\n", modes[mode], rows, bandBytes * NOMINAL_SPI_USECS_PER_BYTE / 1e3,
+           (emulatedSPIStatistics.busActiveNsecs - busNsecs0) / (double) elapsed / EmulatedNsecsPerByte(),
+           writes ? 100.0 * tornWrites / writes : 0.0, writes ? heldUsecs / 1e3 / writes : 0.0);
+}
+
+int TearingBenchmark(int argc, char **argv) {
+    uint64_t durationUsecs = (argc >= 1) ? (uint64_t) (atof(argv[0]) * 1e6) : 1000000;
+
+    // Set up the peripheral and the task queue like InitSPI() does, but without starting the SPI thread, the consumer above runs
+    // the tasks instead.
+    ResetSPIEmulation();
+    spi = &emulatedSPIRegisters;
+    gpio = &emulatedGPIORegisters;
+    spi->cs = BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
+    spi->clk = SPI_BUS_CLOCK_DIVISOR;
+    spi->dlen = 2; // 8 clocks per byte, see UNLOCK_FAST_8_CLOCKS_SPI() in spi.cpp
+    spiTaskMemory = (SharedMemory *) calloc(1, SHARED_MEMORY_SIZE);
+#ifdef USE_DMA_TRANSFERS
+    dmaMinTaskBytes = 0xFFFFFFFFu; // Send with polled SPI, which needs no DMA memory set up
+#endif
+    BEGIN_SPI_COMMUNICATION();
+
+    SetEmulatedTearingEffect(TE_PIN, PANEL_REFRESH_HZ, PANEL_VBLANK_USECS);
+    if (!InitTearingEffectSync(TE_PIN)) return 1;
+    printf("Simulated panel refreshes at %.2f Hz, SPI bus clocked at %.2f MHz\n", PANEL_REFRESH_HZ, 8 * 1e3 / EmulatedNsecsPerByte());
+    printf("%-12s %5s %10s %12s %11s %12s\n", "sync", "rows", "write ms", "bus MB/s", "torn", "held ms");
+    const int bandSizes[] = {4, 16, 40};
+    for (int i = 0; i < 3; ++i)
+        for (int mode = SYNC_OFF; mode <= SYNC_BEAM_RACING; ++mode)
+            RunStream(mode, bandSizes[i], durationUsecs);
+    printf("Beam racing sent %u writes without waiting that were too long to avoid the beam\n",
+           __atomic_load_n(&tearingEffectStatistics.writesTooLong, __ATOMIC_RELAXED));
+
+    SetEmulatedTearingEffect(TE_PIN, 0, 0);
+    free(spiTaskMemory);
+    spiTaskMemory = 0;
+    return 0;
+}
+
+#else
+
+int TearingBenchmark(int argc, char **argv) {
+    printf("This benchmark runs against the emulated SPI peripheral, build with -DSPI_EMULATION=ON\n");
+    return 1;
+}
+
+#endif
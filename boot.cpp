@@ -0,0 +1,51 @@
+#include "config.h"
+#include "boot.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static const char *const bootPhaseNames[NUM_BOOT_PHASES] = {
+    "peripherals and task queue",
+    "display reset",
+    "display init commands",
+    "GRAM clear",
+    "tearing effect calibration",
+    "capture and pipeline setup",
+    "first frame",
+};
+
+static uint64_t bootStart = 0;
+static uint64_t phaseBegin[NUM_BOOT_PHASES], phaseEnd[NUM_BOOT_PHASES];
+
+// Not tick(), which is only usable once InitSPI() has mapped the system timer
+static uint64_t BootClockUsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void StartBootTimer() {
+    bootStart = BootClockUsecs();
+}
+
+void BeginBootPhase(BootPhase phase) {
+    phaseBegin[phase] = BootClockUsecs();
+}
+
+void EndBootPhase(BootPhase phase) {
+    phaseEnd[phase] = BootClockUsecs();
+}
+
+void LogBootTimes() {
+    if (!bootStart || !phaseEnd[BOOT_FIRST_FRAME]) return;
+#ifdef FAST_BOOT
+    const char *mode = "FAST_BOOT";
+#else
+    const char *mode = "without FAST_BOOT";
+#endif
+    printf("Time to first frame %.1f msecs (%s):\n", (phaseEnd[BOOT_FIRST_FRAME] - bootStart) / 1000.0, mode);
+    for (int i = 0; i < NUM_BOOT_PHASES; ++i)
+        if (phaseEnd[i])
+            printf("  %-28s %8.1f msecs, from %7.1f to %7.1f msecs\n", bootPhaseNames[i], (phaseEnd[i] - phaseBegin[i]) / 1000.0,
+                   (phaseBegin[i] - bootStart) / 1000.0, (phaseEnd[i] - bootStart) / 1000.0);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Time to first frame: the phases of startup are timed from the start of the program until the first captured frame has been sent to
+// the display, and logged once it has, so that startup time can be tracked across releases. With FAST_BOOT, the display is brought up
+// on the SPI thread while the main thread sets up the framebuffer capture and the frame pipeline, so phases of the two threads overlap,
+// and the log shows when each of them began and ended.
+
+typedef enum BootPhase {
+    BOOT_PERIPHERALS, // Mapping the SPI and GPIO peripherals, setting up DMA and the task queue
+    BOOT_DISPLAY_RESET, // Reset pulse of the display controller, until it accepts commands
+    BOOT_DISPLAY_COMMANDS, // Initialization commands of the display controller, and the delays among them
+    BOOT_GRAM_CLEAR, // Clearing the garbage that GRAM holds after reset
+    BOOT_TEARING_EFFECT_CALIBRATION, // Measuring the refresh period of the panel, with GPIO_TFT_TEARING_EFFECT
+    BOOT_CAPTURE_SETUP, // Framebuffer capture, diffing and the frame pipeline
+    BOOT_FIRST_FRAME, // From capturing the first frame until all of it has been sent to the display
+    NUM_BOOT_PHASES
+} BootPhase;
+
+#ifdef KERNEL_MODULE
+
+// The kernel module brings up the display when it is loaded, there is no first frame to time
+#define BeginBootPhase(phase) ((void) 0)
+#define EndBootPhase(phase) ((void) 0)
+
+#else
+
+// Marks the start of the program, that the phases are timed from. Nothing is logged unless called.
+void StartBootTimer(void);
+
+// Called at the beginning and at the end of each phase, on the thread that runs it. Phases that are not run are left out of the log.
+void BeginBootPhase(BootPhase phase);
+void EndBootPhase(BootPhase phase);
+
+// Prints the breakdown of the time to first frame, once BOOT_FIRST_FRAME has ended and the display thread has finished its phases
+void LogBootTimes(void);
+
+#endif
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <inttypes.h>
+#include <memory.h>
+
+#include "display.h"
+#include "spi.h"
+
+// Display commands that are fixed at compile time, such as the initialization sequence of the controller, are listed as a command
+// table type, and encoded by the compiler into a single constant byte array, exactly as the bytes go out on the bus: on displays
+// with a 16-bit bus (DISPLAY_SPI_BUS_IS_16BITS_WIDE), each parameter byte is padded to 16 bits here rather than by hand at every
+// call site. RunCommandTable() then streams the array through the bus in one pass, without allocating or copying tasks. E.g.
+//
+//     typedef CommandTable<DisplayCommand<0x11/*Sleep OUT*/>, CommandDelayMsecs<120>, DisplayCommand<0x3A, 0x55>> Commands;
+//     RunCommandTable<Commands>();
+//
+// Encoded, each command is the number of parameter bytes that follow the command byte on the bus, the command byte, and the
+// parameter bytes. A count of COMMAND_TABLE_DELAY (see spi.h) is a delay instead, followed by its length in msecs.
+
+// A sequence of bytes as a type, so that sequences can be joined at compile time
+template<uint8_t... Bytes>
+struct CommandBytes {
+    static constexpr uint32_t size = sizeof...(Bytes);
+    static constexpr uint8_t bytes[sizeof...(Bytes) ? sizeof...(Bytes) : 1] = {Bytes...};
+};
+
+template<uint8_t... Bytes>
+constexpr uint8_t CommandBytes<Bytes...>::bytes[];
+
+template<class... Sequences>
+struct JoinCommandBytes;
+
+template<>
+struct JoinCommandBytes<> {
+    typedef CommandBytes<> type;
+};
+
+template<uint8_t... A>
+struct JoinCommandBytes<CommandBytes<A...>> {
+    typedef CommandBytes<A...> type;
+};
+
+template<uint8_t... A, uint8_t... B, class... Rest>
+struct JoinCommandBytes<CommandBytes<A...>, CommandBytes<B...>, Rest...> {
+    typedef typename JoinCommandBytes<CommandBytes<A..., B...>, Rest...>::type type;
+};
+
+template<uint8_t Param>
+struct CommandParam {
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+    typedef CommandBytes<0x00, Param> type;
+#else
+    typedef CommandBytes<Param> type;
+#endif
+};
+
+template<uint8_t Command, uint8_t... Params>
+struct DisplayCommand {
+    typedef typename JoinCommandBytes<CommandBytes<(uint8_t) (sizeof...(Params) * SPI_BYTES_PER_COMMAND_WORD), Command>,
+                                      typename CommandParam<Params>::type...>::type type;
+};
+
+template<uint8_t Msecs>
+struct CommandDelayMsecs {
+    typedef CommandBytes<COMMAND_TABLE_DELAY, Msecs> type;
+};
+
+// The encoded commands of the table are in bytes[0..size-1]
+template<class... Commands>
+struct CommandTable : JoinCommandBytes<typename Commands::type...>::type {
+};
+
+template<class Table>
+static inline void RunCommandTable() {
+    RunCommandTable(Table::bytes, Table::size);
+}
+
+// Writes a parameter byte of a command as it goes out on the bus, and returns the position after it
+static inline uint8_t *EncodeCommandParam(uint8_t *out, uint8_t param) {
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+    *out++ = 0x00;
+#endif
+    *out++ = param;
+    return out;
+}
+
+// Largest payload of a compound task, room for a few cursor or scroll commands
+#define COMPOUND_TASK_MAX_BYTES 64
+
+// Small commands queued with QueueCommandWords() between BeginCompoundTask() and EndCompoundTask() are packed into one compound task
+// (SPI_TASK_COMPOUND), e.g. the column and the page window before a pixel write. Nothing else may be queued in between. Compound
+// tasks hold only commands that the producers do not supersede, and a single command is queued as a task of its own.
+static inline void BeginCompoundTask() {
+    if (!packCompoundTasks) return;
+    SPITask *task = AllocTask(COMPOUND_TASK_MAX_BYTES);
+    task->cmd = SPI_TASK_COMPOUND;
+    task->size = 0; // Grows as commands are added, AllocTask() has made room for the most it can take
+    spiTaskProducer.compound = task;
+}
+
+static inline void EndCompoundTask() {
+    SPITask *task = spiTaskProducer.compound;
+    if (!task) return;
+    spiTaskProducer.compound = 0;
+    if (!task->size) return; // Never committed, the next task takes its place
+    if (task->size == 2u + task->data[0]) {
+        task->cmd = task->data[1];
+        task->size = task->data[0];
+        memmove(task->data, task->data + 2, task->size);
+    }
+    CommitTask(task);
+}
+
+// Queues a command whose parameters are 16-bit values only known at run time, such as the start and end of a cursor window, each
+// sent high byte first. The parameters are encoded straight into the task, or into the compound task being packed.
+template<class... Words>
+static inline void QueueCommandWords(uint8_t command, Words... words) {
+    const uint16_t values[] = {(uint16_t) words...};
+    const uint32_t paramBytes = sizeof...(Words) * 2 * SPI_BYTES_PER_COMMAND_WORD;
+    SPITask *compound = spiTaskProducer.compound;
+    if (compound && compound->size + 2 + paramBytes > COMPOUND_TASK_MAX_BYTES) {
+        EndCompoundTask();
+        BeginCompoundTask();
+        compound = spiTaskProducer.compound;
+    }
+    uint8_t *out;
+    SPITask *task = 0;
+    if (compound) {
+        out = compound->data + compound->size;
+        *out++ = (uint8_t) paramBytes;
+        *out++ = command;
+        compound->size += 2 + paramBytes;
+    } else {
+        task = AllocTask(paramBytes);
+        task->cmd = command;
+        out = task->data;
+    }
+    for (uint32_t i = 0; i < sizeof...(Words); ++i) {
+        out = EncodeCommandParam(out, (uint8_t) (values[i] >> 8));
+        out = EncodeCommandParam(out, (uint8_t) (values[i] & 0xFF));
+    }
+    if (task) CommitTask(task);
+}
+
+// Number of bytes that QueueCommandWords() adds to the queue with the given number of parameters, in the same units as
+// SPIBytesQueued(): the command and the parameter bytes
+#define COMMAND_WORDS_QUEUED_BYTES(numWords) (1 + (numWords) * 2 * SPI_BYTES_PER_COMMAND_WORD)
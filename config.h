@@ -41,6 +41,10 @@
 // If enabled, the main thread and SPI thread are executed with realtime priority
 // #define RUN_WITH_REALTIME_THREAD_PRIORITY
 
+// By default, frames are updated progressively as long as the SPI bus keeps up, and switch to interlacing
+// (sending only the even or the odd changed rows of each frame, in turn) while more is queued than the bus
+// can send in one frame interval. No row is left behind for more than two frames.
+
 // If defined, progressive updating is always used (at the expense of slowing down refresh rate if it's
 // too much for the display to handle)
 // #define NO_INTERLACING
@@ -50,8 +54,8 @@
 
 // By default, if the SPI bus is idle after rendering an interlaced frame, but the GPU has not yet produced
 // a new application frame to be displayed, the same frame will be rendered again for its other field.
-// Define this option to disable this behavior, in which case when an interlaced frame is rendered, the 
-// remaining other field half of the image will never be uploaded.
+// Define this option to disable this behavior, in which case when an interlaced frame is rendered, the
+// remaining other field half of the image is only uploaded along with the next frame.
 // #define THROTTLE_INTERLACING
 
 // The ILI9486 has to resort to interlacing as a rule rather than exception, and it works much smoother
@@ -83,28 +87,55 @@
 
 
 // If per-pixel diffing is enabled (neither UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF or UPDATE_FRAMES_WITHOUT_DIFFING
-// are enabled), the following variable controls whether to lean towards more precise pixel diffing, or faster, but
-// coarser pixel diffing. Coarse method is twice as fast than the precise method, but submits slightly more pixels.
-// In most cases it is better to use the coarse method, since the increase in pixel counts is small (~5%-10%),
-// so enabled by default. If your display is very constrained on SPI bus speed, and don't mind increased
-// CPU consumption, comment this out to use the precise algorithm.
-#define FAST_BUT_COARSE_PIXEL_DIFF
-
-// If defined, the GPU polling thread will be put to sleep for 1/TARGET_FRAMERATE seconds after receiving
-// each new GPU frame, to wait for the earliest moment that the next frame could arrive.
+// are enabled), the following variable makes the diff lossy: a pixel whose color has changed by less than the
+// thresholds below in each of its RGB565 channels is treated as unchanged, and the display keeps showing the old
+// color. Video, camera sources and dithered gradients change nearly every pixel by a bit or two each frame, which
+// an exact diff has to send in full. The changes are measured against what the display shows, so a pixel that keeps
+// drifting a little each frame is sent once the drift adds up to the threshold, and no pixel is ever shown further
+// off than that. Leave this commented out to send every change exactly.
+// #define FAST_BUT_COARSE_PIXEL_DIFF
+
+// Changes in a channel of at least this many steps (out of 31 for red and blue, 63 for green) are always sent with
+// FAST_BUT_COARSE_PIXEL_DIFF.
+#define COARSE_PIXEL_DIFF_RED_THRESHOLD 2
+#define COARSE_PIXEL_DIFF_GREEN_THRESHOLD 3
+#define COARSE_PIXEL_DIFF_BLUE_THRESHOLD 2
+
+// Number of worker threads that capture, diff and encode bands of each frame in parallel (see pipeline.h). If not
+// defined, one worker per CPU core is started on multicore Pis, and frames are processed on the main thread alone on
+// single core boards. Define as 0 to always process frames on the main thread.
+// #define FRAME_PIPELINE_WORKERS 4
+
+// If defined, frames are checked for content that has scrolled vertically since the previous frame, such as a console,
+// a list or a log, and the display is scrolled in hardware to match, so that only the rows that scroll into view are
+// sent rather than the whole scrolled area. Has no effect with DISPLAY_FLIP_ORIENTATION_IN_HARDWARE, or with
+// DISPLAY_ROTATE_180_DEGREES on a display that is not rotated in software, where the display controller does not
+// scroll along the rows of the display. See scroll.h.
+#define HARDWARE_VERTICAL_SCROLLING
+
+// If defined, the display is brought up with the minimum reset and Sleep Out delays of the controller datasheet
+// rather than generous ones, and on the SPI thread, so that the delays pass while the main thread sets up the
+// framebuffer capture and the frame pipeline. The driver logs how long it took to get the first frame on the
+// display, phase by phase (see boot.h). Comment this out if a display does not come up reliably.
+#define FAST_BOOT
+
+// If defined, the source framebuffer is polled on a fixed grid of 1/TARGET_FRAME_RATE second slots, and the
+// main loop sleeps until the next slot after each frame. Otherwise it is polled four times per slot. See pacing.h.
 #define SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
 
 // Detects when the activity on the screen is mostly idle, and goes to low power mode, in which new
 // frames will be polled first at 10fps, and ultimately at only 2fps.
 #define SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
 
-// Builds a histogram of observed frame intervals and uses that to sync to a known update rate. This aims
-// to detect if an application uses a non-60Hz update rate, and synchronizes to that instead.
+// Learns the update interval and phase of the source from the times that new frames were observed at, and
+// captures right after the next frame is due to arrive. This aims to detect if an application uses a non-60Hz
+// update rate, and synchronizes to that instead.
 #define SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
 
 // If defined, rotates the display 180 degrees. This might not rotate the panel scan order though,
 // so adding this can cause up to one vsync worth of extra display latency. It is best to avoid this and
-// install the display in its natural rotation order, if possible.
+// install the display in its natural rotation order, if possible. With DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE,
+// the frame is rotated 270 degrees in software instead of 90, which keeps the writes in panel scan order.
 // #define DISPLAY_ROTATE_180_DEGREES
 
 // If defined, displays in landscape. Undefine to display in portrait.
@@ -132,7 +163,8 @@
 // probably no other displays in existence?) allow one to adjust the direction that the scanline refresh
 // cycle runs in, but the scanline refresh always runs in portrait mode in these displays. Not having
 // this defined reduces CPU usage at the expense of more tearing, although it is debatable which
-// effect is better - this can be subjective. Impact is around 0.5-1.0msec of extra CPU time.
+// effect is better - this can be subjective. Impact is around 0.5-1.0msec of extra CPU time. Rotates 90
+// degrees clockwise, or 270 degrees with DISPLAY_ROTATE_180_DEGREES.
 // DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE disabled: diagonal tearing
 // DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE enabled: traditional no-vsync tearing (tear line runs in portrait
 // i.e. narrow direction)
@@ -142,6 +174,8 @@
 
 // If enabled, build to utilize DMA transfers to communicate with the SPI peripheral. Otherwise polling
 // writes will be performed (possibly with interrupts, if using kernel side driver module)
+// (Set by CMake, see the USE_DMA_TRANSFERS option)
+// #define USE_DMA_TRANSFERS
 
 // If defined, enables code to manage the backlight.
 // #define BACKLIGHT_CONTROL
@@ -173,3 +207,8 @@
 // driving thread. Otherwise, let the kernel drive SPI (e.g. via interrupts or its own thread)
 // This should be unset, only available for debugging.
 // #define KERNEL_MODULE_CLIENT_DRIVES
+
+#if defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE_CLIENT_DRIVES)
+// The kernel module owns the SPI peripheral and runs the SPI tasks, and this program only queues them up.
+#define KERNEL_MODULE_RUNS_SPI_TASKS
+#endif
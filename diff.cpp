@@ -0,0 +1,251 @@
+#include "config.h"
+#include "diff.h"
+#include "display.h"
+#include "mem_alloc.h"
+#include "pixels.h"
+#include "util.h"
+
+#include <memory.h>
+#include <stdlib.h>
+
+uint16_t *framebuffer[2] = {};
+Span *spans = 0;
+
+// Scratch of DiffFramebuffersToSpans(), see DiffFramebufferRowsToSpans()
+static int *openSpans = 0;
+
+// See SetDiffRegion()
+static int diffX = 0, diffEndX = FRAME_WIDTH, diffY = 0, diffEndY = FRAME_HEIGHT;
+
+// See SetDiffField(). rowAge counts the interlaced diffs in a row that have left each row out, and rowLeftOut marks the rows that
+// the latest diff did not look at, for SwapFramebuffers().
+#define MAX_ROW_AGE 1
+static int diffField = DIFF_ALL_ROWS;
+static uint8_t *rowAge = 0;
+static uint8_t *rowLeftOut = 0;
+
+// Scratch of ScrollPreviousFrame(), room for half of the rows of a frame
+static uint16_t *scrollScratch = 0;
+
+void InitDiff() {
+    for (int i = 0; i < 2; ++i) {
+        // Both frames start out black, which is what InitSPI() clears the display GRAM to.
+        framebuffer[i] = (uint16_t *) Malloc(FRAME_STRIDE * FRAME_HEIGHT * sizeof(uint16_t), "diff.cpp framebuffer");
+        memset(framebuffer[i], 0, FRAME_STRIDE * FRAME_HEIGHT * sizeof(uint16_t));
+    }
+    openSpans = (int *) Malloc(2 * MAX_SPANS_PER_ROW * sizeof(int), "diff.cpp open spans");
+    spans = (Span *) Malloc(MAX_SPANS_PER_ROW * FRAME_HEIGHT * sizeof(Span), "diff.cpp spans");
+    rowAge = (uint8_t *) Malloc(FRAME_HEIGHT, "diff.cpp row ages");
+    rowLeftOut = (uint8_t *) Malloc(FRAME_HEIGHT, "diff.cpp left out rows");
+    scrollScratch = (uint16_t *) Malloc(FRAME_HEIGHT / 2 * FRAME_STRIDE * sizeof(uint16_t), "diff.cpp scroll scratch");
+    memset(rowAge, 0, FRAME_HEIGHT);
+    memset(rowLeftOut, 0, FRAME_HEIGHT);
+    diffField = DIFF_ALL_ROWS;
+}
+
+void DeinitDiff() {
+    for (int i = 0; i < 2; ++i) {
+        free(framebuffer[i]);
+        framebuffer[i] = 0;
+    }
+    free(openSpans);
+    openSpans = 0;
+    free(spans);
+    spans = 0;
+    free(rowAge);
+    rowAge = 0;
+    free(rowLeftOut);
+    rowLeftOut = 0;
+    free(scrollScratch);
+    scrollScratch = 0;
+}
+
+void SetDiffRegion(int x, int endX, int y, int endY) {
+    diffX = x;
+    diffEndX = endX;
+    diffY = y;
+    diffEndY = endY;
+}
+
+void SetDiffField(int field) {
+    diffField = field;
+}
+
+// Whether DiffFramebufferRowsToSpans() looks at row y, and the age of the row after the diff
+static inline bool DiffsRow(int y) {
+    if (diffField == DIFF_ALL_ROWS) return true;
+    if (diffField == DIFF_LEFT_OUT_ROWS) return rowAge[y] > 0;
+    return (y & 1) == diffField || rowAge[y] >= MAX_ROW_AGE;
+}
+
+#ifdef FAST_BUT_COARSE_PIXEL_DIFF
+
+#ifdef DISPLAY_SWAP_BGR
+#define COARSE_TOP_THRESHOLD COARSE_PIXEL_DIFF_BLUE_THRESHOLD
+#define COARSE_BOTTOM_THRESHOLD COARSE_PIXEL_DIFF_RED_THRESHOLD
+#else
+#define COARSE_TOP_THRESHOLD COARSE_PIXEL_DIFF_RED_THRESHOLD
+#define COARSE_BOTTOM_THRESHOLD COARSE_PIXEL_DIFF_BLUE_THRESHOLD
+#endif
+
+// Sets the pixels in x..endX-1 of the new row whose change is below the thresholds in every channel back to their color on the
+// previous row, so that the searches that follow see them unchanged. Counts them, and raises *maxError to the largest channel
+// difference among them. Returns whether any pixel was set back.
+static bool IgnoreSmallChanges(uint16_t *a, const uint16_t *b, int x, int endX, uint32_t *ignoredPixels, uint32_t *maxError) {
+    bool ignored = false;
+    for (x = FindFirstChangedPixel(a, b, x, endX); x < endX; x = FindFirstChangedPixel(a, b, x + 1, endX)) {
+        // Back from the big endian byte order they are sent in. Inverted colors differ by the same amounts.
+        const int p = (uint16_t) ((a[x] >> 8) | (a[x] << 8)), q = (uint16_t) ((b[x] >> 8) | (b[x] << 8));
+        const int top = ABS((p >> 11) - (q >> 11)), g = ABS(((p >> 5) & 0x3F) - ((q >> 5) & 0x3F));
+        const int bottom = ABS((p & 0x1F) - (q & 0x1F));
+        if (top >= COARSE_TOP_THRESHOLD || g >= COARSE_PIXEL_DIFF_GREEN_THRESHOLD || bottom >= COARSE_BOTTOM_THRESHOLD) continue;
+        a[x] = b[x];
+        ++*ignoredPixels;
+        *maxError = MAX(*maxError, (uint32_t) MAX(MAX(top, g), bottom));
+        ignored = true;
+    }
+    return ignored;
+}
+
+#endif
+
+int DiffFramebuffersToSpans(uint16_t *newFrame, const uint16_t *prevFrame, FrameDiffStatistics *stats) {
+    return DiffFramebufferRowsToSpans(newFrame, prevFrame, 0, FRAME_HEIGHT, spans, openSpans, stats);
+}
+
+int DiffFramebufferRowsToSpans(uint16_t *newFrame, const uint16_t *prevFrame, int startY, int endY, Span *spans,
+                               int *openSpansScratch, FrameDiffStatistics *stats) {
+    int numSpans = 0;
+    int numOpen = 0;
+    // Indices to spans that reach down to the row currently being diffed, sorted by x. These can still grow downwards.
+    int *open = openSpansScratch;
+    int *nextOpen = openSpansScratch + MAX_SPANS_PER_ROW;
+    uint32_t changedPixels = 0;
+    uint32_t coarsePixels = 0, maxCoarseError = 0;
+    startY = MAX(startY, diffY);
+    endY = MIN(endY, diffEndY);
+
+    for (int y = startY; y < endY; ++y) {
+        // Rows that are left out break the spans that reach down to them
+        rowLeftOut[y] = !DiffsRow(y);
+        if (rowLeftOut[y]) {
+            if (diffField != DIFF_LEFT_OUT_ROWS) ++rowAge[y];
+            numOpen = 0;
+            continue;
+        }
+        rowAge[y] = 0;
+        uint16_t *a = newFrame + y * FRAME_STRIDE;
+        const uint16_t *b = prevFrame + y * FRAME_STRIDE;
+        int numNextOpen = 0;
+        int o = 0; // Walks the spans open from the previous row in x order
+        int rowEndX = 0; // Right edge of the spans so far on this row, spans must not overlap
+        // Scanning in from both ends finds the first and last changed columns, and skips unchanged rows with a single pass. Runs
+        // are searched for between them only, and x == FRAME_WIDTH stands for no more runs on the row.
+        int changedEndX = FindChangedPixelsEnd(a, b, diffX, diffEndX);
+        int x = (changedEndX > diffX) ? FindFirstChangedPixel(a, b, diffX, changedEndX) : FRAME_WIDTH;
+#ifdef FAST_BUT_COARSE_PIXEL_DIFF
+        if (x < FRAME_WIDTH && IgnoreSmallChanges(a, b, x, changedEndX, &coarsePixels, &maxCoarseError)) {
+            changedEndX = FindChangedPixelsEnd(a, b, x, changedEndX);
+            x = (changedEndX > x) ? FindFirstChangedPixel(a, b, x, changedEndX) : FRAME_WIDTH;
+        }
+#endif
+        while (x < FRAME_WIDTH) {
+            int endX = FindFirstUnchangedPixel(a, b, x, changedEndX);
+            changedPixels += endX - x;
+            int nextX = (endX < changedEndX) ? FindFirstChangedPixel(a, b, endX, changedEndX) : FRAME_WIDTH;
+
+            // Resending the unchanged pixels in between two runs is cheaper than addressing a new span if the gap is small.
+            while (nextX < FRAME_WIDTH && (nextX - endX) * SPI_BYTESPERPIXEL <= SPAN_READDRESS_COST_BYTES) {
+                endX = FindFirstUnchangedPixel(a, b, nextX, changedEndX);
+                changedPixels += endX - nextX;
+                nextX = (endX < changedEndX) ? FindFirstChangedPixel(a, b, endX, changedEndX) : FRAME_WIDTH;
+            }
+
+            // Likewise, grow the overlapping span directly above to cover this run, if the unchanged pixels that the widened
+            // rectangle would add cost less than addressing a new span. Identical columns are always joined.
+            while (o < numOpen && spans[open[o]].endX <= x) ++o;
+            Span *s = 0;
+            if (o < numOpen && spans[open[o]].x < endX) {
+                Span *above = &spans[open[o]];
+                int ux = MIN(x, above->x), uEndX = MAX(endX, above->endX);
+                int wastedPixels = (uEndX - ux - (above->endX - above->x)) * (above->endY - above->y) + (uEndX - ux - (endX - x));
+                // Spans must not overlap: the union must stay clear of the neighboring runs on this row, and if it widens the span
+                // above, of the neighboring spans on the previous row. Only single row spans are widened, since for taller ones
+                // the spans that neighbor them on the rows further up are no longer tracked.
+                bool widens = ux < above->x || uEndX > above->endX;
+                int prevOpenEndX = (o > 0) ? spans[open[o - 1]].endX : 0;
+                int nextOpenX = (o + 1 < numOpen) ? spans[open[o + 1]].x : FRAME_WIDTH;
+                bool fits = ux >= rowEndX && uEndX <= nextX &&
+                            (!widens || (above->endY - above->y == 1 && ux >= prevOpenEndX && uEndX <= nextOpenX));
+                if (fits && wastedPixels * SPI_BYTESPERPIXEL <= SPAN_READDRESS_COST_BYTES) {
+                    s = above;
+                    ++o;
+                    s->x = ux;
+                    s->endX = uEndX;
+                    ++s->endY;
+                    s->size = (s->endX - s->x) * (s->endY - s->y);
+                }
+            }
+            if (!s) {
+                s = &spans[numSpans++];
+                s->x = x;
+                s->endX = endX;
+                s->y = y;
+                s->endY = y + 1;
+                s->size = endX - x;
+            }
+            rowEndX = s->endX;
+            nextOpen[numNextOpen++] = (int) (s - spans);
+            x = nextX;
+        }
+        numOpen = numNextOpen;
+        int *t = open;
+        open = nextOpen;
+        nextOpen = t;
+    }
+
+    if (stats) {
+        stats->changedPixels = changedPixels;
+        stats->spans = numSpans;
+        stats->coarsePixels = coarsePixels;
+        stats->maxCoarseError = maxCoarseError;
+    }
+    return numSpans;
+}
+
+// Rotates the given rows of rowBytes bytes each up by the given number of rows, parking the rows that wrap around in scrollScratch
+static void RotateRows(uint8_t *rows, int numRows, int rowBytes, int up) {
+    const int down = numRows - up;
+    if (up <= down) {
+        memcpy(scrollScratch, rows, up * rowBytes);
+        memmove(rows, rows + up * rowBytes, down * rowBytes);
+        memcpy(rows + down * rowBytes, scrollScratch, up * rowBytes);
+    } else {
+        memcpy(scrollScratch, rows + up * rowBytes, down * rowBytes);
+        memmove(rows + down * rowBytes, rows, up * rowBytes);
+        memcpy(rows, scrollScratch, down * rowBytes);
+    }
+}
+
+void ScrollPreviousFrame(int y, int endY, int rows) {
+    const int numRows = endY - y;
+    rows = ((rows % numRows) + numRows) % numRows;
+    if (!rows) return;
+    RotateRows((uint8_t *) (framebuffer[1] + y * FRAME_STRIDE), numRows, FRAME_STRIDE * sizeof(uint16_t), rows);
+    RotateRows(rowAge + y, numRows, 1, rows);
+}
+
+void SwapFramebuffers() {
+    for (int y = diffY; y < diffEndY; ++y)
+        if (rowLeftOut[y]) {
+            uint16_t *a = framebuffer[0] + y * FRAME_STRIDE + diffX, *b = framebuffer[1] + y * FRAME_STRIDE + diffX;
+            for (int x = 0; x < diffEndX - diffX; ++x) {
+                const uint16_t p = a[x];
+                a[x] = b[x];
+                b[x] = p;
+            }
+        }
+    uint16_t *t = framebuffer[0];
+    framebuffer[0] = framebuffer[1];
+    framebuffer[1] = t;
+}
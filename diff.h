@@ -0,0 +1,76 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "display.h"
+
+// A rectangular region of changed pixels, in drawable display coordinates. x and y are inclusive, endX and endY exclusive.
+typedef struct Span {
+    int x, endX, y, endY;
+    int size; // Number of pixels in the span, (endX-x)*(endY-y)
+} Span;
+
+typedef struct FrameDiffStatistics {
+    uint32_t changedPixels; // Number of pixels that differed from the previous frame
+    uint32_t spans; // Number of rectangular spans the changed pixels were grouped into
+    uint32_t bytesTransmitted; // Command + payload bytes of all tasks queued to update the display
+    uint32_t interlacedFrames; // Number of frames that were updated as a single field, see SetDiffField()
+    uint32_t scrolls; // Number of frames that scrolled the display in hardware, see scroll.h
+    uint32_t coarsePixels; // Number of changed pixels that FAST_BUT_COARSE_PIXEL_DIFF treated as unchanged
+    uint32_t maxCoarseError; // Largest difference, in steps of a RGB565 channel, between such a pixel and what the display shows
+} FrameDiffStatistics;
+
+// Width and height of the diffed frames, and the number of uint16_t pixels between two rows of a frame
+#define FRAME_WIDTH DISPLAY_DRAWABLE_WIDTH
+#define FRAME_HEIGHT DISPLAY_DRAWABLE_HEIGHT
+#define FRAME_STRIDE DISPLAY_DRAWABLE_WIDTH
+
+// Two frames of RGB565 pixels in the byte order they are sent to the display. framebuffer[0] receives the new frame,
+// framebuffer[1] holds what was last sent to the display.
+extern uint16_t *framebuffer[2];
+
+// At most every other pixel on a row can start a new run of changed pixels
+#define MAX_SPANS_PER_ROW ((FRAME_WIDTH + 1) / 2)
+
+// Pre-allocated storage for the spans of one frame, room for MAX_SPANS_PER_ROW spans per row
+extern Span *spans;
+
+void InitDiff(void);
+
+void DeinitDiff(void);
+
+// Limits the diff to columns x..endX-1 of rows y..endY-1, the part of the frame that the source framebuffer is shown in. The
+// letterbox or pillarbox bars outside of it were cleared to black along with the rest of the display, never change, and are not
+// looked at again. The whole frame is diffed by default.
+void SetDiffRegion(int x, int endX, int y, int endY);
+
+// Interlaced updates: with field 0 or 1, the diffs that follow only look at the even or odd rows respectively, plus the rows that
+// the previous diff left out, so that no row of the display lags behind the captured frames by more than two frames. Rows that
+// are left out keep what the display shows through SwapFramebuffers(), so their changes are picked up by a later diff.
+// DIFF_LEFT_OUT_ROWS diffs only the rows that the previous diff left out, DIFF_ALL_ROWS (the default) every row.
+#define DIFF_ALL_ROWS -1
+#define DIFF_LEFT_OUT_ROWS 2
+void SetDiffField(int field);
+
+// Compares the new frame against the previous one, and produces a set of non-overlapping rectangular spans that cover all
+// changed pixels: runs of changed pixels on each row, joined into rectangles with the runs on the rows above. Unchanged pixels
+// are included in a span whenever sending them takes less bus time than addressing a new span would (SPAN_READDRESS_COST_BYTES),
+// so the result minimizes total bus time rather than the number of pixels sent. Returns the number of spans written to the
+// spans array. With FAST_BUT_COARSE_PIXEL_DIFF, the pixels of the new frame whose change is below the thresholds in config.h are
+// set back to their previous color first, so that the new frame holds what the display shows once the spans are sent.
+int DiffFramebuffersToSpans(uint16_t *newFrame, const uint16_t *prevFrame, FrameDiffStatistics *stats);
+
+// Like DiffFramebuffersToSpans(), but only diffs rows startY..endY-1 (spans do not extend outside of them) into the given array,
+// which must have room for MAX_SPANS_PER_ROW spans per row. openSpansScratch must hold 2*MAX_SPANS_PER_ROW ints. Bands of rows
+// can be diffed in parallel, as long as each uses its own scratch and span storage, e.g. spans + startY*MAX_SPANS_PER_ROW.
+int DiffFramebufferRowsToSpans(uint16_t *newFrame, const uint16_t *prevFrame, int startY, int endY, Span *spans,
+                               int *openSpansScratch, FrameDiffStatistics *stats);
+
+// Moves rows y..endY-1 of the previous frame up by the given number of rows, with the rows at the top wrapping around to the bottom,
+// along with whether the rows are due for a diff (see SetDiffField()), to match the display after it has been scrolled in hardware.
+void ScrollPreviousFrame(int y, int endY, int rows);
+
+// Makes the new frame the previous frame for the next diff, to be called after the spans of a frame have been submitted. Rows that
+// the diff left out (see SetDiffField()) are swapped back, so the previous frame keeps their old content, and the new frame holds
+// the content that was captured for them.
+void SwapFramebuffers(void);
@@ -1,45 +1,260 @@
 #include "config.h"
 #include "display.h"
 #include "spi.h"
+#include "command_table.h"
+#include "diff.h"
+#include "scroll.h"
+#include "util.h"
 
 #include <memory.h>
 
-void ClearScreen()
-{
-  for(int y = 0; y < DISPLAY_HEIGHT; ++y)
-  {
-    SPI_TRANSFER(DISPLAY_SET_CURSOR_X, 0, 0, 0, 0, 0, (DISPLAY_WIDTH-1) >> 8, 0, (DISPLAY_WIDTH-1) & 0xFF);
-    SPI_TRANSFER(DISPLAY_SET_CURSOR_Y, 0, (uint8_t)(y >> 8), 0, (uint8_t)(y & 0xFF), 0, (DISPLAY_HEIGHT-1) >> 8, 0, (DISPLAY_HEIGHT-1) & 0xFF);
+DisplayCursorState displayCursor = {-1, -1, -1, -1, -1, -1};
 
-    SPITask *clearLine = AllocTask(DISPLAY_WIDTH*SPI_BYTESPERPIXEL);
-    clearLine->cmd = DISPLAY_WRITE_PIXELS;
-    memset(clearLine->data, 0, clearLine->size);
-    CommitTask(clearLine);
-    RunSPITask(clearLine);
-    DoneTask(clearLine);
-  }
-  SPI_TRANSFER(DISPLAY_SET_CURSOR_X, 0, 0, 0, 0, 0, (DISPLAY_WIDTH-1) >> 8, 0, (DISPLAY_WIDTH-1) & 0xFF);
-  SPI_TRANSFER(DISPLAY_SET_CURSOR_Y, 0, 0, 0, 0, 0, (DISPLAY_HEIGHT-1) >> 8, 0, (DISPLAY_HEIGHT-1) & 0xFF);
+bool supersedeStaleWrites = true;
+
+// A pixel write task queued by QueueWritePixels() that may still be waiting in the queue
+typedef struct QueuedWrite {
+    SPITask *task;
+    uint32_t bytesCommittedEnd; // spiBytesCommitted with the task committed, the task is done once spiBytesDone gets there
+    uint32_t frame; // See BeginFrameWrites()
+    int x0, y0, x1, y1; // Display pixels that the task writes, inclusive
+    bool continues; // Continues from where the write before it left off, so needs that one to be sent
+    bool superseded;
+} QueuedWrite;
+
+// Ring of the queued writes, oldest first. The oldest are forgotten when it fills up, which only happens with frames of many small
+// spans, whose writes are unlikely to be covered by a single span of a later frame anyway.
+#define MAX_QUEUED_WRITES 1024
+static QueuedWrite queuedWrites[MAX_QUEUED_WRITES];
+static int queuedWritesStart = 0, numQueuedWrites = 0;
+static uint32_t writeFrame = 0;
+
+static inline QueuedWrite &QueuedWriteAt(int i) {
+    return queuedWrites[(queuedWritesStart + i) % MAX_QUEUED_WRITES];
+}
+
+void BeginFrameWrites() {
+    ++writeFrame;
+}
+
+void InvalidateDisplayCursor(DisplayCursorState *cursor) {
+    cursor->x0 = cursor->x1 = cursor->y0 = cursor->y1 = -1;
+    cursor->writeX = cursor->writeY = -1;
+}
+
+// Number of bytes a cursor window command adds to the queue: the start and the end coordinate
+#define CURSOR_COMMAND_QUEUED_BYTES COMMAND_WORDS_QUEUED_BYTES(2)
+
+SPITask *QueueWritePixels(DisplayCursorState *cursor, int x0, int y0, int x1, int y1, uint32_t *bytesQueued) {
+    uint32_t bytes = 0;
+
+#ifdef DISPLAY_WRITE_PIXELS_CONTINUE
+    // A write can continue from the write pointer if it starts there and its pixels wrap at the edges of the current window the
+    // same way they would in a window of its own: either it spans the full window width, or it fits on the row it starts on.
+    const bool continues = cursor->writeX == x0 && cursor->writeY == y0 && y1 <= cursor->y1 &&
+                           ((x0 == cursor->x0 && x1 == cursor->x1) || (y0 == y1 && x1 <= cursor->x1));
+#else
+    const bool continues = false;
+#endif
+
+    if (!continues) {
+        // ILI9486 ignores partially sent commands (MUST_SEND_FULL_CURSOR_WINDOW), so both the start and the end coordinates are
+        // always sent, and a command can only be skipped altogether. The two go out packed into one compound task.
+        BeginCompoundTask();
+        if (cursor->x0 != x0 || cursor->x1 != x1) {
+            QueueCommandWords(DISPLAY_SET_CURSOR_X, x0, x1);
+            cursor->x0 = x0;
+            cursor->x1 = x1;
+            bytes += CURSOR_COMMAND_QUEUED_BYTES;
+        }
+
+        // Pixels wrap to the next row at the right edge of the column window, so the page window only needs to start at the
+        // right row and extend far enough down. Leave it open to the bottom of the display, so that the next write starting on
+        // the same row (e.g. another span further right) does not need a new page window.
+        if (cursor->y0 != y0 || cursor->y1 < y1) {
+            QueueCommandWords(DISPLAY_SET_CURSOR_Y, y0, DISPLAY_HEIGHT - 1);
+            cursor->y0 = y0;
+            cursor->y1 = DISPLAY_HEIGHT - 1;
+            bytes += CURSOR_COMMAND_QUEUED_BYTES;
+        }
+        EndCompoundTask();
+    }
+
+    const uint32_t numPixels = (x1 - x0 + 1) * (y1 - y0 + 1);
+    SPITask *task = AllocTask(numPixels * SPI_BYTESPERPIXEL);
+#ifdef DISPLAY_WRITE_PIXELS_CONTINUE
+    task->cmd = continues ? DISPLAY_WRITE_PIXELS_CONTINUE : DISPLAY_WRITE_PIXELS;
+#else
+    task->cmd = DISPLAY_WRITE_PIXELS;
+#endif
+    bytes += 1 + task->PayloadSize();
+
+    if (numQueuedWrites == MAX_QUEUED_WRITES) {
+        queuedWritesStart = (queuedWritesStart + 1) % MAX_QUEUED_WRITES;
+        --numQueuedWrites;
+    }
+    QueuedWrite &w = QueuedWriteAt(numQueuedWrites++);
+    w.task = task;
+    w.bytesCommittedEnd = spiTaskProducer.bytesCommitted + task->PayloadSize() + 1; // The caller commits it next
+    w.frame = writeFrame;
+    w.x0 = x0;
+    w.y0 = y0;
+    w.x1 = x1;
+    w.y1 = y1;
+    w.continues = continues;
+    w.superseded = false;
+
+    // DISPLAY_WRITE_PIXELS starts from the top left corner of the window. Advance the write pointer past the written pixels,
+    // wrapping at the right edge of the window. Past the bottom of the window the controller wraps back to the top, which is
+    // never where the next write wants to continue from, so just mark the pointer unknown.
+    cursor->writeX = x1 + 1;
+    cursor->writeY = y1;
+    if (cursor->writeX > cursor->x1) {
+        cursor->writeX = cursor->x0;
+        ++cursor->writeY;
+    }
+    if (cursor->writeY > cursor->y1) cursor->writeX = cursor->writeY = -1;
+
+    if (bytesQueued) *bytesQueued += bytes;
+    return task;
+}
+
+void ClearScreen() {
+    // Stream the whole display in as one pixel write into a full screen window, split into chunks that continue each other.
+    const int rowsPerTask = PIXEL_TASK_ROWS(DISPLAY_WIDTH);
+    BeginTaskBatch();
+    for (int y = 0; y < DISPLAY_HEIGHT; y += rowsPerTask) {
+        SPITask *clear = QueueWritePixels(&displayCursor, 0, y, DISPLAY_WIDTH - 1,
+                                          MIN(y + rowsPerTask, DISPLAY_HEIGHT) - 1, 0);
+        memset(clear->data, 0, clear->size);
+        CommitTask(clear);
+    }
+    EndTaskBatch();
+}
+
+typedef CommandTable<
+    DisplayCommand<DISPLAY_SET_CURSOR_X, 0, 0, (uint8_t) ((DISPLAY_WIDTH - 1) >> 8), (uint8_t) ((DISPLAY_WIDTH - 1) & 0xFF)>,
+    DisplayCommand<DISPLAY_SET_CURSOR_Y, 0, 0, (uint8_t) ((DISPLAY_HEIGHT - 1) >> 8), (uint8_t) ((DISPLAY_HEIGHT - 1) & 0xFF)>
+> FullScreenWindowCommands;
+
+void ClearGRAM() {
+    RunCommandTable<FullScreenWindowCommands>();
+    RunFillCommand(DISPLAY_WRITE_PIXELS, 0, DISPLAY_WIDTH * DISPLAY_HEIGHT * SPI_BYTESPERPIXEL);
 }
 
 void RandomizeScreen() {
-    for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
-        SPI_TRANSFER(DISPLAY_SET_CURSOR_X, 0, 0, 0, 0, 0, (DISPLAY_WIDTH - 1) >> 8, 0, (DISPLAY_WIDTH - 1) & 0xFF);
-        SPI_TRANSFER(DISPLAY_SET_CURSOR_Y, 0, (uint8_t) (y >> 8), 0, (uint8_t) (y & 0xFF), 0, (DISPLAY_HEIGHT - 1) >> 8,
-                     0, (DISPLAY_HEIGHT - 1) & 0xFF);
+    const int rowsPerTask = PIXEL_TASK_ROWS(DISPLAY_WIDTH);
+    BeginTaskBatch();
+    for (int y = 0; y < DISPLAY_HEIGHT; y += rowsPerTask) {
+        const int endY = MIN(y + rowsPerTask, DISPLAY_HEIGHT);
+        SPITask *noise = QueueWritePixels(&displayCursor, 0, y, DISPLAY_WIDTH - 1, endY - 1, 0);
+        uint8_t *data = noise->data;
+        for (int row = y; row < endY; ++row) {
+            uint32_t seed = (uint32_t) tick() * row;
+            for (int i = 0; i < DISPLAY_WIDTH * SPI_BYTESPERPIXEL; ++i)
+                *data++ = (uint8_t) (seed + i);
+        }
+        CommitTask(noise);
+    }
+    EndTaskBatch();
+}
 
-        SPITask *clearLine = AllocTask(DISPLAY_WIDTH * SPI_BYTESPERPIXEL);
-        clearLine->cmd = DISPLAY_WRITE_PIXELS;
+// Supersedes the queued writes of earlier frames that the given rectangle of display pixels (inclusive) covers, before the writes of
+// the rectangle are queued. See supersedeStaleWrites.
+static void SupersedeCoveredWrites(int x0, int y0, int x1, int y1) {
+    const uint32_t done = __atomic_load_n(&spiTaskMemory->spiBytesDone, __ATOMIC_RELAXED);
+    // Superseded writes at the front are dropped too, so that the head frame is the one that the SPI thread sends next
+    while (numQueuedWrites &&
+           ((int32_t) (done - QueuedWriteAt(0).bytesCommittedEnd) >= 0 || QueuedWriteAt(0).superseded)) {
+        queuedWritesStart = (queuedWritesStart + 1) % MAX_QUEUED_WRITES;
+        --numQueuedWrites;
+    }
+    if (!supersedeStaleWrites || !numQueuedWrites) return;
 
-        for (int i = 0; i < DISPLAY_WIDTH; ++i)
-            clearLine->data[i] = tick() * y + i;
+    // Newest first, to know whether the write after each one continues from it. A write that a kept write continues from must be
+    // sent too, or the continuing write would land in the wrong place.
+    const uint32_t headFrame = QueuedWriteAt(0).frame;
+    bool followerContinues = false;
+    for (int i = numQueuedWrites - 1; i >= 0; --i) {
+        QueuedWrite &w = QueuedWriteAt(i);
+        if (w.frame == headFrame) break;
+        if (w.frame != writeFrame && !w.superseded && !followerContinues && w.x0 >= x0 && w.x1 <= x1 && w.y0 >= y0 &&
+            w.y1 <= y1) {
+            if (!SupersedeTask(w.task)) break; // The SPI thread has got this far
+            w.superseded = true;
+            // The write pointer no longer ends up where the shadow state has it, so the next write must address the cursor
+            if (i == numQueuedWrites - 1) displayCursor.writeX = displayCursor.writeY = -1;
+        }
+        followerContinues = w.continues && !w.superseded;
+    }
+}
+
+// End of the chunk of rows of the span that starts at row y: at most PIXEL_TASK_ROWS rows, and not across the frame row at which
+// the rows wrap around in GRAM after a hardware scroll (see ScrollWrapRow()).
+static inline int SpanChunkEndY(const Span &s, int y, int wrapY) {
+    const int endY = MIN(y + PIXEL_TASK_ROWS(s.endX - s.x), s.endY);
+    return (y < wrapY && endY > wrapY) ? wrapY : endY;
+}
 
-//    memset(clearLine->data, 0, clearLine->size);
-        CommitTask(clearLine);
-        RunSPITask(clearLine);
-        DoneTask(clearLine);
+// Queues the cursor commands and allocates the pixel write task for rows y..endY-1 of the given span, at the GRAM rows that they
+// have been scrolled to.
+static inline SPITask *QueueSpanRows(const Span &s, int y, int endY, int wrapY, uint32_t *bytes) {
+    const int gramY = DISPLAY_COVERED_TOP_SIDE + ScrolledFrameRow(y);
+    // The parts of the span on either side of the wrap row are apart in GRAM, so each supersedes the writes that it covers by itself
+    if (y == s.y || y == wrapY) {
+        const int partEndY = (y < wrapY) ? MIN(s.endY, wrapY) : s.endY;
+        SupersedeCoveredWrites(DISPLAY_COVERED_LEFT_SIDE + s.x, gramY, DISPLAY_COVERED_LEFT_SIDE + s.endX - 1, gramY + partEndY - y - 1);
     }
-    SPI_TRANSFER(DISPLAY_SET_CURSOR_X, 0, 0, 0, 0, 0, (DISPLAY_WIDTH - 1) >> 8, 0, (DISPLAY_WIDTH - 1) & 0xFF);
-    SPI_TRANSFER(DISPLAY_SET_CURSOR_Y, 0, 0, 0, 0, 0, (DISPLAY_HEIGHT - 1) >> 8, 0, (DISPLAY_HEIGHT - 1) & 0xFF);
+    return QueueWritePixels(&displayCursor, DISPLAY_COVERED_LEFT_SIDE + s.x, gramY, DISPLAY_COVERED_LEFT_SIDE + s.endX - 1,
+                            gramY + endY - y - 1, bytes);
 }
 
+static inline void CopySpanRows(SPITask *task, const Span &s, int y, int endY, const uint16_t *frame, int frameStride) {
+    const int width = s.endX - s.x;
+    uint8_t *data = task->data;
+    for (int row = y; row < endY; ++row, data += width * SPI_BYTESPERPIXEL)
+        memcpy(data, frame + row * frameStride + s.x, width * SPI_BYTESPERPIXEL);
+}
+
+uint32_t SubmitSpans(const Span *spans, int numSpans, const uint16_t *frame, int frameStride) {
+    uint32_t bytes = 0;
+    const int wrapY = ScrollWrapRow();
+    // Small spans take only a few bytes each, publish them to the SPI thread in batches rather than one task at a time.
+    BeginTaskBatch();
+    for (int i = 0; i < numSpans; ++i) {
+        const Span &s = spans[i];
+
+        // Large spans are sent in chunks of rows. All chunks after the first, as well as a span that sits directly below another
+        // span of the same width, continue where the previous write left off without re-addressing the cursor.
+        for (int y = s.y, endY; y < s.endY; y = endY) {
+            endY = SpanChunkEndY(s, y, wrapY);
+            SPITask *task = QueueSpanRows(s, y, endY, wrapY, &bytes);
+            CopySpanRows(task, s, y, endY, frame, frameStride);
+            CommitTask(task);
+        }
+    }
+    EndTaskBatch();
+    return bytes;
+}
+
+int ReserveSpans(const Span *spans, int numSpans, SpanTask *tasks, uint32_t *bytesQueued) {
+    int numTasks = 0;
+    const int wrapY = ScrollWrapRow();
+    for (int i = 0; i < numSpans; ++i) {
+        const Span &s = spans[i];
+        for (int y = s.y; y < s.endY; y = tasks[numTasks - 1].endY) {
+            SpanTask &t = tasks[numTasks++];
+            t.span = &s;
+            t.y = y;
+            t.endY = SpanChunkEndY(s, y, wrapY);
+            t.task = QueueSpanRows(s, t.y, t.endY, wrapY, bytesQueued);
+            CommitTask(t.task);
+        }
+    }
+    return numTasks;
+}
+
+void FillSpanTasks(const SpanTask *tasks, int numTasks, const uint16_t *frame, int frameStride) {
+    for (int i = 0; i < numTasks; ++i)
+        CopySpanRows(tasks[i].task, *tasks[i].span, tasks[i].y, tasks[i].endY, frame, frameStride);
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <inttypes.h>
+
 #include "config.h"
 
 // Configure the desired display update rate. Use 120 for max performance/minimized latency, and 60/50/30/24 etc. for regular content, or to save battery.
@@ -28,6 +30,18 @@
 #undef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
 #endif
 
+// When the frame is rotated in software anyway, it is rotated 270 degrees instead of 90 to turn the display upside down, which keeps
+// the display rows the native rows of the panel in scan order. Otherwise the controller rotates its memory access by 180 degrees.
+#if defined(DISPLAY_ROTATE_180_DEGREES) && !defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE)
+#define DISPLAY_ROTATE_180_DEGREES_IN_HARDWARE
+#endif
+
+// The controller scrolls its native rows, which are only the rows of the display if the controller does not flip the orientation,
+// and counts the scroll start address in the order that the panel scans them, which 180 degree rotation reverses
+#if defined(HARDWARE_VERTICAL_SCROLLING) && (defined(DISPLAY_FLIP_ORIENTATION_IN_HARDWARE) || defined(DISPLAY_ROTATE_180_DEGREES_IN_HARDWARE))
+#undef HARDWARE_VERTICAL_SCROLLING
+#endif
+
 #ifndef DISPLAY_NATIVE_COVERED_LEFT_SIDE
 #define DISPLAY_NATIVE_COVERED_LEFT_SIDE 0
 #endif
@@ -66,8 +80,41 @@
 // 16 bits per pixel
 #define SPI_BYTESPERPIXEL 2
 
+// Bus cost model, used to decide whether it is cheaper to send a run of unchanged pixels than to start a new update span at the
+// other side of it. All costs are in units of bus time it takes to clock out one byte.
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+#define SPI_BYTES_PER_COMMAND_WORD 2 // Command bytes and each command parameter are padded to 16 bits
+#else
+#define SPI_BYTES_PER_COMMAND_WORD 1
+#endif
+
+// Fixed overhead of each task in RunSPITask() on top of its bytes: the bus goes idle while waiting for DONE after the command
+// word, toggling the Data/Control line twice and refilling the FIFO. Run "bench spi" to measure this on the target Pi and display.
+#ifndef SPI_TASK_OVERHEAD_BYTES
+#define SPI_TASK_OVERHEAD_BYTES 6
+#endif
+
+#define SPI_COMMAND_COST_BYTES(numParams) (SPI_TASK_OVERHEAD_BYTES + SPI_BYTES_PER_COMMAND_WORD * (1 + (numParams)))
+
+// Starting a new span costs a full cursor window (start and end for both X and Y), and a new DISPLAY_WRITE_PIXELS command.
+#define SPAN_READDRESS_COST_BYTES (2 * SPI_COMMAND_COST_BYTES(4) + SPI_COMMAND_COST_BYTES(0))
+
+// Largest pixel write task the task producers queue, in bytes. Larger updates are split into several tasks that follow each
+// other with DISPLAY_WRITE_PIXELS_CONTINUE, so that each chunk is converted while it is still hot in the L1 data cache, and the
+// bus can start on the first chunk of a large update before the rest of it has been prepared.
+#ifndef SPI_MAX_PIXEL_TASK_BYTES
+#define SPI_MAX_PIXEL_TASK_BYTES 16384
+#endif
+
+// Number of rows of the given width that fit in one pixel write task
+#define PIXEL_TASK_ROWS(width) MAX(1, SPI_MAX_PIXEL_TASK_BYTES / ((width) * SPI_BYTESPERPIXEL))
+
 void ClearScreen(void);
 
+// Fills the whole GRAM with black in a single pixel write, sent straight to the bus rather than queued as tasks, for display
+// initialization. Leaves the controller with a full screen window that the shadow state does not know about.
+void ClearGRAM(void);
+
 void RandomizeScreen(void);
 
 void TurnBacklightOn(void);
@@ -79,3 +126,57 @@ void TurnDisplayOn(void);
 void TurnDisplayOff(void);
 
 void DeinitSPIDisplay(void);
+
+// Shadow copy of the display controller's address window and GRAM write pointer, as they will be after all queued tasks have
+// run. Task producers consult it to leave out cursor commands that would not change anything. Coordinates are in display
+// pixels and inclusive, as sent in DISPLAY_SET_CURSOR_X/Y. A negative value means the state is not known.
+typedef struct DisplayCursorState {
+    int x0, x1; // Column address window
+    int y0, y1; // Page address window
+    int writeX, writeY; // Position in GRAM where the next written pixel would land
+} DisplayCursorState;
+
+extern DisplayCursorState displayCursor;
+
+// Forgets the shadow state, e.g. after the controller has been reset, so that the next write sends a full cursor window.
+void InvalidateDisplayCursor(DisplayCursorState *cursor);
+
+struct SPITask;
+
+// Allocates a pixel write task for the rectangle x0..x1, y0..y1 (inclusive), after queueing only those cursor commands that the
+// shadow state shows are needed. If the rectangle starts where the previous write left off, no cursor commands are needed at
+// all, and the task continues the previous write with DISPLAY_WRITE_PIXELS_CONTINUE. This way a large update sent as a series
+// of row chunks (see PIXEL_TASK_ROWS) only addresses the cursor once. The caller fills in the pixels and commits the task. Adds
+// the number of command and payload bytes queued to *bytesQueued, if not null.
+SPITask *QueueWritePixels(DisplayCursorState *cursor, int x0, int y0, int x1, int y1, uint32_t *bytesQueued);
+
+// While the producer outruns the bus, the queue holds pixel writes of several frames, and each frame would reach the display late.
+// Instead, the writes of a newer frame supersede the queued writes of older frames that they fully cover (see SupersedeTask()),
+// so the display skips ahead to the newest frame. The writes of the frame at the head of the queue are always sent, so that every
+// frame the display starts on also gets finished, and no part of the screen is starved by a stream of newer frames. On by default,
+// cleared to compare against.
+extern bool supersedeStaleWrites;
+
+// Starts a new frame of pixel writes, which can supersede the ones queued before it. Called before queueing the spans of a frame.
+void BeginFrameWrites(void);
+
+struct Span;
+
+// Queues tasks that update the given spans of a RGB565 frame (with rows frameStride pixels apart) to the display. Returns the
+// number of command and payload bytes queued.
+uint32_t SubmitSpans(const Span *spans, int numSpans, const uint16_t *frame, int frameStride);
+
+// A pixel write task that covers rows y..endY-1 of a span, reserved in the queue with its pixels yet to be filled in
+typedef struct SpanTask {
+    struct SPITask *task;
+    const Span *span;
+    int y, endY;
+} SpanTask;
+
+// Queues the same tasks as SubmitSpans() would, but leaves the pixels out, to be filled in later with FillSpanTasks(). To be
+// called between BeginTaskReservation() and EndTaskReservation(). Writes one SpanTask per pixel write task to tasks (at most one
+// per row of each span), and returns their number. Adds the number of command and payload bytes queued to *bytesQueued.
+int ReserveSpans(const Span *spans, int numSpans, SpanTask *tasks, uint32_t *bytesQueued);
+
+// Copies the pixels of the given reserved tasks from a RGB565 frame. Can run on any thread.
+void FillSpanTasks(const SpanTask *tasks, int numTasks, const uint16_t *frame, int frameStride);
@@ -0,0 +1,220 @@
+#include "config.h"
+
+#ifdef USE_DMA_TRANSFERS
+
+#include <fcntl.h> // open
+#include <memory.h> // memset
+#include <stdio.h> // printf
+#include <stdlib.h> // exit, aligned_alloc, free
+#include <syslog.h> // syslog
+#include <sys/ioctl.h> // ioctl
+#include <sys/mman.h> // mmap, munmap
+#include <unistd.h> // close, usleep
+
+#include "dma.h"
+#include "spi.h"
+#include "util.h"
+
+#if DMA_TX_CHANNEL == DMA_RX_CHANNEL
+#error DMA_TX_CHANNEL and DMA_RX_CHANNEL must be different DMA channels!
+#endif
+
+uint32_t dmaMinTaskBytes = DMA_IS_FASTER_THAN_POLLED_SPI;
+
+volatile DMAChannelRegisterFile *dmaTx = 0;
+volatile DMAChannelRegisterFile *dmaRx = 0;
+
+// Holds the control blocks of SPIDMATransfer(), followed by the DLEN+CS header word that the TX channel sends first.
+static GpuMemoryBlock dmaControlBlocks = {};
+
+#define DMA_TX_HEADER_CB 0
+#define DMA_TX_PAYLOAD_CB 1
+#define DMA_RX_CB 2
+#define DMA_HEADER_WORD_OFFSET (3 * sizeof(DMAControlBlock))
+
+#ifdef SPI_EMULATION
+
+// Off-target there is no VideoCore to allocate from, so hand out regular memory, and register it with the DMA model.
+GpuMemoryBlock AllocateUncachedGpuMemory(uint32_t numBytes, const char *reason) {
+    GpuMemoryBlock block = {};
+    block.size = ALIGN_UP(numBytes, 4096);
+    block.virtualAddr = aligned_alloc(4096, block.size);
+    if (!block.virtualAddr) {
+        printf("Failed to allocate %u bytes of DMA memory for %s!\n", block.size, reason);
+        exit(1);
+    }
+    memset(block.virtualAddr, 0, block.size);
+    block.busAddress = RegisterEmulatedBusMemory(block.virtualAddr, block.size);
+    return block;
+}
+
+void FreeUncachedGpuMemory(GpuMemoryBlock &block) {
+    if (!block.virtualAddr) return;
+    UnregisterEmulatedBusMemory(block.virtualAddr);
+    free(block.virtualAddr);
+    memset(&block, 0, sizeof(block));
+}
+
+#else
+
+// VideoCore mailbox property interface, see https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
+#define MAILBOX_IOCTL_PROPERTY _IOWR(100, 0, char *)
+#define MAILBOX_TAG_ALLOCATE_MEMORY 0x3000C
+#define MAILBOX_TAG_LOCK_MEMORY 0x3000D
+#define MAILBOX_TAG_UNLOCK_MEMORY 0x3000E
+#define MAILBOX_TAG_RELEASE_MEMORY 0x3000F
+#define MEM_ALLOC_FLAG_DIRECT (1 << 2) // Allocate in the uncached 0xC0000000 bus alias
+
+static int mailboxFd = -1;
+
+// Sends a single tag with up to three arguments to the VideoCore, and returns the first word of the response.
+static uint32_t Mailbox(uint32_t tag, uint32_t arg0, uint32_t arg1 = 0, uint32_t arg2 = 0) {
+    if (mailboxFd < 0) {
+        mailboxFd = open("/dev/vcio", 0);
+        if (mailboxFd < 0) FATAL_ERROR("Failed to open /dev/vcio for VideoCore mailbox access!");
+    }
+    uint32_t message[9] __attribute__((aligned(16))) = {
+        sizeof(message), 0/*process request*/, tag, 12/*value buffer size*/, 12/*request size*/, arg0, arg1, arg2, 0/*end tag*/
+    };
+    if (ioctl(mailboxFd, MAILBOX_IOCTL_PROPERTY, message) < 0 || message[1] != 0x80000000)
+        FATAL_ERROR("VideoCore mailbox call failed!");
+    return message[5];
+}
+
+GpuMemoryBlock AllocateUncachedGpuMemory(uint32_t numBytes, const char *reason) {
+    GpuMemoryBlock block = {};
+    block.size = ALIGN_UP(numBytes, 4096);
+    block.allocationHandle = Mailbox(MAILBOX_TAG_ALLOCATE_MEMORY, block.size, 4096, MEM_ALLOC_FLAG_DIRECT);
+    if (!block.allocationHandle) {
+        printf("Failed to allocate %u bytes of GPU memory for %s! Try increasing gpu_mem in /boot/config.txt\n", block.size,
+               reason);
+        exit(1);
+    }
+    block.busAddress = Mailbox(MAILBOX_TAG_LOCK_MEMORY, block.allocationHandle);
+    block.virtualAddr = mmap(0, block.size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, BUS_TO_PHYS(block.busAddress));
+    if (block.virtualAddr == MAP_FAILED) FATAL_ERROR("Failed to mmap GPU memory!");
+    memset(block.virtualAddr, 0, block.size);
+    return block;
+}
+
+void FreeUncachedGpuMemory(GpuMemoryBlock &block) {
+    if (!block.allocationHandle) return;
+    munmap(block.virtualAddr, block.size);
+    Mailbox(MAILBOX_TAG_UNLOCK_MEMORY, block.allocationHandle);
+    Mailbox(MAILBOX_TAG_RELEASE_MEMORY, block.allocationHandle);
+    memset(&block, 0, sizeof(block));
+}
+
+#endif
+
+// Returns how long clocking out one byte takes on the SPI bus
+static double SPIUsecsPerByte() {
+#ifdef SPI_EMULATION
+    return EmulatedNsecsPerByte() / 1000.0;
+#else
+    // In DMA mode bytes take 8 clocks, and the SPI clock is core_freq/CDIV. Assume the core_freq=400 of Pi 3B and Zero W turbo.
+    return 8.0 * SPI_BUS_CLOCK_DIVISOR / 400.0;
+#endif
+}
+
+int InitDMA() {
+#ifdef SPI_EMULATION
+    dmaTx = &emulatedDMARegisters[DMA_TX_CHANNEL];
+    dmaRx = &emulatedDMARegisters[DMA_RX_CHANNEL];
+#else
+    dmaTx = (volatile DMAChannelRegisterFile *) ((uintptr_t) bcm2835 + BCM2835_DMA_BASE + DMA_TX_CHANNEL * 0x100);
+    dmaRx = (volatile DMAChannelRegisterFile *) ((uintptr_t) bcm2835 + BCM2835_DMA_BASE + DMA_RX_CHANNEL * 0x100);
+    volatile uint32_t *dmaEnable = (volatile uint32_t *) ((uintptr_t) bcm2835 + BCM2835_DMA_ENABLE);
+    *dmaEnable |= (1 << DMA_TX_CHANNEL) | (1 << DMA_RX_CHANNEL);
+#endif
+    dmaTx->cs = BCM2835_DMA_CS_RESET;
+    dmaRx->cs = BCM2835_DMA_CS_RESET;
+    usleep(100);
+
+    dmaControlBlocks = AllocateUncachedGpuMemory(DMA_HEADER_WORD_OFFSET + sizeof(uint32_t), "dma.cpp control blocks");
+
+    printf("Using DMA channels %d (TX) and %d (RX) for SPI transfers of at least %u bytes\n", DMA_TX_CHANNEL, DMA_RX_CHANNEL,
+           dmaMinTaskBytes);
+    return 0;
+}
+
+void DeinitDMA() {
+    if (dmaTx) dmaTx->cs = BCM2835_DMA_CS_RESET;
+    if (dmaRx) dmaRx->cs = BCM2835_DMA_CS_RESET;
+    dmaTx = dmaRx = 0;
+    FreeUncachedGpuMemory(dmaControlBlocks);
+#ifndef SPI_EMULATION
+    if (mailboxFd >= 0) {
+        close(mailboxFd);
+        mailboxFd = -1;
+    }
+#endif
+}
+
+void SPIDMATransfer(SPITask *task) {
+    const uint32_t payloadSize = task->PayloadSize();
+    volatile DMAControlBlock *cb = (volatile DMAControlBlock *) dmaControlBlocks.virtualAddr;
+    const uint32_t cbBusAddress = dmaControlBlocks.busAddress;
+
+    // With DMAEN set and TA clear, the first word written to the FIFO is not sent out, but sets DLEN from its high 16 bits and
+    // CS[7:0] from its low 8 bits. Setting TA there starts the transfer of DLEN bytes.
+    *(volatile uint32_t *) ((uintptr_t) cb + DMA_HEADER_WORD_OFFSET) =
+        (payloadSize << 16) | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
+
+    // TX channel writes the header word, and then the payload straight out of the task queue, which lives in DMA addressable
+    // memory at sharedMemoryBaseInPhysMemory.
+    const uint32_t txInfo = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_DREQ_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC |
+                            BCM2835_DMA_TI_WAIT_RESP;
+    volatile DMAControlBlock *header = &cb[DMA_TX_HEADER_CB];
+    header->ti = txInfo;
+    header->src = cbBusAddress + DMA_HEADER_WORD_OFFSET;
+    header->dst = BCM2835_SPI0_FIFO_BUS_ADDRESS;
+    header->len = sizeof(uint32_t);
+    header->stride = header->debug = header->reserved = 0;
+    header->next = cbBusAddress + DMA_TX_PAYLOAD_CB * sizeof(DMAControlBlock);
+
+    volatile DMAControlBlock *payload = &cb[DMA_TX_PAYLOAD_CB];
+    payload->ti = txInfo;
+    payload->src = (uint32_t) spiTaskMemory->sharedMemoryBaseInPhysMemory +
+                   (uint32_t) (task->PayloadStart() - (uint8_t *) spiTaskMemory);
+    payload->dst = BCM2835_SPI0_FIFO_BUS_ADDRESS;
+    payload->len = payloadSize;
+    payload->stride = payload->next = payload->debug = payload->reserved = 0;
+
+    // SPI is full duplex, and the transfer stalls when the RX FIFO fills up, so the RX channel drains it. Displays do not send
+    // anything back, so the bytes are discarded. The RX channel finishes only after the last byte has been clocked out, so it
+    // is the one to wait on.
+    volatile DMAControlBlock *rx = &cb[DMA_RX_CB];
+    rx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_DREQ_SPI_RX) | BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_DEST_IGNORE;
+    rx->src = BCM2835_SPI0_FIFO_BUS_ADDRESS;
+    rx->dst = 0;
+    rx->len = payloadSize;
+    rx->stride = rx->next = rx->debug = rx->reserved = 0;
+
+    // Switch the SPI peripheral to DMA mode, with TA clear so that it waits for the header word.
+    spi->cs = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_ADCS | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
+
+    dmaRx->cbAddr = cbBusAddress + DMA_RX_CB * sizeof(DMAControlBlock);
+    dmaTx->cbAddr = cbBusAddress + DMA_TX_HEADER_CB * sizeof(DMAControlBlock);
+    __sync_synchronize();
+    dmaRx->cs = BCM2835_DMA_CS_ACTIVE;
+    dmaTx->cs = BCM2835_DMA_CS_ACTIVE;
+    __sync_synchronize();
+
+    // Give the CPU away for most of the transfer, and only poll for the tail end of it.
+    const double transferUsecs = payloadSize * SPIUsecsPerByte();
+    if (transferUsecs > 70) usleep((useconds_t) (transferUsecs - 70));
+
+    uint64_t waitStart = tick();
+    while ((dmaRx->cs & BCM2835_DMA_CS_ACTIVE))
+        if (tick() - waitStart > 5000000) FATAL_ERROR("DMA transfer to SPI did not finish within 5 seconds!");
+
+    dmaTx->cs = BCM2835_DMA_CS_END;
+    dmaRx->cs = BCM2835_DMA_CS_END;
+
+    // Return to polled mode for the command byte of the next task.
+    spi->cs = BCM2835_SPI0_CS_CLEAR | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
+    __sync_synchronize();
+}
+
+#endif
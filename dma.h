@@ -0,0 +1,110 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+#include "spi.h"
+
+#define BCM2835_DMA_BASE                     0x7000     // Address to DMA register file, channel N is at BCM2835_DMA_BASE + N*0x100
+#define BCM2835_DMA_ENABLE                   0x7FF0     // Global enable bits for each DMA channel
+
+// Peripherals are at 0x7E000000 on the VideoCore bus that the DMA controller sees, regardless of where the ARM sees them
+#define BCM2835_PERI_BUS_BASE                0x7E000000
+#define BCM2835_SPI0_FIFO_BUS_ADDRESS        (BCM2835_PERI_BUS_BASE + BCM2835_SPI0_BASE + 0x04)
+#define BCM2835_GPIO_SET0_BUS_ADDRESS        (BCM2835_PERI_BUS_BASE + BCM2835_GPIO_BASE + 0x1C)
+#define BCM2835_GPIO_CLR0_BUS_ADDRESS        (BCM2835_PERI_BUS_BASE + BCM2835_GPIO_BASE + 0x28)
+
+// The uncached alias of SDRAM on the VideoCore bus, and conversion from bus addresses to ARM physical addresses in /dev/mem
+#define BUS_TO_PHYS(x)                       ((x) & ~0xC0000000)
+
+#define BCM2835_DMA_CS_ACTIVE                0x00000001 // Activate the DMA to load the control block at CONBLK_AD and start transferring
+#define BCM2835_DMA_CS_END                   0x00000002 // Set when the transfer described by the last control block completes, write 1 to clear
+#define BCM2835_DMA_CS_INT                   0x00000004 // Interrupt status, write 1 to clear
+#define BCM2835_DMA_CS_ERROR                 0x00000100 // DMA error
+#define BCM2835_DMA_CS_ABORT                 0x40000000 // Abort the current control block
+#define BCM2835_DMA_CS_RESET                 0x80000000 // Reset the DMA channel
+
+#define BCM2835_DMA_TI_INTEN                 0x00000001 // Raise an interrupt when the transfer of this control block completes
+#define BCM2835_DMA_TI_WAIT_RESP             0x00000008 // Wait for a write response before moving on
+#define BCM2835_DMA_TI_DEST_INC              0x00000010 // Increment the destination address after each write
+#define BCM2835_DMA_TI_DEST_DREQ             0x00000040 // Pace writes by the DREQ of the peripheral selected with PERMAP
+#define BCM2835_DMA_TI_DEST_IGNORE           0x00000080 // Do not perform writes, only reads
+#define BCM2835_DMA_TI_SRC_INC               0x00000100 // Increment the source address after each read
+#define BCM2835_DMA_TI_SRC_DREQ              0x00000400 // Pace reads by the DREQ of the peripheral selected with PERMAP
+#define BCM2835_DMA_TI_PERMAP_SHIFT          16
+#define BCM2835_DMA_TI_PERMAP(x)             ((x) << BCM2835_DMA_TI_PERMAP_SHIFT)
+#define BCM2835_DMA_TI_NO_WIDE_BURSTS        0x04000000
+
+#define BCM2835_DMA_DREQ_SPI_TX              6
+#define BCM2835_DMA_DREQ_SPI_RX              7
+
+#define BCM2835_SPI0_CS_DMAEN                0x00000100 // DMA Enable: DMA paces the FIFOs, and the first word written to FIFO sets DLEN and CS[7:0]
+#define BCM2835_SPI0_CS_ADCS                 0x00000800 // Automatically Deassert Chip Select: clear TA when DLEN bytes have been transferred
+
+// Describes a single DMA transfer, the DMA controller reads these from memory. Must be 32-byte aligned.
+typedef struct __attribute__((aligned(32))) DMAControlBlock {
+    uint32_t ti; // Transfer Information
+    uint32_t src; // Source bus address
+    uint32_t dst; // Destination bus address
+    uint32_t len; // Number of bytes to transfer
+    uint32_t stride;
+    uint32_t next; // Bus address of the next control block to run after this one, or 0 to stop
+    uint32_t debug;
+    uint32_t reserved;
+} DMAControlBlock;
+
+#ifndef SPI_EMULATION
+typedef struct DMAChannelRegisterFile {
+    uint32_t cs; // DMA Channel Control and Status register
+    uint32_t cbAddr; // DMA Channel Control Block Address
+    uint32_t ti, sourceAddr, destAddr, len, stride, nextConBk, debug; // Copy of the control block currently being run
+} DMAChannelRegisterFile;
+#endif
+
+#ifdef USE_DMA_TRANSFERS
+
+#ifndef DMA_TX_CHANNEL
+#define DMA_TX_CHANNEL 7
+#endif
+
+#ifndef DMA_RX_CHANNEL
+#define DMA_RX_CHANNEL 1
+#endif
+
+// Payloads shorter than this many bytes are sent with polled SPI, since the latency of setting up a DMA transfer and waiting for
+// it to finish outweighs the time spent feeding the FIFO by hand. Run "bench dma" to find the crossover point on the target Pi.
+#ifdef ALL_TASKS_SHOULD_DMA
+#define DMA_IS_FASTER_THAN_POLLED_SPI 0
+#elif !defined(DMA_IS_FASTER_THAN_POLLED_SPI)
+#define DMA_IS_FASTER_THAN_POLLED_SPI 140
+#endif
+
+// The SPI DLEN register is 16 bits, so a DMA transfer can carry at most this many bytes. Larger tasks fall back to polled SPI.
+#define DMA_MAX_SPI_TRANSFER_BYTES 0xFFFF
+
+// A block of physically contiguous, uncached memory that both the CPU and the DMA controller can access.
+typedef struct GpuMemoryBlock {
+    void *virtualAddr; // Address of the memory in this process
+    uint32_t busAddress; // Address of the memory on the VideoCore bus, as used in DMA control blocks
+    uint32_t allocationHandle; // VideoCore mailbox handle to the allocation
+    uint32_t size;
+} GpuMemoryBlock;
+
+// Allocates memory from the VideoCore via the mailbox interface. Needs /dev/mem to be open (mem_fd) to map it to the process.
+GpuMemoryBlock AllocateUncachedGpuMemory(uint32_t numBytes, const char *reason);
+
+void FreeUncachedGpuMemory(GpuMemoryBlock &block);
+
+// Minimum payload size to send a task with DMA, DMA_IS_FASTER_THAN_POLLED_SPI by default. Benchmarks change this to compare the
+// two transfer methods.
+extern uint32_t dmaMinTaskBytes;
+
+int InitDMA(void);
+
+void DeinitDMA(void);
+
+// Sends the payload of the given task with DMA, directly from the task queue memory, and returns when the transfer has finished.
+// The command byte must have been sent already, with polled SPI. Payload must be at most DMA_MAX_SPI_TRANSFER_BYTES long.
+void SPIDMATransfer(SPITask *task);
+
+#endif
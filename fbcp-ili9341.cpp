@@ -22,6 +22,13 @@
 #include "display.h"
 #include "util.h"
 #include "mem_alloc.h"
+#include "framebuffer.h"
+#include "diff.h"
+#include "pipeline.h"
+#include "pacing.h"
+#include "scroll.h"
+#include "tearing.h"
+#include "boot.h"
 
 
 volatile bool programRunning = true;
@@ -48,50 +55,143 @@ void ProgramInterruptHandler(int signal) {
     }
     MarkProgramQuitting();
     __sync_synchronize();
-    // Wake the SPI thread if it was sleeping so that it can gracefully quit
-    if (spiTaskMemory) {
-        __atomic_fetch_add(&spiTaskMemory->queueHead, 1, __ATOMIC_SEQ_CST);
-        __atomic_fetch_add(&spiTaskMemory->queueTail, 1, __ATOMIC_SEQ_CST);
-        syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0,
-                0); // Wake the SPI thread if it was sleeping to get new tasks
-    }
+    // Wake the SPI thread if it was sleeping so that it can gracefully quit. N.B. the queue indices must not be touched here,
+    // the main thread may be in the middle of producing or running tasks when the signal arrives.
+    if (spiTaskMemory)
+        syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0);
 }
 
 
-void drawScreen(int z) {
-    for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
-        SPI_TRANSFER(DISPLAY_SET_CURSOR_X, 0, 0, 0, 0, 0, (DISPLAY_WIDTH - 1) >> 8, 0, (DISPLAY_WIDTH - 1) & 0xFF);
-        SPI_TRANSFER(DISPLAY_SET_CURSOR_Y, 0, (uint8_t) (y >> 8), 0, (uint8_t) (y & 0xFF), 0, (DISPLAY_HEIGHT - 1) >> 8,
-                     0, (DISPLAY_HEIGHT - 1) & 0xFF);
-
-        SPITask *clearLine = AllocTask(DISPLAY_WIDTH * SPI_BYTESPERPIXEL);
-        clearLine->cmd = DISPLAY_WRITE_PIXELS;
-
-        for (int i = 0; i < DISPLAY_WIDTH; ++i)
-            clearLine->data[i] = z * y + i;
-
-//    memset(clearLine->data, 0, clearLine->size);
-        CommitTask(clearLine);
-        RunSPITask(clearLine);
-        DoneTask(clearLine);
-    }
-    SPI_TRANSFER(DISPLAY_SET_CURSOR_X, 0, 0, 0, 0, 0, (DISPLAY_WIDTH - 1) >> 8, 0, (DISPLAY_WIDTH - 1) & 0xFF);
-    SPI_TRANSFER(DISPLAY_SET_CURSOR_Y, 0, 0, 0, 0, 0, (DISPLAY_HEIGHT - 1) >> 8, 0, (DISPLAY_HEIGHT - 1) & 0xFF);
+// Called once the first frame has been queued, waits until it has been sent to the display and logs the time that took (see boot.h).
+// Waiting for the queue to drain makes the time exact, and only holds back preparing the frame after it.
+static void LogTimeToFirstFrame() {
+    WaitForDisplay();
+    while (!SPITaskQueueDrained() && programRunning) usleep(100);
+    EndBootPhase(BOOT_FIRST_FRAME);
+    LogBootTimes();
 }
 
-int main() {
+int main(int argc, char **argv) {
+    StartBootTimer();
     signal(SIGINT, ProgramInterruptHandler);
     signal(SIGQUIT, ProgramInterruptHandler);
     signal(SIGUSR1, ProgramInterruptHandler);
     signal(SIGUSR2, ProgramInterruptHandler);
     signal(SIGTERM, ProgramInterruptHandler);
 
-    InitSPI();
-    usleep(3000 * 1000);
-//    for (int z = 0; z < 5; z++) {
-//        usleep(200 * 1000);
-//        drawScreen(z);
-//    }
+    // Usage: fbcp-ili9341 [framebuffer [width height bitsPerPixel [stride]]]
+    // The geometry only needs to be passed if the framebuffer is a regular file rather than a framebuffer device.
+    const char *framebufferPath = (argc >= 2) ? argv[1] : "/dev/fb0";
+    int width = (argc >= 5) ? atoi(argv[2]) : 0;
+    int height = (argc >= 5) ? atoi(argv[3]) : 0;
+    int bitsPerPixel = (argc >= 5) ? atoi(argv[4]) : 0;
+    int stride = (argc >= 6) ? atoi(argv[5]) : 0;
+
+    // The display comes up in the background while the rest is set up, and the first frame is queued right behind it
+    InitSPIInBackground();
+    BeginBootPhase(BOOT_CAPTURE_SETUP);
+    InitFramebufferCapture(framebufferPath, width, height, bitsPerPixel, stride);
+
+#ifndef UPDATE_FRAMES_WITHOUT_DIFFING
+    InitDiff();
+    SetDiffRegion(capturedRegion.x, capturedRegion.endX, capturedRegion.y, capturedRegion.endY);
+    InitScrolling(capturedRegion.y, capturedRegion.endY);
+    InitFramePipeline(-1);
+    if (framePipelineWorkers) printf("Processing frames on %d worker threads\n", framePipelineWorkers);
+    FrameDiffStatistics statsSinceReport = {};
+    uint64_t stallUsecsAtLastReport = spiTaskMemory->producerStallUsecs;
+    uint32_t supersededBytesAtLastReport = spiTaskMemory->spiBytesSuperseded;
+#ifdef GPIO_TFT_TEARING_EFFECT
+    uint32_t writesHeldAtLastReport = 0;
+    uint64_t heldUsecsAtLastReport = 0;
+#endif
+    uint64_t lastReportTime = tick();
+#endif
+    EndBootPhase(BOOT_CAPTURE_SETUP);
+    InitFramePacing(tick());
+    FramePacingStatistics pacingSinceReport = {};
+    bool firstFrame = true;
+
+    while (programRunning) {
+        // Sleep until the frame pacing says that the next frame is due, see pacing.h. The SPI thread sends the queued tasks to the
+        // display in the background meanwhile.
+        const uint64_t captureTime = NextFrameCaptureTime();
+#ifndef UPDATE_FRAMES_WITHOUT_DIFFING
+        // If the previous frame was interlaced, fill in its other field while the bus would otherwise sit idle
+        SendLeftOutFieldWhenBusIdle(captureTime, &statsSinceReport);
+#endif
+        uint64_t now = tick();
+        if (captureTime > now) usleep(captureTime - now);
+        if (!programRunning) break;
+        const uint64_t captureStart = tick();
+        if (firstFrame) BeginBootPhase(BOOT_FIRST_FRAME);
+#ifdef UPDATE_FRAMES_WITHOUT_DIFFING
+        SubmitFramebufferFrame();
+        FrameCaptured(captureStart, tick(), true, &pacingSinceReport);
+#else
+        FrameDiffStatistics stats = {};
+        RunFramePipeline(&stats);
+        FrameCaptured(captureStart, tick(), stats.changedPixels > 0, &pacingSinceReport);
+#endif
+        if (firstFrame) LogTimeToFirstFrame();
+        firstFrame = false;
+#ifndef UPDATE_FRAMES_WITHOUT_DIFFING
+        statsSinceReport.changedPixels += stats.changedPixels;
+        statsSinceReport.spans += stats.spans;
+        statsSinceReport.bytesTransmitted += stats.bytesTransmitted;
+        statsSinceReport.interlacedFrames += stats.interlacedFrames;
+        statsSinceReport.scrolls += stats.scrolls;
+        statsSinceReport.coarsePixels += stats.coarsePixels;
+        statsSinceReport.maxCoarseError = MAX(statsSinceReport.maxCoarseError, stats.maxCoarseError);
+        now = tick();
+        if (now - lastReportTime >= 1000000) {
+            const uint32_t captures = pacingSinceReport.captures;
+            const double fullFrameBytes = FRAME_WIDTH * FRAME_HEIGHT * SPI_BYTESPERPIXEL;
+            const uint64_t stallUsecs = spiTaskMemory->producerStallUsecs;
+            const uint32_t supersededBytes = spiTaskMemory->spiBytesSuperseded;
+            printf("%u frames (%u interlaced, %u scrolled): %.0f changed pixels/frame (%.2f%% of screen) in %.0f spans, %.0f bytes/frame sent (%.2f%% of a full frame), %.0f bytes/frame superseded, waited %.2f%% of the time for a full SPI queue\n",
+                   captures, statsSinceReport.interlacedFrames, statsSinceReport.scrolls,
+                   (double) statsSinceReport.changedPixels / captures,
+                   100.0 * statsSinceReport.changedPixels / captures / (FRAME_WIDTH * FRAME_HEIGHT),
+                   (double) statsSinceReport.spans / captures,
+                   (double) statsSinceReport.bytesTransmitted / captures,
+                   100.0 * statsSinceReport.bytesTransmitted / captures / fullFrameBytes,
+                   (double) (uint32_t) (supersededBytes - supersededBytesAtLastReport) / captures,
+                   100.0 * (stallUsecs - stallUsecsAtLastReport) / (now - lastReportTime));
+            printf("%.1f fps of new content, frame interval jitter %.2f msecs, busy %.1f%% of the time",
+                   AchievedFrameRate(&pacingSinceReport, now - lastReportTime), FrameIntervalJitterUsecs(&pacingSinceReport) / 1000.0,
+                   100.0 * BusyDutyCycle(&pacingSinceReport, now - lastReportTime));
+            if (PredictedFrameInterval()) printf(", source updates every %.2f msecs", PredictedFrameInterval() / 1000.0);
+#ifdef GPIO_TFT_TEARING_EFFECT
+            const uint32_t writesHeld = __atomic_load_n(&tearingEffectStatistics.writesHeld, __ATOMIC_RELAXED);
+            const uint64_t heldUsecs = __atomic_load_n(&tearingEffectStatistics.heldUsecs, __ATOMIC_RELAXED);
+            if (TearingEffectSyncEnabled())
+                printf(", held %u writes back from the beam for %.2f%% of the time", writesHeld - writesHeldAtLastReport,
+                       100.0 * (heldUsecs - heldUsecsAtLastReport) / (now - lastReportTime));
+            writesHeldAtLastReport = writesHeld;
+            heldUsecsAtLastReport = heldUsecs;
+#endif
+#ifdef FAST_BUT_COARSE_PIXEL_DIFF
+            // Skipped pixels that end up inside a span are sent anyway, so the saving is an upper bound
+            printf(", coarse diff skipped %.0f pixels/frame (up to %.0f bytes/frame), leaving pixels at most %u steps off",
+                   (double) statsSinceReport.coarsePixels / captures,
+                   (double) statsSinceReport.coarsePixels * SPI_BYTESPERPIXEL / captures, statsSinceReport.maxCoarseError);
+#endif
+            printf("\n");
+            stallUsecsAtLastReport = stallUsecs;
+            supersededBytesAtLastReport = supersededBytes;
+            memset(&statsSinceReport, 0, sizeof(statsSinceReport));
+            memset(&pacingSinceReport, 0, sizeof(pacingSinceReport));
+            lastReportTime = now;
+        }
+#endif
+    }
+
+#ifndef UPDATE_FRAMES_WITHOUT_DIFFING
+    DeinitFramePipeline();
+    DeinitDiff();
+#endif
+    DeinitFramebufferCapture();
     DeinitSPI();
     printf("Quit.\n");
 }
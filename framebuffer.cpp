@@ -0,0 +1,257 @@
+#include "config.h"
+#include "framebuffer.h"
+#include "pixels.h"
+#include "scaler.h"
+#include "display.h"
+#include "spi.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <linux/fb.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+SourceFramebuffer sourceFramebuffer = {-1};
+FrameRegion capturedRegion = {};
+
+void InitFramebufferCapture(const char *path, int width, int height, int bitsPerPixel, int stride) {
+    SourceFramebuffer &fb = sourceFramebuffer;
+    fb.fd = open(path, O_RDONLY);
+    if (fb.fd < 0) FATAL_ERROR("Failed to open source framebuffer!");
+
+    // Default channel layout: XRGB8888 for 32bpp, BGR byte order for 24bpp (both have blue in the lowest byte)
+    fb.redShift = 16;
+    fb.greenShift = 8;
+    fb.blueShift = 0;
+
+    if (width <= 0 || height <= 0) {
+        struct fb_var_screeninfo var;
+        struct fb_fix_screeninfo fix;
+        if (ioctl(fb.fd, FBIOGET_VSCREENINFO, &var) < 0 || ioctl(fb.fd, FBIOGET_FSCREENINFO, &fix) < 0)
+            FATAL_ERROR("Source is not a framebuffer device, specify its width, height and bits per pixel explicitly!");
+        fb.width = var.xres;
+        fb.height = var.yres;
+        fb.bitsPerPixel = var.bits_per_pixel;
+        fb.stride = fix.line_length;
+        if (fb.bitsPerPixel > 16) {
+            fb.redShift = var.red.offset;
+            fb.greenShift = var.green.offset;
+            fb.blueShift = var.blue.offset;
+        }
+    } else {
+        fb.width = width;
+        fb.height = height;
+        fb.bitsPerPixel = bitsPerPixel;
+        fb.stride = (stride > 0) ? stride : width * bitsPerPixel / 8;
+    }
+
+    if (fb.bitsPerPixel != 16 && fb.bitsPerPixel != 24 && fb.bitsPerPixel != 32)
+        FATAL_ERROR("Unsupported source framebuffer pixel format, only 16, 24 and 32 bits per pixel are supported!");
+
+    fb.mappedSize = (size_t) fb.stride * fb.height;
+    struct stat st;
+    if (fstat(fb.fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t) st.st_size < fb.mappedSize)
+        FATAL_ERROR("Source framebuffer file is smaller than the specified geometry!");
+
+    fb.pixels = (uint8_t *) mmap(NULL, fb.mappedSize, PROT_READ, MAP_SHARED, fb.fd, 0);
+    if (fb.pixels == MAP_FAILED) FATAL_ERROR("Failed to mmap source framebuffer!");
+
+    printf("Source framebuffer %s: %dx%d, %d bits per pixel, stride %d bytes\n", path, fb.width, fb.height,
+           fb.bitsPerPixel, fb.stride);
+#if defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && defined(DISPLAY_ROTATE_180_DEGREES)
+    printf("Rotating the source framebuffer 270 degrees in software onto the %dx%d display\n", DISPLAY_DRAWABLE_WIDTH,
+           DISPLAY_DRAWABLE_HEIGHT);
+#elif defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE)
+    printf("Rotating the source framebuffer 90 degrees in software onto the %dx%d display\n", DISPLAY_DRAWABLE_WIDTH,
+           DISPLAY_DRAWABLE_HEIGHT);
+#endif
+    FitFramebufferToDisplay();
+    const SourceScaler &s = sourceScaler;
+    if (s.mode != SCALING_NONE)
+        printf("Scaling the source framebuffer to %dx%d, %s\n", s.width, s.height,
+               (s.mode == SCALING_NEAREST) ? "nearest neighbour" : "filtered");
+    else if (s.srcWidth < fb.width || s.srcHeight < fb.height)
+        printf("Source framebuffer is larger than the display, showing its center %dx%d pixels\n", s.srcWidth, s.srcHeight);
+}
+
+void FitFramebufferToDisplay() {
+    const SourceScaler &s = sourceScaler;
+    FrameRegion &r = capturedRegion;
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+    // The source is fitted onto the display as it is before the rotation, see ConvertFramebufferRows()
+    InitSourceScaler(DISPLAY_DRAWABLE_HEIGHT, DISPLAY_DRAWABLE_WIDTH);
+#ifdef DISPLAY_ROTATE_180_DEGREES
+    r.x = s.y;
+    r.endX = s.y + s.height;
+    r.y = DISPLAY_DRAWABLE_HEIGHT - s.x - s.width;
+    r.endY = r.y + s.width;
+#else
+    r.x = DISPLAY_DRAWABLE_WIDTH - s.y - s.height;
+    r.endX = r.x + s.height;
+    r.y = s.x;
+    r.endY = s.x + s.width;
+#endif
+#else
+    InitSourceScaler(DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT);
+    r.x = s.x;
+    r.endX = s.x + s.width;
+    r.y = s.y;
+    r.endY = s.y + s.height;
+#endif
+}
+
+void DeinitFramebufferCapture() {
+    SourceFramebuffer &fb = sourceFramebuffer;
+    if (fb.pixels && fb.pixels != MAP_FAILED) munmap(fb.pixels, fb.mappedSize);
+    fb.pixels = 0;
+    if (fb.fd >= 0) close(fb.fd);
+    fb.fd = -1;
+    DeinitSourceScaler();
+}
+
+static inline uint16_t PackRGB565(uint32_t r, uint32_t g, uint32_t b) {
+#ifdef DISPLAY_SWAP_BGR
+    uint32_t t = r;
+    r = b;
+    b = t;
+#endif
+    uint16_t c = (uint16_t) (((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+#ifdef DISPLAY_INVERT_COLORS
+    c = ~c;
+#endif
+    return c;
+}
+
+// The usual layouts, with red and blue in the lowest and third lowest bytes either way around, go through the vectorized kernels
+// in pixels.cpp. Anything else takes the general path.
+static inline bool HasVectorizedChannelLayout(const SourceFramebuffer &fb) {
+    return fb.greenShift == 8 && ((fb.redShift == 16 && fb.blueShift == 0) || (fb.redShift == 0 && fb.blueShift == 16));
+}
+
+void ConvertFramebufferRow(const uint8_t *src, uint8_t *dst, int width) {
+    const SourceFramebuffer &fb = sourceFramebuffer;
+    switch (fb.bitsPerPixel) {
+        case 16:
+            for (int x = 0; x < width; ++x, src += 2, dst += 2) {
+                uint16_t c = src[0] | (src[1] << 8);
+#if defined(DISPLAY_SWAP_BGR) || defined(DISPLAY_INVERT_COLORS)
+                c = PackRGB565((c >> 8) & 0xF8, (c >> 3) & 0xFC, (c << 3) & 0xF8);
+#endif
+                dst[0] = (uint8_t) (c >> 8);
+                dst[1] = (uint8_t) c;
+            }
+            break;
+        case 24:
+            if (HasVectorizedChannelLayout(fb)) {
+                ConvertRGB888ToRGB565BE(src, dst, width, fb.redShift == 0);
+                break;
+            }
+            for (int x = 0; x < width; ++x, src += 3, dst += 2) {
+                uint32_t px = src[0] | (src[1] << 8) | (src[2] << 16);
+                uint16_t c = PackRGB565((px >> fb.redShift) & 0xFF, (px >> fb.greenShift) & 0xFF, (px >> fb.blueShift) & 0xFF);
+                dst[0] = (uint8_t) (c >> 8);
+                dst[1] = (uint8_t) c;
+            }
+            break;
+        case 32:
+            if (HasVectorizedChannelLayout(fb)) {
+                ConvertXRGB8888ToRGB565BE(src, dst, width, fb.redShift == 0);
+                break;
+            }
+            for (int x = 0; x < width; ++x, src += 4, dst += 2) {
+                uint32_t px = *(const uint32_t *) src;
+                uint16_t c = PackRGB565((px >> fb.redShift) & 0xFF, (px >> fb.greenShift) & 0xFF, (px >> fb.blueShift) & 0xFF);
+                dst[0] = (uint8_t) (c >> 8);
+                dst[1] = (uint8_t) c;
+            }
+            break;
+    }
+}
+
+// Converts rows startY..endY-1 of capturedRegion, as shown on the display, to dst, which points to the first captured pixel of row
+// startY, with rows dstStride bytes apart. The source is cropped or scaled first (see scaler.h), and only the part of the scaled image
+// that these rows show is brought up to date, so that bands of rows can be captured in parallel.
+static void ConvertFramebufferRows(uint8_t *dst, int dstStride, int startY, int endY) {
+    const SourceScaler &s = sourceScaler;
+    const int firstY = capturedRegion.y;
+    int stride;
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+    const SourceFramebuffer &fb = sourceFramebuffer;
+#ifdef DISPLAY_ROTATE_180_DEGREES
+    // The scaled image is rotated 270 degrees clockwise onto the display: frame row y is image column s.width-1-(y-firstY), and
+    // the frame columns are image rows from the top down, so that the top row of the image ends up on the left edge of the display.
+    const int startX = s.width - (endY - firstY), endX = s.width - (startY - firstY);
+#else
+    // The scaled image is rotated 90 degrees clockwise onto the display: frame row y is image column y-firstY, and the frame
+    // columns are image rows from the bottom up, so that the bottom row of the image ends up on the left edge of the display.
+    const int startX = startY - firstY, endX = endY - firstY;
+#endif
+    ScaleSourceRegion(startX, endX, 0, s.height);
+    const uint8_t *image = ScaledImage(&stride);
+    if (fb.bitsPerPixel == 32 && HasVectorizedChannelLayout(fb)) {
+#ifdef DISPLAY_ROTATE_180_DEGREES
+        Rotate270XRGB8888ToRGB565BE(image, stride, s.height, startX, endX, dst, dstStride, fb.redShift == 0);
+#else
+        RotateXRGB8888ToRGB565BE(image, stride, s.height, startX, endX, dst, dstStride, fb.redShift == 0);
+#endif
+        return;
+    }
+    // Other formats gather each image column into a row first, which reads the image in a cache unfriendly order
+    const int bytesPerPixel = fb.bitsPerPixel / 8;
+    uint8_t column[DISPLAY_DRAWABLE_WIDTH * 4];
+    for (int y = startY; y < endY; ++y, dst += dstStride) {
+#ifdef DISPLAY_ROTATE_180_DEGREES
+        const uint8_t *src = image + (endX - 1 - (y - startY)) * bytesPerPixel;
+        for (int x = 0; x < s.height; ++x)
+            memcpy(column + x * bytesPerPixel, src + (size_t) x * stride, bytesPerPixel);
+#else
+        const uint8_t *src = image + (startX + (y - startY)) * bytesPerPixel;
+        for (int x = 0; x < s.height; ++x)
+            memcpy(column + x * bytesPerPixel, src + (size_t) (s.height - 1 - x) * stride, bytesPerPixel);
+#endif
+        ConvertFramebufferRow(column, dst, s.height);
+    }
+#else
+    ScaleSourceRegion(0, s.width, startY - firstY, endY - firstY);
+    const uint8_t *image = ScaledImage(&stride);
+    for (int y = startY; y < endY; ++y, dst += dstStride)
+        ConvertFramebufferRow(image + (size_t) (y - firstY) * stride, dst, s.width);
+#endif
+}
+
+void CaptureFramebufferFrame(uint16_t *dst, int dstStride) {
+    CaptureFramebufferRows(dst, dstStride, 0, DISPLAY_DRAWABLE_HEIGHT);
+}
+
+void CaptureFramebufferRows(uint16_t *dst, int dstStride, int startY, int endY) {
+    const FrameRegion &r = capturedRegion;
+    startY = MAX(startY, r.y);
+    endY = MIN(endY, r.endY);
+    if (startY < endY)
+        ConvertFramebufferRows((uint8_t *) (dst + startY * dstStride + r.x), dstStride * (int) sizeof(uint16_t), startY, endY);
+}
+
+void SubmitFramebufferFrame() {
+    const FrameRegion &r = capturedRegion;
+    const int x0 = DISPLAY_COVERED_LEFT_SIDE + r.x;
+    const int y0 = DISPLAY_COVERED_TOP_SIDE;
+    const int width = r.endX - r.x;
+
+    // The rows of the frame follow each other in a window of the captured region's width, so they are streamed in as one pixel write,
+    // converted in chunks of rows that continue each other.
+    const int rowsPerTask = PIXEL_TASK_ROWS(width);
+    BeginTaskBatch();
+    for (int y = r.y; y < r.endY; y += rowsPerTask) {
+        const int endY = MIN(y + rowsPerTask, r.endY);
+        SPITask *task = QueueWritePixels(&displayCursor, x0, y0 + y, x0 + width - 1, y0 + endY - 1, 0);
+        ConvertFramebufferRows(task->data, width * SPI_BYTESPERPIXEL, y, endY);
+        CommitTask(task);
+    }
+    EndTaskBatch();
+}
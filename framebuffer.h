@@ -0,0 +1,50 @@
+#pragma once
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+// Describes the source framebuffer that is mirrored to the SPI display: either a Linux framebuffer device such as /dev/fb0, or any
+// regular file that holds raw pixels of a known geometry (e.g. for exercising the capture path on a development machine).
+typedef struct SourceFramebuffer {
+    int fd;
+    uint8_t *pixels; // Memory mapped contents of the framebuffer
+    size_t mappedSize;
+    int width; // Dimensions in pixels
+    int height;
+    int stride; // Distance between two rows, in bytes
+    int bitsPerPixel; // 16 (RGB565), 24 or 32
+    int redShift, greenShift, blueShift; // Bit offsets of the 8-bit color channels in a 24bpp or 32bpp pixel
+} SourceFramebuffer;
+
+extern SourceFramebuffer sourceFramebuffer;
+
+// Rectangle of the frame that shows the source framebuffer once it is cropped or scaled to the display (see scaler.h): columns
+// x..endX-1 of rows y..endY-1. The letterbox or pillarbox bars around it stay black, the capture does not write to them.
+typedef struct FrameRegion {
+    int x, endX, y, endY;
+} FrameRegion;
+
+extern FrameRegion capturedRegion;
+
+// Opens and memory maps the given framebuffer. If width or height is zero, the geometry is queried from the framebuffer device
+// driver. Otherwise the given geometry is used, and if stride is zero, rows are assumed to be tightly packed.
+void InitFramebufferCapture(const char *path, int width, int height, int bitsPerPixel, int stride);
+
+void DeinitFramebufferCapture(void);
+
+// Works out how the source framebuffer is cropped or scaled onto the display, and sets capturedRegion accordingly. Called by
+// InitFramebufferCapture(), call again after filling in the geometry of sourceFramebuffer by other means.
+void FitFramebufferToDisplay(void);
+
+// Converts one row of source pixels to the RGB565 big endian byte stream that the display expects.
+void ConvertFramebufferRow(const uint8_t *src, uint8_t *dst, int width);
+
+// Converts the current contents of the source framebuffer to RGB565 into the given frame, with rows dstStride pixels apart.
+void CaptureFramebufferFrame(uint16_t *dst, int dstStride);
+
+// Converts only rows startY..endY-1 of the frame (clipped to capturedRegion) into the same rows of the given frame.
+void CaptureFramebufferRows(uint16_t *dst, int dstStride, int startY, int endY);
+
+// Queues tasks to the SPI task ring that update the display with the current contents of the source framebuffer. Pixels are
+// converted straight from the mapped framebuffer memory into the task payloads.
+void SubmitFramebufferFrame(void);
@@ -6,6 +6,9 @@
 #define DISPLAY_SET_CURSOR_X 0x2A
 #define DISPLAY_SET_CURSOR_Y 0x2B
 #define DISPLAY_WRITE_PIXELS 0x2C
+#define DISPLAY_WRITE_PIXELS_CONTINUE 0x3C // Write Memory Continue: resumes writing from where the previous pixel write left off
+#define DISPLAY_VERTICAL_SCROLLING_DEFINITION 0x33 // Top fixed area, vertical scrolling area and bottom fixed area, in native rows
+#define DISPLAY_VERTICAL_SCROLLING_START_ADDRESS 0x37 // GRAM row shown on the first row of the scrolling area
 
 #ifdef WAVESHARE35B_ILI9486
 
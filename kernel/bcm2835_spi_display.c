@@ -14,6 +14,7 @@
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/platform_data/dma-bcm2708.h>
+#include <linux/platform_device.h>
 #include <linux/proc_fs.h>
 #include <linux/slab.h>
 #include <linux/spi/spidev.h>
@@ -27,6 +28,7 @@
 #include "../display.h"
 #include "../spi.h"
 #include "../util.h"
+#include "../spi_pump.h"
 
 static inline uint64_t tick(void)
 {
@@ -37,200 +39,61 @@ static inline uint64_t tick(void)
 // TODO: Super-dirty temp, factor this into kbuild Makefile.
 #include "../spi.cpp"
 
-volatile SPITask *currentTask = 0;
-volatile uint8_t *taskNextByte = 0;
-volatile uint8_t *taskEndByte = 0;
-
-#define SPI_BUS_PROC_ENTRY_FILENAME "bcm2835_spi_display_bus"
-
-typedef struct mmap_info
-{
-  char *data;
-} mmap_info;
-
-static void p_vm_open(struct vm_area_struct *vma)
-{
-}
-
-static void p_vm_close(struct vm_area_struct *vma)
-{
-}
-
-static int p_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
-{
-  mmap_info *info = (mmap_info *)vma->vm_private_data;
-  if (info->data)
-  {
-    struct page *page = virt_to_page(info->data + vmf->pgoff*PAGE_SIZE);
-    get_page(page);
-    vmf->page = page;
-  }
-  return 0;
-}
-
-static struct vm_operations_struct vm_ops =
-{
-  .open = p_vm_open,
-  .close = p_vm_close,
-  .fault = p_vm_fault,
-};
+// Sends the tasks of the queue out from the SPI interrupt handler, see spi_pump.h. pumpLock serializes the interrupt handler with
+// the kick ioctl from user space.
+static SPIPump pump;
+static DEFINE_SPINLOCK(pumpLock);
 
+// The task queue is one physically contiguous coherent allocation (see InitSPI()), so map all of it to user space up front,
+// instead of faulting it in page by page.
 static int p_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-  vma->vm_ops = &vm_ops;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  if (size > PAGE_ALIGN(SHARED_MEMORY_SIZE) || vma->vm_pgoff != 0) return -EINVAL;
   vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
-  vma->vm_private_data = filp->private_data;
-  p_vm_open(vma);
-  return 0;
-}
-
-static int p_open(struct inode *inode, struct file *filp)
-{
-  mmap_info *info = kmalloc(sizeof(mmap_info), GFP_KERNEL);
-  info->data = (void*)spiTaskMemory;
-  filp->private_data = info;
-  return 0;
+  return dma_mmap_coherent(&spiTaskMemoryDevice->dev, vma, spiTaskMemory, spiTaskMemoryBusAddress, size);
 }
 
-static int p_release(struct inode *inode, struct file *filp)
+// User space calls this after committing tasks to an empty queue (see WakeSPITaskConsumer() in spi.h)
+static long p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-  mmap_info *info;
-  info = filp->private_data;
-  kfree(info);
-  filp->private_data = NULL;
+  unsigned long flags;
+  if (cmd != SPI_BUS_IOCTL_KICK) return -ENOTTY;
+  spin_lock_irqsave(&pumpLock, flags);
+  SPIPumpKick(&pump, tick());
+  spin_unlock_irqrestore(&pumpLock, flags);
   return 0;
 }
 
 static const struct file_operations fops =
 {
   .mmap = p_mmap,
-  .open = p_open,
-  .release = p_release,
+  .unlocked_ioctl = p_ioctl,
 };
 
-#ifdef KERNEL_DRIVE_WITH_IRQ
 static irqreturn_t irq_handler(int irq, void* dev_id)
 {
 #ifndef KERNEL_MODULE_CLIENT_DRIVES
-  uint32_t cs = spi->cs;
-  if (!taskNextByte)
-  {
-    if (currentTask) DoneTask((SPITask*)currentTask);
-    currentTask = GetTask();
-    if (!currentTask)
-    {
-      spi->cs = (cs & ~BCM2835_SPI0_CS_TA) | BCM2835_SPI0_CS_CLEAR;
-      return IRQ_HANDLED;
-    }
-
-    if ((cs & (BCM2835_SPI0_CS_RXF|BCM2835_SPI0_CS_RXR))) (void)spi->fifo;
-    while (!(spi->cs & BCM2835_SPI0_CS_DONE))
-    {
-      if ((spi->cs & (BCM2835_SPI0_CS_RXF|BCM2835_SPI0_CS_RXR|BCM2835_SPI0_CS_RXD)))
-        (void)spi->fifo;
-    }
-    CLEAR_GPIO(GPIO_TFT_DATA_CONTROL);
-    spi->fifo = currentTask->cmd;
-    if (currentTask->size == 0) // Was this a task without data bytes? If so, nothing more to do here, go to sleep to wait for next IRQ event
-    {
-      DoneTask((SPITask*)currentTask);
-      taskNextByte = 0;
-      currentTask = 0;
-    }
-    else
-    {
-      taskNextByte = currentTask->data;
-      taskEndByte = currentTask->data + currentTask->size;
-    }
-#if 0 // Testing overhead of not returning after command byte, but synchronously polling it out..
-    while (!(spi->cs & BCM2835_SPI0_CS_DONE)) ;
-    (void)spi->fifo;
-#else
-    return IRQ_HANDLED;
-#endif
-  }
-  if (taskNextByte == currentTask->data)
-  {
-    SET_GPIO(GPIO_TFT_DATA_CONTROL);
-    __sync_synchronize();
-  }
-
-  // Test code: write and read from FIFO as many bytes as spec says we should be allowed to, without checking CS in between.
-//  int maxBytesToSend = (cs & BCM2835_SPI0_CS_DONE) ? 16 : 12;
-//  if ((cs & BCM2835_SPI0_CS_RXF)) (void)spi->fifo;
-//  if ((cs & BCM2835_SPI0_CS_RXR)) for(int i = 0; i < MIN(maxBytesToSend, taskEndByte-taskNextByte); ++i) { spi->fifo = *taskNextByte++; (void)spi->fifo; }
-//  else for(int i = 0; i < MIN(maxBytesToSend, taskEndByte-taskNextByte); ++i) { spi->fifo = *taskNextByte++; }
-
-  while(taskNextByte < taskEndByte)
-  {
-    uint32_t cs = spi->cs;
-    if ((cs & (BCM2835_SPI0_CS_RXR | BCM2835_SPI0_CS_RXF))) spi->cs = cs | BCM2835_SPI0_CS_CLEAR_RX;
-    if ((cs & BCM2835_SPI0_CS_TXD)) spi->fifo = *taskNextByte++;
-    if ((cs & BCM2835_SPI0_CS_RXD)) (void)spi->fifo;
-    else break;
-  }
-
-  if (taskNextByte >= taskEndByte)
-  {
-    if ((cs & BCM2835_SPI0_CS_INTR)) spi->cs = (cs & ~BCM2835_SPI0_CS_INTR) | BCM2835_SPI0_CS_INTD;
-    taskNextByte = 0;
-  }
-  else
-  {
-    if (!(cs & BCM2835_SPI0_CS_INTR)) spi->cs = (cs | BCM2835_SPI0_CS_INTR) & ~BCM2835_SPI0_CS_INTR;
-  }
+  spin_lock(&pumpLock);
+  ++spiTaskMemory->interruptsRaised;
+  SPIPumpService(&pump, tick());
+  spin_unlock(&pumpLock);
 #endif
   return IRQ_HANDLED;
 }
-#endif
 
 #define req(cnd) if (!(cnd)) { LOG("!!!%s!!!\n", #cnd);}
 
-uint32_t virt_to_bus_address(volatile void *virtAddress)
-{
-  return (uint32_t)virt_to_phys((void*)virtAddress) | 0x40000000U;
-}
-
 volatile int shuttingDown = 0;
-dma_addr_t spiTaskMemoryPhysical = 0;
 
-void PumpSPI(void)
+// Runs the tasks queued so far, and waits until they have been sent.
+static void RunQueuedSPITasks(void)
 {
-#ifdef KERNEL_DRIVE_WITH_IRQ
-  spi->cs = BCM2835_SPI0_CS_CLEAR | BCM2835_SPI0_CS_TA | BCM2835_SPI0_CS_INTR | BCM2835_SPI0_CS_INTD; // Initialize the Control and Status register to defaults: CS=0 (Chip Select), CPHA=0 (Clock Phase), CPOL=0 (Clock Polarity), CSPOL=0 (Chip Select Polarity), TA=0 (Transfer not active), and reset TX and RX queues.
-#else
-  if (spiTaskMemory->queueTail != spiTaskMemory->queueHead)
-  {
-    BEGIN_SPI_COMMUNICATION();
-    {
-      int i = 0;
-      while(spiTaskMemory->queueTail != spiTaskMemory->queueHead)
-      {
-        ++i;
-        if (i > 500) break;
-        SPITask *task = GetTask();
-        if (task)
-        {
-          RunSPITask(task);
-          DoneTask(task);
-        }
-        else
-          break;
-      }
-    }
-    END_SPI_COMMUNICATION();
-  }
-#endif
-}
-
-static struct timer_list my_timer;
- void my_timer_callback( unsigned long data )
-{
-  if (shuttingDown) return;
-
-  PumpSPI();
-  int ret = mod_timer( &my_timer, jiffies + msecs_to_jiffies(1) );
-  if (ret) printk("Error in mod_timer\n");
+  unsigned long flags;
+  spin_lock_irqsave(&pumpLock, flags);
+  SPIPumpKick(&pump, tick());
+  spin_unlock_irqrestore(&pumpLock, flags);
+  while (!SPITaskQueueDrained() && !shuttingDown) msleep(1);
 }
 
 static int display_initialization_thread(void *unused)
@@ -252,7 +115,7 @@ static int display_initialization_thread(void *unused)
 #ifdef DISPLAY_OUTPUT_LANDSCAPE
   madctl |= MADCTL_ROW_COLUMN_EXCHANGE;
 #endif
-#ifdef DISPLAY_ROTATE_180_DEGREES
+#ifdef DISPLAY_ROTATE_180_DEGREES_IN_HARDWARE
     madctl ^= MADCTL_ROTATE_180_DEGREES;
 #endif
   QUEUE_SPI_TRANSFER(0x36/*MADCTL: Memory Access Control*/, madctl);
@@ -264,7 +127,7 @@ static int display_initialization_thread(void *unused)
   QUEUE_SPI_TRANSFER(0xE1/*Negative Gamma Correction*/, 0x00, 0x0E, 0x14, 0x03, 0x11, 0x07, 0x31, 0xC1, 0x48, 0x08, 0x0F, 0x0C, 0x31, 0x36, 0x0F);
   QUEUE_SPI_TRANSFER(0x11/*Sleep Out*/);
 
-  PumpSPI();
+  RunQueuedSPITasks();
   msleep(1000);
   QUEUE_SPI_TRANSFER(/*Display ON*/0x29);
 
@@ -281,7 +144,7 @@ static int display_initialization_thread(void *unused)
       clearLine->data[i] = tick() * y + i;
     CommitTask(clearLine);
   }
-  PumpSPI();
+  RunQueuedSPITasks();
   msleep(1000);
 #endif
 
@@ -296,24 +159,15 @@ static int display_initialization_thread(void *unused)
     memset((void*)clearLine->data, 0, DISPLAY_SCANLINE_SIZE);
     CommitTask(clearLine);
   }
-  PumpSPI();
+  RunQueuedSPITasks();
 
   QUEUE_SPI_TRANSFER(DISPLAY_SET_CURSOR_X, 0, 0, DISPLAY_WIDTH >> 8, DISPLAY_WIDTH & 0xFF);
   QUEUE_SPI_TRANSFER(DISPLAY_SET_CURSOR_Y, 0, 0, DISPLAY_HEIGHT >> 8, DISPLAY_HEIGHT & 0xFF);
-
-  spi->cs = BCM2835_SPI0_CS_CLEAR | BCM2835_SPI0_CS_TA | BCM2835_SPI0_CS_INTR | BCM2835_SPI0_CS_INTD;
+  RunQueuedSPITasks();
 #endif
 
-  PumpSPI();
-
   // Expose SPI worker ring bus to user space driver application.
   proc_create(SPI_BUS_PROC_ENTRY_FILENAME, 0, NULL, &fops);
-
-  setup_timer(&my_timer, my_timer_callback, 0);
-   printk("Starting timer to fire in 200ms (%ld)\n", jiffies);
-  int ret = mod_timer( &my_timer, jiffies + msecs_to_jiffies(200) );
-  if (ret) printk("Error in mod_timer\n");
- 
   return 0;
 }
 
@@ -324,16 +178,13 @@ static uint32_t irqRegistered = 0;
 int bcm2835_spi_display_init(void)
 {
   InitSPI();
-#ifdef KERNEL_DRIVE_WITH_IRQ
+  if (!spiTaskMemory) FATAL_ERROR("Shared memory block not initialized!");
+  LOG("PhysBase: %p", (void*)spiTaskMemory->sharedMemoryBaseInPhysMemory);
+
+  SPIPumpInit(&pump, tick());
   int ret = request_irq(84, irq_handler, IRQF_SHARED, "spi_handler", &irqHandlerCookie);
   if (ret != 0) FATAL_ERROR("request_irq failed!");
   irqRegistered = 1;
-#endif
-
-  if (!spiTaskMemory) FATAL_ERROR("Shared memory block not initialized!");
-
-  spiTaskMemory->sharedMemoryBaseInPhysMemory = (uint32_t)virt_to_phys(spiTaskMemory) | 0x40000000U;
-  LOG("PhysBase: %p", (void*)spiTaskMemory->sharedMemoryBaseInPhysMemory);
 
   displayThread = kthread_create(display_initialization_thread, NULL, "display_thread");
   if (displayThread) wake_up_process(displayThread);
@@ -344,21 +195,18 @@ int bcm2835_spi_display_init(void)
 void bcm2835_spi_display_exit(void)
 {
   shuttingDown = 1;
-  msleep(2000);
-  spi->cs = BCM2835_SPI0_CS_CLEAR;
-  msleep(200);
-  DeinitSPI();
-
+  remove_proc_entry(SPI_BUS_PROC_ENTRY_FILENAME, NULL);
   if (irqRegistered)
   {
     free_irq(84, &irqHandlerCookie);
     irqRegistered = 0;
   }
+  spi->cs = BCM2835_SPI0_CS_CLEAR;
 
-  remove_proc_entry(SPI_BUS_PROC_ENTRY_FILENAME, NULL);
-
-  int ret = del_timer( &my_timer );
-  if (ret) printk("The timer is still in use...\n");}
+  LOG("SPI pump: %u tasks, %llu bytes, %u interrupts, %u kicks (%u while idle), bus idle for %llu usecs with the queue empty",
+      pump.tasksDone, pump.bytesSent, spiTaskMemory->interruptsRaised, pump.kicks, pump.kicksWhileIdle, pump.idleUsecs);
+  DeinitSPI();
+}
 
 module_init(bcm2835_spi_display_init);
 module_exit(bcm2835_spi_display_exit);
@@ -0,0 +1,177 @@
+#include "config.h"
+#include "pacing.h"
+#include "display.h"
+#include "util.h"
+
+#include <math.h>
+#include <memory.h>
+
+#define TARGET_FRAME_INTERVAL_USECS (1000000 / TARGET_FRAME_RATE)
+
+// Past this long without changes the screen counts as idle, and polling slows down to at most MAX_IDLE_POLL_INTERVAL_USECS
+#define IDLE_AFTER_USECS 1000000
+#define MAX_IDLE_POLL_INTERVAL_USECS 500000
+
+// Number of observed frame arrivals that the prediction is made from
+#define FRAME_HISTORY_SIZE 16
+
+// Once the arrival of the next frame is known to within this many usecs, it is captured this long after it has surely landed.
+// Until then, captures probe in the middle of the window where it can arrive, to narrow it down.
+#define FRAME_ARRIVAL_RESOLUTION_USECS 3000
+#define FRAME_ARRIVAL_MARGIN_USECS 500
+
+// Sources do not update exactly on time, arrivals may be off the steady interval by this much either way
+#define FRAME_ARRIVAL_JITTER_USECS 1000
+
+// Captures are never closer together than this, in case a prediction goes wrong
+#define MIN_CAPTURE_SPACING_USECS 1000
+
+// A new frame is only ever observed at a capture, so all that is known about when it arrived is that it was after the previous
+// capture and no later than this one.
+typedef struct FrameArrival {
+    uint64_t after, by;
+} FrameArrival;
+
+static struct {
+    uint64_t slotOrigin; // The target frame slots are at slotOrigin + k*TARGET_FRAME_INTERVAL_USECS
+    uint64_t lastCapture; // Start times of the latest capture, and of the latest one that found new content
+    uint64_t lastChange;
+    bool hasChanged;
+    FrameArrival history[FRAME_HISTORY_SIZE]; // Ring of the latest frame arrivals, oldest first from historyStart
+    int historyStart, historyLength;
+    uint64_t frameInterval; // Predicted interval of the source, 0 if none
+    uint64_t predictedCapture; // When to capture next according to the prediction, 0 if none
+} pacing;
+
+void InitFramePacing(uint64_t now) {
+    memset(&pacing, 0, sizeof(pacing));
+    pacing.slotOrigin = now;
+    pacing.lastCapture = pacing.lastChange = now;
+}
+
+static inline FrameArrival &HistoryAt(int i) {
+    return pacing.history[(pacing.historyStart + i) % FRAME_HISTORY_SIZE];
+}
+
+// Fits a steady update interval to the observed arrivals, and works out the window that the next arrival falls into, given that it
+// did not land before the latest capture. Assumes that no frames went unobserved in between. Returns false if the arrivals do not
+// fit a steady interval.
+//
+// With arrival i at first + i*interval, each observed window (after, by] bounds first + i*interval from both sides. The pairs of
+// (first, interval) that satisfy all of these form a convex polygon, and the earliest and latest possible next arrival are at its
+// corners, where two of the bounds meet. There are only 2*FRAME_HISTORY_SIZE bounds, so all pairs are tried.
+static bool PredictNextFrameArrival() {
+    pacing.frameInterval = pacing.predictedCapture = 0;
+    const int n = pacing.historyLength;
+    if (n < 4) return true;
+    // Times relative to the start of the oldest window, in usecs
+    const uint64_t origin = HistoryAt(0).after;
+    double bound[2 * FRAME_HISTORY_SIZE];
+    for (int i = 0; i < n; ++i) {
+        bound[2 * i] = (double) (HistoryAt(i).after - origin);
+        bound[2 * i + 1] = (double) (HistoryAt(i).by - origin);
+    }
+    double earliest = 1e18, latest = -1e18, minInterval = 1e18, maxInterval = -1e18;
+    for (int u = 0; u < 2 * n; ++u)
+        for (int v = u + 1; v < 2 * n; ++v) {
+            const int i = u / 2, j = v / 2;
+            if (i == j) continue;
+            const double interval = (bound[v] - bound[u]) / (j - i);
+            const double first = bound[u] - i * interval;
+            bool inside = interval > 0;
+            for (int k = 0; k < n && inside; ++k) {
+                const double t = first + k * interval;
+                inside = t >= bound[2 * k] - FRAME_ARRIVAL_JITTER_USECS && t <= bound[2 * k + 1] + FRAME_ARRIVAL_JITTER_USECS;
+            }
+            if (!inside) continue;
+            earliest = MIN(earliest, first + n * interval);
+            latest = MAX(latest, first + n * interval);
+            minInterval = MIN(minInterval, interval);
+            maxInterval = MAX(maxInterval, interval);
+        }
+    if (earliest > latest) return false;
+    const uint64_t interval = (uint64_t) ((minInterval + maxInterval) / 2);
+    // A source that updates faster than the target frame rate is captured on every slot anyway
+    if (interval + MIN_CAPTURE_SPACING_USECS < TARGET_FRAME_INTERVAL_USECS) return true;
+
+    const uint64_t after = MAX(origin + (uint64_t) earliest, pacing.lastCapture), by = origin + (uint64_t) latest;
+    if (after >= by) return true; // Late, wait for it
+    pacing.frameInterval = interval;
+    pacing.predictedCapture = (by - after > FRAME_ARRIVAL_RESOLUTION_USECS) ? after + (by - after) / 2
+                                                                           : by + FRAME_ARRIVAL_MARGIN_USECS;
+    return true;
+}
+
+static void RecordFrameArrival(uint64_t after, uint64_t by) {
+    // After a pause, the earlier arrivals say nothing about the phase of the source anymore
+    const uint64_t pause = pacing.frameInterval ? 2 * pacing.frameInterval + FRAME_ARRIVAL_RESOLUTION_USECS : IDLE_AFTER_USECS / 4;
+    if (pacing.historyLength > 0 && by - HistoryAt(pacing.historyLength - 1).by > pause) pacing.historyLength = 0;
+    if (pacing.historyLength == FRAME_HISTORY_SIZE) {
+        pacing.historyStart = (pacing.historyStart + 1) % FRAME_HISTORY_SIZE;
+        --pacing.historyLength;
+    }
+    FrameArrival &a = HistoryAt(pacing.historyLength++);
+    a.after = after;
+    a.by = by;
+}
+
+uint64_t NextFrameCaptureTime() {
+    const uint64_t last = pacing.lastCapture;
+#ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
+    uint64_t next = pacing.slotOrigin + ((last - pacing.slotOrigin) / TARGET_FRAME_INTERVAL_USECS + 1) * TARGET_FRAME_INTERVAL_USECS;
+#else
+    uint64_t next = last + TARGET_FRAME_INTERVAL_USECS / 4;
+#endif
+
+#ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
+    const uint64_t idle = last - pacing.lastChange;
+    if (idle >= IDLE_AFTER_USECS) return MAX(next, last + MIN(idle / 10, MAX_IDLE_POLL_INTERVAL_USECS));
+#endif
+
+#ifdef SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
+    if (pacing.predictedCapture) next = pacing.predictedCapture;
+#endif
+    return MAX(next, last + MIN_CAPTURE_SPACING_USECS);
+}
+
+void FrameCaptured(uint64_t captureStart, uint64_t captureEnd, bool changed, FramePacingStatistics *stats) {
+    ++stats->captures;
+    stats->busyUsecs += captureEnd - captureStart;
+    if (changed) {
+        if (pacing.hasChanged) {
+            const double interval = (double) (captureStart - pacing.lastChange);
+            ++stats->frameIntervals;
+            stats->frameIntervalSum += interval;
+            stats->frameIntervalSumSquares += interval * interval;
+        }
+        ++stats->frames;
+        RecordFrameArrival(pacing.lastCapture, captureStart);
+        pacing.lastChange = captureStart;
+        pacing.hasChanged = true;
+    }
+    pacing.lastCapture = captureStart;
+    // A frame that arrives off the predicted interval means that the source changed its rate or skipped a frame, start over from
+    // it. A frame that is late only ends the prediction until it arrives.
+    if (!PredictNextFrameArrival() && changed) {
+        pacing.historyStart = (pacing.historyStart + pacing.historyLength - 1) % FRAME_HISTORY_SIZE;
+        pacing.historyLength = 1;
+    }
+}
+
+uint64_t PredictedFrameInterval() {
+    return pacing.frameInterval;
+}
+
+double AchievedFrameRate(const FramePacingStatistics *stats, uint64_t elapsedUsecs) {
+    return elapsedUsecs ? stats->frames * 1e6 / elapsedUsecs : 0.0;
+}
+
+double FrameIntervalJitterUsecs(const FramePacingStatistics *stats) {
+    if (!stats->frameIntervals) return 0.0;
+    const double mean = stats->frameIntervalSum / stats->frameIntervals;
+    return sqrt(MAX(stats->frameIntervalSumSquares / stats->frameIntervals - mean * mean, 0.0));
+}
+
+double BusyDutyCycle(const FramePacingStatistics *stats, uint64_t elapsedUsecs) {
+    return elapsedUsecs ? (double) stats->busyUsecs / elapsedUsecs : 0.0;
+}
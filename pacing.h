@@ -0,0 +1,37 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Frame pacing: decides when the main loop captures, diffs and submits the next frame, as tick() times in microseconds.
+// - SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME: captures happen on a fixed grid of 1/TARGET_FRAME_RATE second slots, and the main
+//   loop sleeps in between. Otherwise the source is polled four times per slot, for lower latency at a higher CPU cost.
+// - SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE: while the screen stays static, polling slows down progressively to 10fps after a second
+//   and to 2fps after five seconds. The first change goes back to full rate.
+// - SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES: learns the update interval and phase of the source from the times at which
+//   new frames were observed, and captures right after the next one is due to land instead of polling for it. A source that
+//   updates at e.g. 24 or 30fps is then captured once per frame, shortly after each frame arrives.
+
+typedef struct FramePacingStatistics {
+    uint32_t captures; // Times that the source was captured and diffed
+    uint32_t frames; // Captures that found new content
+    uint32_t frameIntervals; // Number of intervals between two consecutive captures with new content, and their sum and sum of squares in usecs
+    double frameIntervalSum, frameIntervalSumSquares;
+    uint64_t busyUsecs; // Time spent capturing, diffing and queueing
+} FramePacingStatistics;
+
+void InitFramePacing(uint64_t now);
+
+// Returns the time at which the next frame should be captured. May be in the past, in which case the capture is due right away.
+uint64_t NextFrameCaptureTime(void);
+
+// Reports a capture that started at captureStart and finished at captureEnd, and whether it found new content on the source.
+void FrameCaptured(uint64_t captureStart, uint64_t captureEnd, bool changed, FramePacingStatistics *stats);
+
+// Returns the update interval of the source in usecs as currently predicted, or 0 if the source has no steady update rate.
+uint64_t PredictedFrameInterval(void);
+
+// Frame rate, standard deviation of the interval between frames (the jitter), and the share of time spent busy, of the given
+// statistics over elapsedUsecs.
+double AchievedFrameRate(const FramePacingStatistics *stats, uint64_t elapsedUsecs);
+double FrameIntervalJitterUsecs(const FramePacingStatistics *stats);
+double BusyDutyCycle(const FramePacingStatistics *stats, uint64_t elapsedUsecs);
@@ -0,0 +1,305 @@
+#include "config.h"
+#include "pipeline.h"
+#include "diff.h"
+#include "display.h"
+#include "framebuffer.h"
+#include "mem_alloc.h"
+#include "scroll.h"
+#include "spi.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+
+int framePipelineWorkers = 0;
+
+#if defined(NO_INTERLACING)
+int frameInterlacing = INTERLACING_NEVER;
+#elif defined(ALWAYS_INTERLACING)
+int frameInterlacing = INTERLACING_ALWAYS;
+#else
+int frameInterlacing = INTERLACING_ADAPTIVE;
+#endif
+
+// Field of the next interlaced frame, and whether the latest frame left the other field out
+static int nextField = 0;
+static bool fieldLeftOut = false;
+
+// Whether the frame being processed is captured from the source, or only diffs the rows that the previous one left out of the frame
+// that it captured
+static bool captureSource = true;
+
+// Whether the frame being processed is checked for scrolling (see scroll.h), in which case all of it is captured before any of it
+// is diffed
+static bool checkScroll = false;
+
+#define MAX_FRAME_PIPELINE_BANDS (MAX_FRAME_PIPELINE_WORKERS * FRAME_PIPELINE_BANDS_PER_WORKER)
+
+// Each band goes through these states in order every frame. Workers run the CAPTURING, DIFFING and FILLING steps, the main thread
+// the rest. The CAPTURING step is only taken by frames that are checked for scrolling, otherwise bands are captured as they are
+// diffed.
+#define BAND_CAPTURING 0 // Queued for, or being captured and hashed by a worker
+#define BAND_CAPTURED 1 // Waiting for the main thread to check the whole frame for scrolling
+#define BAND_DIFFING 2 // Queued for, or being captured and diffed by a worker
+#define BAND_DIFFED 3 // Waiting for the main thread to reserve its tasks
+#define BAND_FILLING 4 // Queued for, or having the pixels of its reserved tasks filled in by a worker
+#define BAND_FILLED 5 // Waiting for the main thread to publish its tasks
+
+typedef struct FrameBand {
+    int y, endY; // Rows of the frame in this band
+    int state; // BAND_*, guarded by pipelineLock
+    Span *spans; // Points into the global spans array, at row y
+    int numSpans;
+    int *openSpansScratch;
+    SpanTask *tasks; // Pixel write tasks reserved for the spans
+    int numTasks;
+    SPITaskReservation reservation;
+    uint32_t queueBytes; // Upper bound of the task queue memory that the tasks of the band take
+    FrameDiffStatistics stats;
+} FrameBand;
+
+static FrameBand bands[MAX_FRAME_PIPELINE_BANDS];
+static int numBands = 0;
+static SpanTask *spanTasks = 0; // Storage for the SpanTasks of all bands, laid out by row like spans
+static pthread_t workers[MAX_FRAME_PIPELINE_WORKERS];
+
+static pthread_mutex_t pipelineLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workAvailable = PTHREAD_COND_INITIALIZER; // Signaled when a band is queued for the workers
+static pthread_cond_t bandFinished = PTHREAD_COND_INITIALIZER; // Signaled when a worker has finished a step of a band
+static int workQueue[MAX_FRAME_PIPELINE_BANDS]; // Ring of indices to bands, each band is queued at most once at a time
+static int workQueueStart = 0, workQueueLength = 0;
+static bool workersQuit = false;
+
+// Tasks of the bands that have been reserved but not yet published take up room in the task queue that the SPI thread cannot free.
+// Reserving is held back while more than this is in flight, so that AllocTask() always gets room by waiting only for the SPI thread
+// to run what has been published. The first band past the limit is still let in when nothing else is in flight: it is at most
+// half a frame, and the queue holds three.
+#define MAX_RESERVED_QUEUE_BYTES (SPI_QUEUE_SIZE / 2)
+
+static void QueueBand(int band) {
+    workQueue[(workQueueStart + workQueueLength++) % MAX_FRAME_PIPELINE_BANDS] = band;
+    pthread_cond_signal(&workAvailable);
+}
+
+static void CaptureBand(FrameBand *b) {
+    CaptureFramebufferRows(framebuffer[0], FRAME_STRIDE, b->y, b->endY);
+    HashScrollRows(b->y, b->endY);
+}
+
+static void DiffBand(FrameBand *b) {
+    if (captureSource && !checkScroll) CaptureFramebufferRows(framebuffer[0], FRAME_STRIDE, b->y, b->endY);
+    b->stats.bytesTransmitted = 0;
+    b->numSpans = DiffFramebufferRowsToSpans(framebuffer[0], framebuffer[1], b->y, b->endY, b->spans, b->openSpansScratch,
+                                             &b->stats);
+
+    // Cursor commands and pixel write tasks of each chunk of rows (see SubmitSpans()), as they lie in the task queue. A span across
+    // the row where a scrolled display wraps around in GRAM is split there, which can take one more chunk.
+    b->queueBytes = SPI_MAX_PIXEL_TASK_BYTES + sizeof(SPITask); // Room that a wrap around the end of the queue can waste
+    const int wrapY = ScrollWrapRow();
+    for (int i = 0; i < b->numSpans; ++i) {
+        const Span &s = b->spans[i];
+        const int chunks = (s.endY - s.y + PIXEL_TASK_ROWS(s.endX - s.x) - 1) / PIXEL_TASK_ROWS(s.endX - s.x) +
+                           (s.y < wrapY && s.endY > wrapY);
+        b->queueBytes += s.size * SPI_BYTESPERPIXEL + chunks * (3 * sizeof(SPITask) + 2 * 8);
+    }
+}
+
+static void *FramePipelineWorker(void *unused) {
+    pthread_mutex_lock(&pipelineLock);
+    for (;;) {
+        while (!workQueueLength && !workersQuit) pthread_cond_wait(&workAvailable, &pipelineLock);
+        if (!workQueueLength) break;
+        FrameBand *b = &bands[workQueue[workQueueStart]];
+        workQueueStart = (workQueueStart + 1) % MAX_FRAME_PIPELINE_BANDS;
+        --workQueueLength;
+        const int state = b->state;
+        pthread_mutex_unlock(&pipelineLock);
+
+        if (state == BAND_CAPTURING) CaptureBand(b);
+        else if (state == BAND_DIFFING) DiffBand(b);
+        else FillSpanTasks(b->tasks, b->numTasks, framebuffer[0], FRAME_STRIDE);
+
+        pthread_mutex_lock(&pipelineLock);
+        b->state = state + 1;
+        pthread_cond_signal(&bandFinished);
+    }
+    pthread_mutex_unlock(&pipelineLock);
+    return 0;
+}
+
+void InitFramePipeline(int numWorkers) {
+    if (numWorkers < 0) {
+#if defined(FRAME_PIPELINE_WORKERS)
+        numWorkers = FRAME_PIPELINE_WORKERS;
+#elif defined(SINGLE_CORE_BOARD)
+        numWorkers = 0;
+#else
+        // A single worker would only add handovers to the work of the main thread
+        numWorkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (numWorkers < 2) numWorkers = 0;
+#endif
+    }
+    framePipelineWorkers = MIN(numWorkers, MAX_FRAME_PIPELINE_WORKERS);
+    if (!framePipelineWorkers) return;
+
+    numBands = framePipelineWorkers * FRAME_PIPELINE_BANDS_PER_WORKER;
+    spanTasks = (SpanTask *) Malloc(MAX_SPANS_PER_ROW * FRAME_HEIGHT * sizeof(SpanTask), "pipeline.cpp span tasks");
+    const int rowsPerBand = (FRAME_HEIGHT + numBands - 1) / numBands;
+    for (int i = 0; i < numBands; ++i) {
+        FrameBand *b = &bands[i];
+        b->y = MIN(i * rowsPerBand, FRAME_HEIGHT);
+        b->endY = MIN(b->y + rowsPerBand, FRAME_HEIGHT);
+        b->spans = spans + b->y * MAX_SPANS_PER_ROW;
+        b->tasks = spanTasks + b->y * MAX_SPANS_PER_ROW;
+        b->openSpansScratch = (int *) Malloc(2 * MAX_SPANS_PER_ROW * sizeof(int), "pipeline.cpp open spans");
+    }
+
+    workersQuit = false;
+    workQueueStart = workQueueLength = 0;
+    for (int i = 0; i < framePipelineWorkers; ++i)
+        if (pthread_create(&workers[i], NULL, FramePipelineWorker, NULL) != 0)
+            FATAL_ERROR("Failed to create frame pipeline worker thread!");
+}
+
+void DeinitFramePipeline() {
+    if (!framePipelineWorkers) return;
+    pthread_mutex_lock(&pipelineLock);
+    workersQuit = true;
+    pthread_cond_broadcast(&workAvailable);
+    pthread_mutex_unlock(&pipelineLock);
+    for (int i = 0; i < framePipelineWorkers; ++i)
+        pthread_join(workers[i], NULL);
+    for (int i = 0; i < numBands; ++i) {
+        free(bands[i].openSpansScratch);
+        bands[i].openSpansScratch = 0;
+    }
+    free(spanTasks);
+    spanTasks = 0;
+    framePipelineWorkers = numBands = 0;
+}
+
+static void RunPipeline(FrameDiffStatistics *stats) {
+    BeginFrameWrites();
+    checkScroll = captureSource && ScrollDetectionEnabled();
+    if (!framePipelineWorkers) {
+        FrameDiffStatistics frameStats = {};
+        if (captureSource) CaptureFramebufferFrame(framebuffer[0], FRAME_STRIDE);
+        if (checkScroll) {
+            HashScrollRows(0, FRAME_HEIGHT);
+            ScrollDisplayToFrame(stats);
+        }
+        int numSpans = DiffFramebuffersToSpans(framebuffer[0], framebuffer[1], &frameStats);
+        stats->changedPixels += frameStats.changedPixels;
+        stats->spans += frameStats.spans;
+        stats->coarsePixels += frameStats.coarsePixels;
+        stats->maxCoarseError = MAX(stats->maxCoarseError, frameStats.maxCoarseError);
+        stats->bytesTransmitted += SubmitSpans(spans, numSpans, framebuffer[0], FRAME_STRIDE);
+        SwapFramebuffers();
+        return;
+    }
+
+    pthread_mutex_lock(&pipelineLock);
+    if (checkScroll) {
+        // The scroll has to be known before any band is diffed, and queued before any of their tasks
+        for (int i = 0; i < numBands; ++i) {
+            bands[i].state = BAND_CAPTURING;
+            QueueBand(i);
+        }
+        for (int i = 0; i < numBands; ++i)
+            while (bands[i].state != BAND_CAPTURED) pthread_cond_wait(&bandFinished, &pipelineLock);
+        pthread_mutex_unlock(&pipelineLock);
+        ScrollDisplayToFrame(stats);
+        pthread_mutex_lock(&pipelineLock);
+    }
+    for (int i = 0; i < numBands; ++i) {
+        bands[i].state = BAND_DIFFING;
+        QueueBand(i);
+    }
+
+    int nextToReserve = 0, nextToPublish = 0;
+    uint32_t reservedQueueBytes = 0;
+    while (nextToPublish < numBands) {
+        FrameBand *p = &bands[nextToPublish];
+        if (p->state == BAND_FILLED) {
+            pthread_mutex_unlock(&pipelineLock);
+            PublishReservedTasks(p->reservation);
+            reservedQueueBytes -= p->queueBytes;
+            stats->changedPixels += p->stats.changedPixels;
+            stats->spans += p->stats.spans;
+            stats->coarsePixels += p->stats.coarsePixels;
+            stats->maxCoarseError = MAX(stats->maxCoarseError, p->stats.maxCoarseError);
+            stats->bytesTransmitted += p->stats.bytesTransmitted;
+            ++nextToPublish;
+            pthread_mutex_lock(&pipelineLock);
+            continue;
+        }
+
+        FrameBand *r = (nextToReserve < numBands) ? &bands[nextToReserve] : 0;
+        if (r && r->state == BAND_DIFFED &&
+            (!reservedQueueBytes || reservedQueueBytes + r->queueBytes <= MAX_RESERVED_QUEUE_BYTES)) {
+            // The display cursor commands depend on the tasks before, so tasks are reserved on this thread, in scan order.
+            pthread_mutex_unlock(&pipelineLock);
+            BeginTaskReservation();
+            r->numTasks = ReserveSpans(r->spans, r->numSpans, r->tasks, &r->stats.bytesTransmitted);
+            r->reservation = EndTaskReservation();
+            reservedQueueBytes += r->queueBytes;
+            ++nextToReserve;
+            pthread_mutex_lock(&pipelineLock);
+            if (r->numTasks) {
+                r->state = BAND_FILLING;
+                QueueBand((int) (r - bands));
+            } else
+                r->state = BAND_FILLED;
+            continue;
+        }
+
+        pthread_cond_wait(&bandFinished, &pipelineLock);
+    }
+    pthread_mutex_unlock(&pipelineLock);
+    SwapFramebuffers();
+}
+
+// The field to update the next frame in, or DIFF_ALL_ROWS for a progressive update
+static int ChooseDiffField() {
+    bool interlace = (frameInterlacing == INTERLACING_ALWAYS);
+    if (frameInterlacing == INTERLACING_ADAPTIVE) {
+        // SPIBytesQueued() is an estimate, as the SPI thread keeps going, but the bus falling behind by a whole frame interval
+        // shows well enough
+        interlace = SPIBytesQueued() * NOMINAL_SPI_USECS_PER_BYTE > 1e6 / TARGET_FRAME_RATE;
+    }
+    if (!interlace) return DIFF_ALL_ROWS;
+    const int field = nextField;
+    nextField ^= 1;
+    return field;
+}
+
+void RunFramePipeline(FrameDiffStatistics *stats) {
+    const int field = ChooseDiffField();
+    SetDiffField(field);
+    captureSource = true;
+    RunPipeline(stats);
+    fieldLeftOut = (field != DIFF_ALL_ROWS);
+    if (fieldLeftOut) ++stats->interlacedFrames;
+}
+
+bool SendLeftOutFieldWhenBusIdle(uint64_t deadline, FrameDiffStatistics *stats) {
+#ifdef THROTTLE_INTERLACING
+    (void) deadline;
+    (void) stats;
+    return false;
+#else
+    if (!fieldLeftOut) return false;
+    uint64_t now = tick();
+    const uint64_t idle = now + (uint64_t) (SPIBytesQueued() * NOMINAL_SPI_USECS_PER_BYTE);
+    if (idle >= deadline) return false;
+    if (idle > now) usleep(idle - now);
+    SetDiffField(DIFF_LEFT_OUT_ROWS);
+    captureSource = false;
+    RunPipeline(stats);
+    fieldLeftOut = false;
+    return true;
+#endif
+}
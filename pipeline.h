@@ -0,0 +1,43 @@
+#pragma once
+
+#include "diff.h"
+
+// Splits the frame work (capture and RGB565 conversion, diff, and filling in the pixels of the SPI tasks) into horizontal bands
+// that a pool of worker threads processes in parallel. The main thread reserves the tasks of each band in the SPI task queue in
+// scan order as soon as the band has been diffed (see BeginTaskReservation()), and publishes them in that same order once a worker
+// has filled them in, so the display receives the bands top to bottom while several of them are being worked on at once.
+
+// Upper limit for the number of worker threads
+#define MAX_FRAME_PIPELINE_WORKERS 8
+
+// Number of bands each worker gets per frame. More bands than workers evens out the load when the changes on the screen are not
+// spread evenly, at the cost of splitting spans that cross band edges.
+#define FRAME_PIPELINE_BANDS_PER_WORKER 2
+
+// Number of worker threads started by InitFramePipeline(), 0 if the main thread processes frames by itself
+extern int framePipelineWorkers;
+
+// Starts the given number of worker threads. Pass a negative number for the default, FRAME_PIPELINE_WORKERS if defined, otherwise
+// one per CPU core, or none on single core boards. Call after InitDiff().
+void InitFramePipeline(int numWorkers);
+
+void DeinitFramePipeline(void);
+
+// Captures the source framebuffer into framebuffer[0], diffs it against framebuffer[1], queues the tasks that update the changed
+// spans of the display, and swaps the framebuffers. Adds the statistics of the frame to *stats. Called on the main thread, the
+// only producer of the SPI task queue.
+void RunFramePipeline(FrameDiffStatistics *stats);
+
+// How RunFramePipeline() interlaces, see NO_INTERLACING and ALWAYS_INTERLACING in config.h. INTERLACING_ADAPTIVE updates frames
+// progressively while the SPI bus keeps up. While more is queued than the bus sends in one 1/TARGET_FRAME_RATE interval, it only
+// updates one field of each frame, the even and the odd rows in turn, which halves the bytes per frame so that motion keeps its
+// pace instead of the frame rate dropping.
+#define INTERLACING_NEVER 0
+#define INTERLACING_ADAPTIVE 1
+#define INTERLACING_ALWAYS 2
+extern int frameInterlacing;
+
+// If the latest frame was interlaced, and the SPI bus runs out of queued tasks before the given tick() time, waits until then and
+// sends the field that the frame left out, from the same captured frame. Returns whether it did. Does nothing under
+// THROTTLE_INTERLACING, where the other field waits for the next frame.
+bool SendLeftOutFieldWhenBusIdle(uint64_t deadline, FrameDiffStatistics *stats);
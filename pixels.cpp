@@ -0,0 +1,260 @@
+#include "config.h"
+#include "pixels.h"
+
+#include <memory.h>
+#include <stddef.h>
+
+void RotateXRGB8888ToRGB565BEScalar(const uint8_t *src, int srcStride, int srcHeight, int startX, int endX, uint8_t *dst,
+                                    int dstStride, bool redInLowByte) {
+    for (int x = startX; x < endX; ++x, dst += dstStride)
+        for (int j = 0; j < srcHeight; ++j)
+            ConvertXRGB8888ToRGB565BEScalar(src + (size_t) (srcHeight - 1 - j) * srcStride + x * 4, dst + j * 2, 1, redInLowByte);
+}
+
+void Rotate270XRGB8888ToRGB565BEScalar(const uint8_t *src, int srcStride, int srcHeight, int startX, int endX, uint8_t *dst,
+                                       int dstStride, bool redInLowByte) {
+    for (int x = endX - 1; x >= startX; --x, dst += dstStride)
+        for (int j = 0; j < srcHeight; ++j)
+            ConvertXRGB8888ToRGB565BEScalar(src + (size_t) j * srcStride + x * 4, dst + j * 2, 1, redInLowByte);
+}
+
+#if defined(PIXEL_KERNELS_NEON)
+const char *pixelKernelsIsa = "NEON";
+#elif defined(PIXEL_KERNELS_SSE2)
+const char *pixelKernelsIsa = "SSE2";
+#else
+const char *pixelKernelsIsa = "scalar";
+#endif
+
+#ifdef DISPLAY_SWAP_BGR
+#define SWAP_BGR true
+#else
+#define SWAP_BGR false
+#endif
+
+// Packs the two color channels that go to the top and bottom 5 bits of a RGB565 pixel and the green channel, and returns the
+// pixel in the byte order it is sent in (big endian) when stored as a uint16_t. Matches PackRGB565() in framebuffer.cpp.
+static inline uint16_t PackRGB565BE(uint32_t top, uint32_t g, uint32_t bottom) {
+    uint16_t c = (uint16_t) (((top >> 3) << 11) | ((g >> 2) << 5) | (bottom >> 3));
+#ifdef DISPLAY_INVERT_COLORS
+    c = ~c;
+#endif
+    return (uint16_t) ((c >> 8) | (c << 8));
+}
+
+void ConvertXRGB8888ToRGB565BEScalar(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte) {
+    // The channel in the low byte goes to the top bits if it is red, unless the display wants red and blue swapped
+    const bool lowByteToTop = redInLowByte != SWAP_BGR;
+    for (int x = 0; x < width; ++x, src += 4, dst += 2) {
+        uint16_t c = lowByteToTop ? PackRGB565BE(src[0], src[1], src[2]) : PackRGB565BE(src[2], src[1], src[0]);
+        memcpy(dst, &c, sizeof(c));
+    }
+}
+
+void ConvertRGB888ToRGB565BEScalar(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte) {
+    const bool lowByteToTop = redInLowByte != SWAP_BGR;
+    for (int x = 0; x < width; ++x, src += 3, dst += 2) {
+        uint16_t c = lowByteToTop ? PackRGB565BE(src[0], src[1], src[2]) : PackRGB565BE(src[2], src[1], src[0]);
+        memcpy(dst, &c, sizeof(c));
+    }
+}
+
+#if defined(PIXEL_KERNELS_NEON)
+
+// NEON deinterleaves the color channels of 16 pixels into their own registers (vld3/vld4), computes both bytes of the big endian
+// RGB565 pixels with shift-and-insert, and interleaves them back on store (vst2).
+static inline uint8x16x2_t PackRGB565BEx16(uint8x16_t top, uint8x16_t g, uint8x16_t bottom) {
+    uint8x16x2_t c;
+    c.val[0] = vsriq_n_u8(top, g, 5); // rrrrrggg
+    c.val[1] = vsriq_n_u8(vshlq_n_u8(g, 3), bottom, 3); // gggbbbbb
+#ifdef DISPLAY_INVERT_COLORS
+    c.val[0] = vmvnq_u8(c.val[0]);
+    c.val[1] = vmvnq_u8(c.val[1]);
+#endif
+    return c;
+}
+
+// Converts 8 XRGB8888 pixels to RGB565 big endian, as they are stored in memory
+static inline uint16x8_t ConvertXRGB8888x8(const uint8_t *src, bool lowByteToTop) {
+    uint8x8x4_t p = vld4_u8(src);
+    uint8x8_t top = lowByteToTop ? p.val[0] : p.val[2], g = p.val[1], bottom = lowByteToTop ? p.val[2] : p.val[0];
+    uint8x8_t hi = vsri_n_u8(top, g, 5), lo = vsri_n_u8(vshl_n_u8(g, 3), bottom, 3);
+#ifdef DISPLAY_INVERT_COLORS
+    hi = vmvn_u8(hi);
+    lo = vmvn_u8(lo);
+#endif
+    uint8x8x2_t z = vzip_u8(hi, lo);
+    return vreinterpretq_u16_u8(vcombine_u8(z.val[0], z.val[1]));
+}
+
+// Transposes an 8x8 block of 16-bit pixels in registers: r[i] receives what was column i
+static inline void Transpose8x8(uint16x8_t r[8]) {
+    uint16x8x2_t t01 = vtrnq_u16(r[0], r[1]), t23 = vtrnq_u16(r[2], r[3]);
+    uint16x8x2_t t45 = vtrnq_u16(r[4], r[5]), t67 = vtrnq_u16(r[6], r[7]);
+    // Columns 0 and 4 of rows 0-3 in u02.val[0], columns 2 and 6 in u02.val[1], and so on
+    uint32x4x2_t u02 = vtrnq_u32(vreinterpretq_u32_u16(t01.val[0]), vreinterpretq_u32_u16(t23.val[0]));
+    uint32x4x2_t u13 = vtrnq_u32(vreinterpretq_u32_u16(t01.val[1]), vreinterpretq_u32_u16(t23.val[1]));
+    uint32x4x2_t v02 = vtrnq_u32(vreinterpretq_u32_u16(t45.val[0]), vreinterpretq_u32_u16(t67.val[0]));
+    uint32x4x2_t v13 = vtrnq_u32(vreinterpretq_u32_u16(t45.val[1]), vreinterpretq_u32_u16(t67.val[1]));
+    r[0] = vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u02.val[0]), vget_low_u32(v02.val[0])));
+    r[1] = vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u13.val[0]), vget_low_u32(v13.val[0])));
+    r[2] = vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u02.val[1]), vget_low_u32(v02.val[1])));
+    r[3] = vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u13.val[1]), vget_low_u32(v13.val[1])));
+    r[4] = vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u02.val[0]), vget_high_u32(v02.val[0])));
+    r[5] = vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u13.val[0]), vget_high_u32(v13.val[0])));
+    r[6] = vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u02.val[1]), vget_high_u32(v02.val[1])));
+    r[7] = vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u13.val[1]), vget_high_u32(v13.val[1])));
+}
+
+static inline void RotateBlock8x8(const uint8_t *src, int srcRowStep, uint8_t *dst, int dstStride, bool lowByteToTop) {
+    uint16x8_t r[8];
+    for (int i = 0; i < 8; ++i) r[i] = ConvertXRGB8888x8(src + i * srcRowStep, lowByteToTop);
+    Transpose8x8(r);
+    for (int i = 0; i < 8; ++i) vst1q_u8(dst + i * dstStride, vreinterpretq_u8_u16(r[i]));
+}
+
+void ConvertXRGB8888ToRGB565BE(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte) {
+    const bool lowByteToTop = redInLowByte != SWAP_BGR;
+    int x = 0;
+    for (; x + 16 <= width; x += 16, src += 64, dst += 32) {
+        uint8x16x4_t p = vld4q_u8(src);
+        vst2q_u8(dst, lowByteToTop ? PackRGB565BEx16(p.val[0], p.val[1], p.val[2]) : PackRGB565BEx16(p.val[2], p.val[1], p.val[0]));
+    }
+    ConvertXRGB8888ToRGB565BEScalar(src, dst, width - x, redInLowByte);
+}
+
+void ConvertRGB888ToRGB565BE(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte) {
+    const bool lowByteToTop = redInLowByte != SWAP_BGR;
+    int x = 0;
+    for (; x + 16 <= width; x += 16, src += 48, dst += 32) {
+        uint8x16x3_t p = vld3q_u8(src);
+        vst2q_u8(dst, lowByteToTop ? PackRGB565BEx16(p.val[0], p.val[1], p.val[2]) : PackRGB565BEx16(p.val[2], p.val[1], p.val[0]));
+    }
+    ConvertRGB888ToRGB565BEScalar(src, dst, width - x, redInLowByte);
+}
+
+#elif defined(PIXEL_KERNELS_SSE2)
+
+// SSE2 has no byte deinterleaving, so 4 pixels are packed at a time within 32-bit lanes, and then narrowed to 16 bits.
+static inline __m128i PackRGB565x4(__m128i p, bool lowByteToTop) {
+    __m128i top, bottom;
+    if (lowByteToTop) {
+        top = _mm_and_si128(_mm_slli_epi32(p, 8), _mm_set1_epi32(0xF800));
+        bottom = _mm_and_si128(_mm_srli_epi32(p, 19), _mm_set1_epi32(0x1F));
+    } else {
+        top = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xF800));
+        bottom = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x1F));
+    }
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07E0));
+    __m128i c = _mm_or_si128(_mm_or_si128(top, g), bottom);
+    // Sign extend, so that the signed saturating narrowing in _mm_packs_epi32 keeps all 16 bits as they are
+    return _mm_srai_epi32(_mm_slli_epi32(c, 16), 16);
+}
+
+// Converts 8 XRGB8888 pixels to RGB565 big endian, as they are stored in memory
+static inline __m128i ConvertXRGB8888x8(const uint8_t *src, bool lowByteToTop) {
+    __m128i c = _mm_packs_epi32(PackRGB565x4(_mm_loadu_si128((const __m128i *) src), lowByteToTop),
+                                PackRGB565x4(_mm_loadu_si128((const __m128i *) (src + 16)), lowByteToTop));
+    c = _mm_or_si128(_mm_slli_epi16(c, 8), _mm_srli_epi16(c, 8));
+#ifdef DISPLAY_INVERT_COLORS
+    c = _mm_xor_si128(c, _mm_set1_epi32(-1));
+#endif
+    return c;
+}
+
+void ConvertXRGB8888ToRGB565BE(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte) {
+    const bool lowByteToTop = redInLowByte != SWAP_BGR;
+    int x = 0;
+    for (; x + 8 <= width; x += 8, src += 32, dst += 16)
+        _mm_storeu_si128((__m128i *) dst, ConvertXRGB8888x8(src, lowByteToTop));
+    ConvertXRGB8888ToRGB565BEScalar(src, dst, width - x, redInLowByte);
+}
+
+// Transposes an 8x8 block of 16-bit pixels in registers: r[i] receives what was column i
+static inline void Transpose8x8(__m128i r[8]) {
+    __m128i t0 = _mm_unpacklo_epi16(r[0], r[1]), t1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i t2 = _mm_unpacklo_epi16(r[2], r[3]), t3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i t4 = _mm_unpacklo_epi16(r[4], r[5]), t5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i t6 = _mm_unpacklo_epi16(r[6], r[7]), t7 = _mm_unpackhi_epi16(r[6], r[7]);
+    // Columns 0 and 1 of rows 0-3 in u0, columns 2 and 3 in u1, ..., and the same of rows 4-7 in u4-u7
+    __m128i u0 = _mm_unpacklo_epi32(t0, t2), u1 = _mm_unpackhi_epi32(t0, t2);
+    __m128i u2 = _mm_unpacklo_epi32(t1, t3), u3 = _mm_unpackhi_epi32(t1, t3);
+    __m128i u4 = _mm_unpacklo_epi32(t4, t6), u5 = _mm_unpackhi_epi32(t4, t6);
+    __m128i u6 = _mm_unpacklo_epi32(t5, t7), u7 = _mm_unpackhi_epi32(t5, t7);
+    r[0] = _mm_unpacklo_epi64(u0, u4);
+    r[1] = _mm_unpackhi_epi64(u0, u4);
+    r[2] = _mm_unpacklo_epi64(u1, u5);
+    r[3] = _mm_unpackhi_epi64(u1, u5);
+    r[4] = _mm_unpacklo_epi64(u2, u6);
+    r[5] = _mm_unpackhi_epi64(u2, u6);
+    r[6] = _mm_unpacklo_epi64(u3, u7);
+    r[7] = _mm_unpackhi_epi64(u3, u7);
+}
+
+static inline void RotateBlock8x8(const uint8_t *src, int srcRowStep, uint8_t *dst, int dstStride, bool lowByteToTop) {
+    __m128i r[8];
+    for (int i = 0; i < 8; ++i) r[i] = ConvertXRGB8888x8(src + i * srcRowStep, lowByteToTop);
+    Transpose8x8(r);
+    for (int i = 0; i < 8; ++i) _mm_storeu_si128((__m128i *) (dst + i * dstStride), r[i]);
+}
+
+void ConvertRGB888ToRGB565BE(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte) {
+    ConvertRGB888ToRGB565BEScalar(src, dst, width, redInLowByte);
+}
+
+#else
+
+void ConvertXRGB8888ToRGB565BE(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte) {
+    ConvertXRGB8888ToRGB565BEScalar(src, dst, width, redInLowByte);
+}
+
+static inline void RotateBlock8x8(const uint8_t *src, int srcRowStep, uint8_t *dst, int dstStride, bool lowByteToTop) {
+    for (int i = 0; i < 8; ++i, src += srcRowStep)
+        for (int j = 0; j < 8; ++j) {
+            const uint8_t *p = src + j * 4;
+            uint16_t c = lowByteToTop ? PackRGB565BE(p[0], p[1], p[2]) : PackRGB565BE(p[2], p[1], p[0]);
+            memcpy(dst + j * dstStride + i * 2, &c, sizeof(c));
+        }
+}
+
+void ConvertRGB888ToRGB565BE(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte) {
+    ConvertRGB888ToRGB565BEScalar(src, dst, width, redInLowByte);
+}
+
+#endif
+
+// Rotates in strips of ROTATE_STRIP_WIDTH source columns, so that each source row is read a whole 64 byte cache line at a time,
+// and the 8 rotated rows that each 8x8 block writes to stay in the cache until the strip moves on.
+#define ROTATE_STRIP_WIDTH 16
+
+void RotateXRGB8888ToRGB565BE(const uint8_t *src, int srcStride, int srcHeight, int startX, int endX, uint8_t *dst,
+                              int dstStride, bool redInLowByte) {
+    const bool lowByteToTop = redInLowByte != SWAP_BGR;
+    for (int x0 = startX; x0 < endX; x0 += ROTATE_STRIP_WIDTH) {
+        const int x1 = (x0 + ROTATE_STRIP_WIDTH < endX) ? x0 + ROTATE_STRIP_WIDTH : endX;
+        int j = 0;
+        // Rotated column j comes from source row srcHeight-1-j, so blocks walk the source upwards
+        for (; j + 8 <= srcHeight; j += 8) {
+            const uint8_t *s = src + (ptrdiff_t) (srcHeight - 1 - j) * srcStride;
+            uint8_t *d = dst + (x0 - startX) * dstStride + j * 2;
+            int x = x0;
+            for (; x + 8 <= x1; x += 8, d += 8 * dstStride)
+                RotateBlock8x8(s + x * 4, -srcStride, d, dstStride, lowByteToTop);
+            for (; x < x1; ++x, d += dstStride)
+                for (int i = 0; i < 8; ++i) ConvertXRGB8888ToRGB565BEScalar(s - i * srcStride + x * 4, d + i * 2, 1, redInLowByte);
+        }
+        for (; j < srcHeight; ++j)
+            for (int x = x0; x < x1; ++x)
+                ConvertXRGB8888ToRGB565BEScalar(src + (ptrdiff_t) (srcHeight - 1 - j) * srcStride + x * 4,
+                                                dst + (x - startX) * dstStride + j * 2, 1, redInLowByte);
+    }
+}
+
+// Rotating 270 degrees is rotating 90 degrees an upside down source into rows in reverse order, so the same blocks do, with the
+// source walked from the top down. The negative strides are why the offsets above are signed.
+void Rotate270XRGB8888ToRGB565BE(const uint8_t *src, int srcStride, int srcHeight, int startX, int endX, uint8_t *dst,
+                                 int dstStride, bool redInLowByte) {
+    if (startX >= endX || srcHeight <= 0) return;
+    RotateXRGB8888ToRGB565BE(src + (ptrdiff_t) (srcHeight - 1) * srcStride, -srcStride, srcHeight, startX, endX,
+                             dst + (ptrdiff_t) (endX - 1 - startX) * dstStride, -dstStride, redInLowByte);
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <inttypes.h>
+#include <memory.h>
+
+// Pixel kernels of the capture and diff paths: source pixel conversion to the RGB565 big endian byte stream that the display
+// expects, and searches for changed pixels between two RGB565 rows. Vectorized with NEON on ARM (always on AArch64, on AArch32 when
+// built with the ARMV7A or ARMV8A option) and with SSE2 on x86 hosts, with a portable scalar version elsewhere, e.g. on ARMv6 Pis.
+// The *Scalar versions are the reference implementations that "bench pixels" checks the vectorized ones against.
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PIXEL_KERNELS_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PIXEL_KERNELS_SSE2
+#endif
+
+// Names the instruction set the kernels were built for: "NEON", "SSE2" or "scalar"
+extern const char *pixelKernelsIsa;
+
+// Converts width pixels of 32bpp XRGB8888 (blue in the lowest byte) to RGB565 big endian, or of XBGR8888 (red in the lowest byte)
+// if redInLowByte is set. DISPLAY_SWAP_BGR and DISPLAY_INVERT_COLORS are applied on the way.
+void ConvertXRGB8888ToRGB565BE(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte);
+void ConvertXRGB8888ToRGB565BEScalar(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte);
+
+// Same for 24bpp pixels, stored in B, G, R byte order, or R, G, B if redInLowByte is set. Not vectorized on x86, where unpacking
+// three byte pixels would need SSSE3.
+void ConvertRGB888ToRGB565BE(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte);
+void ConvertRGB888ToRGB565BEScalar(const uint8_t *src, uint8_t *dst, int width, bool redInLowByte);
+
+// Converts source columns startX..endX-1 of a XRGB8888 (or XBGR8888) image that is srcHeight rows tall to RGB565 big endian, rotated
+// 90 degrees clockwise: column x becomes row x-startX of dst, rows dstStride bytes apart, with the bottom source row on the left.
+// Works through 8x8 pixel blocks that are converted and transposed in registers, so the source is read once, in whole cache lines.
+void RotateXRGB8888ToRGB565BE(const uint8_t *src, int srcStride, int srcHeight, int startX, int endX, uint8_t *dst,
+                              int dstStride, bool redInLowByte);
+void RotateXRGB8888ToRGB565BEScalar(const uint8_t *src, int srcStride, int srcHeight, int startX, int endX, uint8_t *dst,
+                                    int dstStride, bool redInLowByte);
+
+// The same, rotated 270 degrees clockwise instead: column endX-1 becomes the first row of dst, with the top source row on the left.
+void Rotate270XRGB8888ToRGB565BE(const uint8_t *src, int srcStride, int srcHeight, int startX, int endX, uint8_t *dst,
+                                 int dstStride, bool redInLowByte);
+void Rotate270XRGB8888ToRGB565BEScalar(const uint8_t *src, int srcStride, int srcHeight, int startX, int endX, uint8_t *dst,
+                                       int dstStride, bool redInLowByte);
+
+// The searches below run several times per row of the diff, often over only a few pixels, so they are inline.
+
+// Returns the index of the first pixel in x..width-1 that differs between the two rows, or width if there is none.
+static inline int FindFirstChangedPixelScalar(const uint16_t *a, const uint16_t *b, int x, int width) {
+    // Skip identical pixels four at a time, then locate the exact differing pixel.
+    while (x + 4 <= width) {
+        uint64_t u, v;
+        memcpy(&u, a + x, sizeof(u));
+        memcpy(&v, b + x, sizeof(v));
+        if (u != v) break;
+        x += 4;
+    }
+    while (x < width && a[x] == b[x]) ++x;
+    return x;
+}
+
+// Returns the index of the first pixel in x..width-1 that is the same on both rows, or width if there is none.
+static inline int FindFirstUnchangedPixelScalar(const uint16_t *a, const uint16_t *b, int x, int width) {
+    while (x < width && a[x] != b[x]) ++x;
+    return x;
+}
+
+// Returns one past the index of the last pixel in x..width-1 that differs between the two rows, or x if there is none. Together
+// with FindFirstChangedPixel() this gives the first and last changed columns of a row, scanning each unchanged pixel only once.
+static inline int FindChangedPixelsEndScalar(const uint16_t *a, const uint16_t *b, int x, int width) {
+    while (width - x >= 4) {
+        uint64_t u, v;
+        memcpy(&u, a + width - 4, sizeof(u));
+        memcpy(&v, b + width - 4, sizeof(v));
+        if (u != v) break;
+        width -= 4;
+    }
+    while (width > x && a[width - 1] == b[width - 1]) --width;
+    return width;
+}
+
+#if defined(PIXEL_KERNELS_NEON) || defined(PIXEL_KERNELS_SSE2)
+
+#if defined(PIXEL_KERNELS_NEON)
+// Compares 8 pixels, and returns a mask with 8 bits set for each pixel that is the same on both rows, lowest pixel in the low bits
+static inline uint64_t EqualPixelsMask(const uint16_t *a, const uint16_t *b) {
+    uint16x8_t eq = vceqq_u16(vld1q_u16(a), vld1q_u16(b));
+    return vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(eq)), 0);
+}
+#define EQUAL_PIXELS_MASK_ALL ~0ULL
+#define EQUAL_PIXELS_MASK_BITS_LOG2 3
+
+// Returns whether all 32 pixels are the same on both rows
+static inline bool Equal32Pixels(const uint16_t *a, const uint16_t *b) {
+    uint16x8_t eq01 = vandq_u16(vceqq_u16(vld1q_u16(a), vld1q_u16(b)), vceqq_u16(vld1q_u16(a + 8), vld1q_u16(b + 8)));
+    uint16x8_t eq23 = vandq_u16(vceqq_u16(vld1q_u16(a + 16), vld1q_u16(b + 16)), vceqq_u16(vld1q_u16(a + 24), vld1q_u16(b + 24)));
+    uint16x8_t eq = vandq_u16(eq01, eq23);
+    return vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(eq)), 0) == ~0ULL;
+}
+#else
+// Compares 8 pixels, and returns a mask with 2 bits set for each pixel that is the same on both rows, lowest pixel in the low bits
+static inline uint64_t EqualPixelsMask(const uint16_t *a, const uint16_t *b) {
+    return (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *) a), _mm_loadu_si128((const __m128i *) b)));
+}
+#define EQUAL_PIXELS_MASK_ALL 0xFFFFULL
+#define EQUAL_PIXELS_MASK_BITS_LOG2 1
+
+// Returns whether all 32 pixels are the same on both rows
+static inline bool Equal32Pixels(const uint16_t *a, const uint16_t *b) {
+    const __m128i *u = (const __m128i *) a, *v = (const __m128i *) b;
+    __m128i eq = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi16(_mm_loadu_si128(u), _mm_loadu_si128(v)),
+                                             _mm_cmpeq_epi16(_mm_loadu_si128(u + 1), _mm_loadu_si128(v + 1))),
+                               _mm_and_si128(_mm_cmpeq_epi16(_mm_loadu_si128(u + 2), _mm_loadu_si128(v + 2)),
+                                             _mm_cmpeq_epi16(_mm_loadu_si128(u + 3), _mm_loadu_si128(v + 3))));
+    return _mm_movemask_epi8(eq) == 0xFFFF;
+}
+#endif
+
+// Runs of changed and unchanged pixels are often just a few pixels long, and for those the vector setup costs more than a couple of
+// scalar compares. So the first few pixels are checked one by one.
+#define SCALAR_SEARCH_PIXELS 4
+
+static inline int FindFirstChangedPixel(const uint16_t *a, const uint16_t *b, int x, int width) {
+    for (int end = (x + SCALAR_SEARCH_PIXELS < width) ? x + SCALAR_SEARCH_PIXELS : width; x < end; ++x)
+        if (a[x] != b[x]) return x;
+    // Unchanged stretches are skipped 32 pixels per test, one mask for four compares, then the change is located 8 pixels at a time
+    while (x + 32 <= width && Equal32Pixels(a + x, b + x)) x += 32;
+    for (; x + 8 <= width; x += 8) {
+        uint64_t eq = EqualPixelsMask(a + x, b + x);
+        if (eq != EQUAL_PIXELS_MASK_ALL) return x + (__builtin_ctzll(~eq) >> EQUAL_PIXELS_MASK_BITS_LOG2);
+    }
+    return FindFirstChangedPixelScalar(a, b, x, width);
+}
+
+static inline int FindFirstUnchangedPixel(const uint16_t *a, const uint16_t *b, int x, int width) {
+    for (int end = (x + SCALAR_SEARCH_PIXELS < width) ? x + SCALAR_SEARCH_PIXELS : width; x < end; ++x)
+        if (a[x] == b[x]) return x;
+    for (; x + 8 <= width; x += 8) {
+        uint64_t eq = EqualPixelsMask(a + x, b + x);
+        if (eq) return x + (__builtin_ctzll(eq) >> EQUAL_PIXELS_MASK_BITS_LOG2);
+    }
+    return FindFirstUnchangedPixelScalar(a, b, x, width);
+}
+
+static inline int FindChangedPixelsEnd(const uint16_t *a, const uint16_t *b, int x, int width) {
+    while (width - x >= 32 && Equal32Pixels(a + width - 32, b + width - 32)) width -= 32;
+    for (; width - x >= 8; width -= 8) {
+        uint64_t eq = EqualPixelsMask(a + width - 8, b + width - 8) ^ EQUAL_PIXELS_MASK_ALL;
+        if (eq) return width - 8 + ((63 - __builtin_clzll(eq)) >> EQUAL_PIXELS_MASK_BITS_LOG2) + 1;
+    }
+    return FindChangedPixelsEndScalar(a, b, x, width);
+}
+
+#else
+
+static inline int FindFirstChangedPixel(const uint16_t *a, const uint16_t *b, int x, int width) {
+    return FindFirstChangedPixelScalar(a, b, x, width);
+}
+
+static inline int FindFirstUnchangedPixel(const uint16_t *a, const uint16_t *b, int x, int width) {
+    return FindFirstUnchangedPixelScalar(a, b, x, width);
+}
+
+static inline int FindChangedPixelsEnd(const uint16_t *a, const uint16_t *b, int x, int width) {
+    return FindChangedPixelsEndScalar(a, b, x, width);
+}
+
+#endif
@@ -0,0 +1,228 @@
+#include "config.h"
+#include "scaler.h"
+#include "framebuffer.h"
+#include "mem_alloc.h"
+#include "util.h"
+
+#include <math.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+SourceScaler sourceScaler = {};
+
+// Rows of the source are filtered vertically into a scratch row on the stack, which limits the width of a filtered source, and a
+// downscale by more than MAX_FILTER_TAPS-1 times needs more taps than the filter has room for. Those fall back to nearest neighbour.
+#define MAX_FILTERED_SOURCE_WIDTH 4096
+#define MAX_FILTER_TAPS 16
+
+static void AllocScaleAxis(ScaleAxis *axis, int size, int maxTaps) {
+    axis->first = (int *) Malloc(size * sizeof(int), "scaler.cpp first tap");
+    axis->taps = (int *) Malloc(size * sizeof(int), "scaler.cpp tap count");
+    axis->weights = (uint16_t *) Malloc(size * maxTaps * sizeof(uint16_t), "scaler.cpp weights");
+    axis->maxTaps = maxTaps;
+}
+
+static void FreeScaleAxis(ScaleAxis *axis) {
+    free(axis->first);
+    free(axis->taps);
+    free(axis->weights);
+    memset(axis, 0, sizeof(*axis));
+}
+
+static void InitNearestAxis(ScaleAxis *axis, int srcSize, int dstSize) {
+    AllocScaleAxis(axis, dstSize, 1);
+    for (int i = 0; i < dstSize; ++i) {
+        axis->first[i] = (int) ((int64_t) i * srcSize / dstSize);
+        axis->taps[i] = 1;
+        axis->weights[i] = 256;
+    }
+}
+
+// Shrinking averages the source pixels that each output pixel covers, weighted by how much of them it covers. Growing interpolates
+// between the two source pixels nearest to the center of each output pixel.
+static void InitFilteredAxis(ScaleAxis *axis, int srcSize, int dstSize) {
+    const double scale = (double) srcSize / dstSize;
+    AllocScaleAxis(axis, dstSize, (dstSize < srcSize) ? (int) ceil(scale) + 1 : 2);
+    for (int i = 0; i < dstSize; ++i) {
+        uint16_t *w = axis->weights + i * axis->maxTaps;
+        int taps = 0;
+        if (dstSize < srcSize) {
+            const double a = i * scale, b = (i + 1) * scale;
+            axis->first[i] = (int) a;
+            for (int k = (int) a; k < srcSize && k < b; ++k)
+                w[taps++] = (uint16_t) lround((MIN(b, k + 1.0) - MAX(a, (double) k)) / scale * 256);
+            // Rounding may leave the weights a little off from 256 in total, the biggest one takes up the difference
+            int sum = 0, biggest = 0;
+            for (int t = 0; t < taps; ++t) {
+                sum += w[t];
+                if (w[t] > w[biggest]) biggest = t;
+            }
+            w[biggest] += 256 - sum;
+            // Drop the source pixels that the output pixel only grazes
+            while (taps > 1 && w[taps - 1] == 0) --taps;
+            while (taps > 1 && w[0] == 0) {
+                memmove(w, w + 1, --taps * sizeof(uint16_t));
+                ++axis->first[i];
+            }
+        } else {
+            double c = MIN(MAX((i + 0.5) * scale - 0.5, 0.0), srcSize - 1.0);
+            int k = (int) c;
+            int w1 = (int) lround((c - k) * 256);
+            if (w1 == 256) ++k, w1 = 0;
+            axis->first[i] = k;
+            w[taps++] = (uint16_t) (256 - w1);
+            if (w1) w[taps++] = (uint16_t) w1;
+        }
+        axis->taps[i] = taps;
+    }
+}
+
+void InitSourceScaler(int targetWidth, int targetHeight) {
+    DeinitSourceScaler();
+    SourceScaler &s = sourceScaler;
+    const SourceFramebuffer &fb = sourceFramebuffer;
+    s.srcX = s.srcY = 0;
+    s.srcWidth = fb.width;
+    s.srcHeight = fb.height;
+#ifdef DISPLAY_CROPPED_INSTEAD_OF_SCALING
+    s.width = MIN(fb.width, targetWidth);
+    s.height = MIN(fb.height, targetHeight);
+    s.srcX = (fb.width - s.width) / 2;
+    s.srcY = (fb.height - s.height) / 2;
+    s.srcWidth = s.width;
+    s.srcHeight = s.height;
+#elif defined(DISPLAY_BREAK_ASPECT_RATIO_WHEN_SCALING)
+    s.width = targetWidth;
+    s.height = targetHeight;
+#else
+    if ((int64_t) fb.width * targetHeight >= (int64_t) fb.height * targetWidth) {
+        s.width = targetWidth;
+        s.height = MAX(1, (int) (((int64_t) fb.height * targetWidth + fb.width / 2) / fb.width));
+    } else {
+        s.width = MAX(1, (int) (((int64_t) fb.width * targetHeight + fb.height / 2) / fb.height));
+        s.height = targetHeight;
+    }
+#endif
+    s.x = (targetWidth - s.width) / 2;
+    s.y = (targetHeight - s.height) / 2;
+
+    if (s.width == s.srcWidth && s.height == s.srcHeight) s.mode = SCALING_NONE;
+    else if ((s.width % s.srcWidth == 0 && s.height % s.srcHeight == 0) || fb.bitsPerPixel != 32 ||
+             s.srcWidth > MAX_FILTERED_SOURCE_WIDTH || s.srcWidth / s.width + 2 > MAX_FILTER_TAPS ||
+             s.srcHeight / s.height + 2 > MAX_FILTER_TAPS)
+        s.mode = SCALING_NEAREST;
+    else s.mode = SCALING_FILTERED;
+
+    if (s.mode == SCALING_NEAREST) {
+        InitNearestAxis(&s.horizontal, s.srcWidth, s.width);
+        InitNearestAxis(&s.vertical, s.srcHeight, s.height);
+    } else if (s.mode == SCALING_FILTERED) {
+        InitFilteredAxis(&s.horizontal, s.srcWidth, s.width);
+        InitFilteredAxis(&s.vertical, s.srcHeight, s.height);
+    }
+    if (s.mode != SCALING_NONE)
+        s.pixels = (uint8_t *) Malloc((size_t) s.width * s.height * fb.bitsPerPixel / 8, "scaler.cpp scaled image");
+}
+
+void DeinitSourceScaler() {
+    SourceScaler &s = sourceScaler;
+    FreeScaleAxis(&s.horizontal);
+    FreeScaleAxis(&s.vertical);
+    free(s.pixels);
+    s.pixels = 0;
+}
+
+const uint8_t *ScaledImage(int *stride) {
+    const SourceScaler &s = sourceScaler;
+    const SourceFramebuffer &fb = sourceFramebuffer;
+    if (s.mode != SCALING_NONE) {
+        *stride = s.width * fb.bitsPerPixel / 8;
+        return s.pixels;
+    }
+    *stride = fb.stride;
+    return fb.pixels + (size_t) s.srcY * fb.stride + s.srcX * fb.bitsPerPixel / 8;
+}
+
+// The filter works on two 8-bit channels at a time in the 16-bit halves of a 32-bit word: bytes 0 and 2 of a pixel in one word,
+// bytes 1 and 3 in another. With weights that add up to 256 the sums cannot overflow into the neighbouring channel. This keeps the
+// byte order of the source, whichever channel is where.
+static inline void AccumulatePixel(uint32_t px, uint32_t weight, uint32_t &lo, uint32_t &hi) {
+    lo += (px & 0x00FF00FF) * weight;
+    hi += ((px >> 8) & 0x00FF00FF) * weight;
+}
+
+static inline uint32_t ResolvePixel(uint32_t lo, uint32_t hi) {
+    return (((lo + 0x00800080) >> 8) & 0x00FF00FF) | ((hi + 0x00800080) & 0xFF00FF00);
+}
+
+static void ScaleNearest(const uint8_t *src, int srcStride, int x, int endX, int y, int endY) {
+    const SourceScaler &s = sourceScaler;
+    const int bytesPerPixel = sourceFramebuffer.bitsPerPixel / 8;
+    const int *first = s.horizontal.first;
+    for (int j = y; j < endY; ++j) {
+        uint8_t *dst = s.pixels + ((size_t) j * s.width + x) * bytesPerPixel;
+        // Enlarging repeats each source row on consecutive output rows, those are copies of the row above
+        if (j > y && s.vertical.first[j] == s.vertical.first[j - 1]) {
+            memcpy(dst, dst - s.width * bytesPerPixel, (endX - x) * bytesPerPixel);
+            continue;
+        }
+        const uint8_t *row = src + (size_t) s.vertical.first[j] * srcStride;
+        if (bytesPerPixel == 4) {
+            for (int i = x; i < endX; ++i, dst += 4) *(uint32_t *) dst = *(const uint32_t *) (row + first[i] * 4);
+        } else {
+            for (int i = x; i < endX; ++i, dst += bytesPerPixel) memcpy(dst, row + first[i] * bytesPerPixel, bytesPerPixel);
+        }
+    }
+}
+
+static void ScaleFiltered(const uint8_t *src, int srcStride, int x, int endX, int y, int endY) {
+    const SourceScaler &s = sourceScaler;
+    const ScaleAxis &h = s.horizontal, &v = s.vertical;
+    // Source columns that the output columns x..endX-1 read from
+    const int srcX = h.first[x], srcEndX = h.first[endX - 1] + h.taps[endX - 1];
+    // Sums of the vertical pass, in the lo/hi channel pairs of AccumulatePixel()
+    uint32_t lo[MAX_FILTERED_SOURCE_WIDTH], hi[MAX_FILTERED_SOURCE_WIDTH];
+    for (int j = y; j < endY; ++j) {
+        // Vertical pass, over only the source columns needed, skipped when the output row is a single source row. Goes through the
+        // source a row at a time, in loops that the compiler vectorizes.
+        const int vTaps = v.taps[j];
+        const uint16_t *vWeights = v.weights + j * v.maxTaps;
+        const uint32_t *row = (const uint32_t *) (src + (size_t) v.first[j] * srcStride);
+        if (vTaps > 1) {
+            for (int i = srcX; i < srcEndX; ++i) {
+                lo[i] = (row[i] & 0x00FF00FF) * vWeights[0];
+                hi[i] = ((row[i] >> 8) & 0x00FF00FF) * vWeights[0];
+            }
+            for (int t = 1; t < vTaps; ++t) {
+                const uint32_t *r = (const uint32_t *) (src + (size_t) (v.first[j] + t) * srcStride);
+                const uint32_t w = vWeights[t];
+                for (int i = srcX; i < srcEndX; ++i) {
+                    lo[i] += (r[i] & 0x00FF00FF) * w;
+                    hi[i] += ((r[i] >> 8) & 0x00FF00FF) * w;
+                }
+            }
+            for (int i = srcX; i < srcEndX; ++i) lo[i] = ResolvePixel(lo[i], hi[i]);
+            row = lo;
+        }
+        // Horizontal pass
+        uint32_t *dst = (uint32_t *) s.pixels + (size_t) j * s.width;
+        for (int i = x; i < endX; ++i) {
+            const uint32_t *px = row + h.first[i];
+            const uint16_t *hWeights = h.weights + i * h.maxTaps;
+            uint32_t lo = 0, hi = 0;
+            for (int t = 0; t < h.taps[i]; ++t) AccumulatePixel(px[t], hWeights[t], lo, hi);
+            dst[i] = ResolvePixel(lo, hi);
+        }
+    }
+}
+
+void ScaleSourceRegion(int x, int endX, int y, int endY) {
+    const SourceScaler &s = sourceScaler;
+    if (s.mode == SCALING_NONE || x >= endX || y >= endY) return;
+    const SourceFramebuffer &fb = sourceFramebuffer;
+    const uint8_t *src = fb.pixels + (size_t) s.srcY * fb.stride + s.srcX * fb.bitsPerPixel / 8;
+    if (s.mode == SCALING_NEAREST) ScaleNearest(src, fb.stride, x, endX, y, endY);
+    else ScaleFiltered(src, fb.stride, x, endX, y, endY);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Fits the source framebuffer onto the display when their sizes differ. With DISPLAY_CROPPED_INSTEAD_OF_SCALING, the center of the
+// source is shown 1:1. Otherwise the source is scaled to fill the display, preserving its aspect ratio unless
+// DISPLAY_BREAK_ASPECT_RATIO_WHEN_SCALING is defined. The scaled image is placed at the center of the display, and the letterbox or
+// pillarbox bars around it are left black.
+
+#define SCALING_NONE 0 // Same size, or cropped: the source is read in place, from an offset into it
+#define SCALING_NEAREST 1 // Enlarged by whole factors, each source pixel becomes a block of pixels. Also used for 16bpp and 24bpp sources
+#define SCALING_FILTERED 2 // Box filter along an axis that shrinks, bilinear along an axis that grows, in 8 bit fixed point
+
+// Precomputed coefficients of one axis: output pixel i is the sum of taps[i] source pixels starting from first[i], weighted by
+// weights[i*maxTaps...], which add up to 256. With SCALING_NEAREST, output pixel i is source pixel first[i].
+typedef struct ScaleAxis {
+    int *first;
+    int *taps;
+    uint16_t *weights;
+    int maxTaps;
+} ScaleAxis;
+
+typedef struct SourceScaler {
+    int mode; // One of SCALING_*
+    int x, y, width, height; // Where the scaled image is placed on the target, in the orientation of the source
+    int srcX, srcY, srcWidth, srcHeight; // The part of the source framebuffer that is shown
+    ScaleAxis horizontal, vertical;
+    uint8_t *pixels; // The scaled image, width*height pixels in the pixel format of the source. Unused with SCALING_NONE.
+} SourceScaler;
+
+extern SourceScaler sourceScaler;
+
+// Works out how sourceFramebuffer is fitted onto a target of the given size, and precomputes the coefficient tables of the scaling.
+void InitSourceScaler(int targetWidth, int targetHeight);
+
+void DeinitSourceScaler(void);
+
+// Returns the top left pixel of the scaled image, and the distance between its rows in bytes in *stride.
+const uint8_t *ScaledImage(int *stride);
+
+// Brings pixels x..endX-1 of rows y..endY-1 of the scaled image up to date with the source framebuffer. Does nothing with
+// SCALING_NONE. Regions that do not overlap can be scaled from several threads at the same time.
+void ScaleSourceRegion(int x, int endX, int y, int endY);
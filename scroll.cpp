@@ -0,0 +1,143 @@
+#include "config.h"
+#include "scroll.h"
+#include "diff.h"
+#include "display.h"
+#include "spi.h"
+#include "command_table.h"
+#include "util.h"
+
+#include <memory.h>
+
+bool detectScrolling = true;
+
+// Rows of the frame in the scrolling area, none before InitScrolling(). Frame row scrollY+i is in GRAM row
+// scrollY+(i+scrollOffset)%(scrollEndY-scrollY).
+static int scrollY = 0, scrollEndY = 0;
+static int scrollOffset = 0;
+
+// Hashes of the rows of the captured frame, and of the frame that the display shows
+static uint32_t newRowHashes[FRAME_HEIGHT];
+static uint32_t prevRowHashes[FRAME_HEIGHT];
+
+// A scroll has to line up at least this fraction of the rows of the scrolling area with the new frame, on top of the rows that
+// are already in line unscrolled. This keeps small moves and coincidentally equal rows from making the display jump around.
+#define MIN_SCROLLED_ROWS_FRACTION 4
+
+// Number of scroll amounts with the most votes (see ScrollDisplayToFrame()) that are checked row by row
+#define SCROLL_CANDIDATES 3
+
+// Open addressing table from the hashes of the rows of the previous frame to the rows that have them, at most half full
+#define ROW_TABLE_BITS 12
+#define ROW_TABLE_SIZE (1 << ROW_TABLE_BITS)
+#define ROW_SHARED_HASH -2 // Several rows have the hash, e.g. rows of plain background
+static uint32_t rowTableHashes[ROW_TABLE_SIZE];
+static int rowTableRows[ROW_TABLE_SIZE]; // -1 for an empty slot
+static int votes[FRAME_HEIGHT];
+
+static inline int RowTableSlot(uint32_t hash) {
+    int i = (int) ((hash * 2654435761u) >> (32 - ROW_TABLE_BITS));
+    while (rowTableRows[i] != -1 && rowTableHashes[i] != hash) i = (i + 1) & (ROW_TABLE_SIZE - 1);
+    return i;
+}
+
+void InitScrolling(int y, int endY) {
+#ifdef HARDWARE_VERTICAL_SCROLLING
+    scrollY = scrollEndY = scrollOffset = 0;
+    if (endY - y < 2) return;
+    scrollY = y;
+    scrollEndY = endY;
+    const int top = DISPLAY_COVERED_TOP_SIDE + y, rows = endY - y, bottom = DISPLAY_HEIGHT - top - rows;
+    BeginCompoundTask();
+    QueueCommandWords(DISPLAY_VERTICAL_SCROLLING_DEFINITION, top, rows, bottom);
+    QueueCommandWords(DISPLAY_VERTICAL_SCROLLING_START_ADDRESS, top);
+    EndCompoundTask();
+#else
+    (void) y;
+    (void) endY;
+#endif
+}
+
+bool ScrollDetectionEnabled() {
+    return detectScrolling && scrollEndY > scrollY;
+}
+
+// FNV-1a over pairs of pixels. Rows that collide only make a scroll line up fewer rows than it seemed to, the diff that follows
+// still finds every pixel that differs.
+static uint32_t HashRow(const uint16_t *row) {
+    uint32_t hash = 2166136261u;
+    int x = 0;
+    for (; x + 1 < FRAME_WIDTH; x += 2) hash = (hash ^ (row[x] | ((uint32_t) row[x + 1] << 16))) * 16777619u;
+    if (x < FRAME_WIDTH) hash = (hash ^ row[x]) * 16777619u;
+    return hash;
+}
+
+void HashScrollRows(int y, int endY) {
+    for (y = MAX(y, scrollY), endY = MIN(endY, scrollEndY); y < endY; ++y) {
+        newRowHashes[y] = HashRow(framebuffer[0] + y * FRAME_STRIDE);
+        prevRowHashes[y] = HashRow(framebuffer[1] + y * FRAME_STRIDE);
+    }
+}
+
+// Number of rows of the new frame that are the same as the rows of the previous frame the given number of rows below them, wrapping
+// around the scrolling area, i.e. that would not need sending after scrolling the display up by that many rows
+static int RowsInLine(int rows) {
+    const int n = scrollEndY - scrollY;
+    const uint32_t *a = newRowHashes + scrollY, *b = prevRowHashes + scrollY;
+    int inLine = 0;
+    for (int i = 0; i < n; ++i) inLine += (a[i] == b[(i + rows) % n]);
+    return inLine;
+}
+
+void ScrollDisplayToFrame(FrameDiffStatistics *stats) {
+    const int n = scrollEndY - scrollY;
+    const int inLine = RowsInLine(0);
+    if ((n - inLine) * MIN_SCROLLED_ROWS_FRACTION < n) return; // Too few rows changed for any scroll to line up enough of them
+
+    // Every changed row whose content is on a single row of the previous frame votes for scrolling by the distance between the two.
+    // Rows with content that is on several rows, like blank lines, do not tell the distance apart.
+    memset(rowTableRows, -1, sizeof(rowTableRows));
+    for (int i = 0; i < n; ++i) {
+        const int slot = RowTableSlot(prevRowHashes[scrollY + i]);
+        rowTableRows[slot] = (rowTableRows[slot] == -1) ? i : ROW_SHARED_HASH;
+        rowTableHashes[slot] = prevRowHashes[scrollY + i];
+    }
+    memset(votes, 0, n * sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        const uint32_t hash = newRowHashes[scrollY + i];
+        if (hash == prevRowHashes[scrollY + i]) continue;
+        const int row = rowTableRows[RowTableSlot(hash)];
+        if (row >= 0) ++votes[(row - i + n) % n];
+    }
+
+    // The distance with the most votes is not necessarily the one that lines up the most rows, count for a few of them
+    int bestRows = 0, bestInLine = inLine;
+    for (int c = 0; c < SCROLL_CANDIDATES; ++c) {
+        int rows = 0;
+        for (int d = 1; d < n; ++d)
+            if (votes[d] > votes[rows]) rows = d;
+        if (!rows) break;
+        votes[rows] = 0;
+        const int candidateInLine = RowsInLine(rows);
+        if (candidateInLine > bestInLine) {
+            bestRows = rows;
+            bestInLine = candidateInLine;
+        }
+    }
+    if (!bestRows || (bestInLine - inLine) * MIN_SCROLLED_ROWS_FRACTION < n) return;
+
+    scrollOffset = (scrollOffset + bestRows) % n;
+    const int start = DISPLAY_COVERED_TOP_SIDE + scrollY + scrollOffset;
+    QueueCommandWords(DISPLAY_VERTICAL_SCROLLING_START_ADDRESS, start);
+    ScrollPreviousFrame(scrollY, scrollEndY, bestRows);
+    ++stats->scrolls;
+    stats->bytesTransmitted += COMMAND_WORDS_QUEUED_BYTES(1);
+}
+
+int ScrolledFrameRow(int y) {
+    if (!scrollOffset || y < scrollY || y >= scrollEndY) return y;
+    return scrollY + (y - scrollY + scrollOffset) % (scrollEndY - scrollY);
+}
+
+int ScrollWrapRow() {
+    return scrollOffset ? scrollEndY - scrollOffset : FRAME_HEIGHT;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "diff.h"
+
+// Hardware vertical scrolling (HARDWARE_VERTICAL_SCROLLING in config.h): when a console, a list or a log scrolls by a line, every
+// row of the screen changes, and the diff would send all of them. Instead, each captured frame is compared with what the display
+// shows by row hashes, and if a large band of rows has moved up or down, the display is scrolled in hardware with Vertical
+// Scrolling Start Address, so that only the rows that scroll into view need to be sent. The rows of the frame then sit rotated in
+// GRAM: pixel writes address each frame row at the GRAM row that the scroll has moved it to (see ScrolledFrameRow()).
+
+// Whether captured frames are checked for scrolling. On by default, cleared to compare against. The display stays scrolled where it
+// is when cleared.
+extern bool detectScrolling;
+
+// Makes rows y..endY-1 of the frame, the rows that the diff looks at (see SetDiffRegion()), the scrolling area of the display, and
+// queues the commands that set it up unscrolled. Until called, and without HARDWARE_VERTICAL_SCROLLING, nothing is scrolled.
+void InitScrolling(int y, int endY);
+
+// Whether the frame that is captured next is to be checked for scrolling
+bool ScrollDetectionEnabled(void);
+
+// Hashes rows y..endY-1 of the captured frame in framebuffer[0] and of the previous frame in framebuffer[1], for
+// ScrollDisplayToFrame(). Bands of rows can be hashed in parallel.
+void HashScrollRows(int y, int endY);
+
+// Called once all rows of a captured frame have been hashed, before the frame is diffed. If a large band of the rows that the
+// display shows has moved up or down in the new frame, queues the command that scrolls the display to match, and scrolls
+// framebuffer[1] the same way (see ScrollPreviousFrame()), so that the diff only finds the rows that scrolled into view and the
+// rows that changed otherwise. Adds the scroll and its command bytes to *stats.
+void ScrollDisplayToFrame(FrameDiffStatistics *stats);
+
+// GRAM row that frame row y is in after the scrolls so far, both counted from DISPLAY_COVERED_TOP_SIDE like frame rows
+int ScrolledFrameRow(int y);
+
+// Frame row that is in the first GRAM row of the scrolling area, so that the rows before and after it are not next to each other in
+// GRAM: a pixel write cannot span it. FRAME_HEIGHT if the display is not scrolled.
+int ScrollWrapRow(void);
@@ -3,15 +3,24 @@
 #include <stdio.h> // printf, stderr
 #include <syslog.h> // syslog
 #include <fcntl.h> // open, O_RDWR, O_SYNC
+#include <stdlib.h> // free
+#include <string.h> // memset
 #include <sys/mman.h> // mmap, munmap
+#include <pthread.h> // pthread_create, pthread_join
+#include <unistd.h> // usleep
+#ifndef SPI_EMULATION
 #include <bcm_host.h> // bcm_host_get_peripheral_address, bcm_host_get_peripheral_size, bcm_host_get_sdram_address
+#endif
 
 #endif
 
 #include "config.h"
 #include "spi.h"
+#include "dma.h"
 #include "util.h"
 #include "mem_alloc.h"
+#include "tearing.h"
+#include "boot.h"
 
 // Uncomment this to print out all bytes sent to the SPI bus
 // #define DEBUG_SPI_BUS_WRITES
@@ -41,7 +50,9 @@ volatile SPIRegisterFile *spi = 0;
 
 // Points to the system timer register. N.B. spec sheet says this is two low and high parts, in an 32-bit aligned (but not 64-bit aligned) address. Profiling shows
 // that Pi 3 Model B does allow reading this as a u64 load, and even when unaligned, it is around 30% faster to do so compared to loading in parts "lo | (hi << 32)".
+#ifndef SPI_EMULATION
 volatile uint64_t *systemTimerRegister = 0;
+#endif
 
 
 // Errata to BCM2835 behavior: documentation states that the SPI0 DLEN register is only used for DMA. However, even when DMA is not being utilized, setting it from
@@ -62,56 +73,288 @@ void WaitForPolledSPITransferToFinish() {
         spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
 }
 
-void RunSPITask(SPITask *task) {
-    WaitForPolledSPITransferToFinish();
-
-    uint8_t *tStart = task->PayloadStart();
-    uint8_t *tEnd = task->PayloadEnd();
-    const uint32_t payloadSize = tEnd - tStart;
-    uint8_t *tPrefillEnd = tStart + MIN(15, payloadSize);
-
+// Sends the command word of a command, and leaves the Data/Control line set for its parameter bytes
+static inline void WriteCommandWord(uint8_t cmd) {
     // Send the command word if display is 4-wire (3-wire displays can omit this, commands are interleaved in the data payload stream above)
     // An SPI transfer to the display always starts with one control (command) byte, followed by N data bytes.
     CLEAR_GPIO(GPIO_TFT_DATA_CONTROL);
 
     // On e.g. the ILI9486, all commands are 16-bit, so need to be clocked in in two bytes. The MSB byte is always zero though in all the defined commands.
     WRITE_FIFO(0x00);
-    WRITE_FIFO(task->cmd);
+    WRITE_FIFO(cmd);
 
     while (!(spi->cs & (BCM2835_SPI0_CS_DONE))) /*nop*/;
-    spi->fifo;
-    spi->fifo;
+    (void) spi->fifo;
+    (void) spi->fifo;
 
     SET_GPIO(GPIO_TFT_DATA_CONTROL);
+}
+
+// Pushes bytes to the FIFO as it has room, without waiting for them to be sent
+static inline void WritePolledBytes(const uint8_t *tStart, const uint8_t *tEnd) {
+    const uint8_t *tPrefillEnd = tStart + MIN(15, tEnd - tStart);
+    while (tStart < tPrefillEnd) WRITE_FIFO(*tStart++);
+    while (tStart < tEnd) {
+        uint32_t cs = spi->cs;
+        if ((cs & BCM2835_SPI0_CS_TXD)) WRITE_FIFO(*tStart++);
+// TODO:      else asm volatile("yield");
+        if ((cs & (BCM2835_SPI0_CS_RXR | BCM2835_SPI0_CS_RXF)))
+            spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
+    }
+}
+
+// Sends the commands in p..end-1, in the encoding of command tables, and waits out the delays among them
+static void RunCommands(const uint8_t *p, const uint8_t *end) {
+    while (p < end) {
+        const uint8_t numParamBytes = *p++;
+        WaitForPolledSPITransferToFinish();
+        if (numParamBytes == COMMAND_TABLE_DELAY) {
+#ifdef KERNEL_MODULE
+            msleep(*p++);
+#else
+            usleep(*p++ * 1000);
+#endif
+            continue;
+        }
+        WriteCommandWord(*p++);
+        WritePolledBytes(p, p + numParamBytes);
+        p += numParamBytes;
+    }
+}
+
+void RunSPITask(SPITask *task) {
+    if (task->cmd == SPI_TASK_COMPOUND) {
+        RunCommands(task->PayloadStart(), task->PayloadEnd());
+        return;
+    }
+
+    WaitForPolledSPITransferToFinish();
+
+    WriteCommandWord(task->cmd);
 
 // For small transfers, using DMA is not worth it, but pushing through with polled SPI gives better bandwidth.
 // For larger transfers though that are more than this amount of bytes, using DMA is faster.
 // This cutoff number was experimentally tested to find where Polled SPI and DMA are as fast.
+#if defined(USE_DMA_TRANSFERS) && !defined(KERNEL_MODULE)
     // Do a DMA transfer if this task is suitable in size for DMA to handle
-    {
-        while (tStart < tPrefillEnd) WRITE_FIFO(*tStart++);
-        while (tStart < tEnd) {
-            uint32_t cs = spi->cs;
-            if ((cs & BCM2835_SPI0_CS_TXD)) WRITE_FIFO(*tStart++);
-// TODO:      else asm volatile("yield");
-            if ((cs & (BCM2835_SPI0_CS_RXR | BCM2835_SPI0_CS_RXF)))
-                spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
+    const uint32_t payloadSize = task->PayloadSize();
+    if (payloadSize > 0 && payloadSize >= dmaMinTaskBytes && payloadSize <= DMA_MAX_SPI_TRANSFER_BYTES) {
+        SPIDMATransfer(task);
+        // DMA transfers leave DLEN at the payload size, restore polled mode to 8 clocks per byte for the next command.
+        UNLOCK_FAST_8_CLOCKS_SPI();
+    } else
+#endif
+        WritePolledBytes(task->PayloadStart(), task->PayloadEnd());
+}
+
+void RunCommandTable(const uint8_t *table, uint32_t size) {
+    RunCommands(table, table + size);
+    WaitForPolledSPITransferToFinish();
+}
+
+void RunFillCommand(uint8_t cmd, uint8_t value, uint32_t size) {
+    WaitForPolledSPITransferToFinish();
+    WriteCommandWord(cmd);
+    // One stream, as in WritePolledBytes(): the FIFO is empty after the command word, so only the first 15 bytes can go in unchecked
+    uint32_t prefill = MIN(size, 15u);
+    size -= prefill;
+    while (prefill--) WRITE_FIFO(value);
+    while (size > 0) {
+        uint32_t cs = spi->cs;
+        if ((cs & BCM2835_SPI0_CS_TXD)) {
+            WRITE_FIFO(value);
+            --size;
         }
+        if ((cs & (BCM2835_SPI0_CS_RXR | BCM2835_SPI0_CS_RXF)))
+            spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
     }
-
+    WaitForPolledSPITransferToFinish();
 }
 
 SharedMemory *spiTaskMemory = 0;
+SPITaskProducer spiTaskProducer = {};
+bool packCompoundTasks = true;
+uint32_t spiTaskConsumerCachedTail = 0;
+#ifdef KERNEL_MODULE
+dma_addr_t spiTaskMemoryBusAddress = 0;
+struct platform_device *spiTaskMemoryDevice = 0; // The DMA API allocates and maps coherent memory on behalf of a device
+#endif
+#if defined(USE_DMA_TRANSFERS) && !defined(KERNEL_MODULE_CLIENT)
+static GpuMemoryBlock spiTaskMemoryBlock = {};
+#endif
 
 void DoneTask(SPITask *task) // Frees the first SPI task from the queue, called in worker thread
 {
-    __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, task->PayloadSize() + 1, __ATOMIC_RELAXED);
-    spiTaskMemory->queueHead = (uint32_t) ((uint8_t *) task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
+    // The consumer is the only writer of both, so plain stores do, no read-modify-write needed.
+    __atomic_store_n(&spiTaskMemory->spiBytesDone, spiTaskMemory->spiBytesDone + task->PayloadSize() + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&spiTaskMemory->queueHead,
+                     (uint32_t) ((uint8_t *) task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size, __ATOMIC_RELEASE);
+#ifndef KERNEL_MODULE
+    // Wake the main thread if it is blocked in AllocTask() waiting for room in the queue, and enough room has now been freed.
+    // No barrier per task here: a waiter that registers just after this check is caught by GetTask() before the queue runs dry.
+    if (__atomic_load_n(&spiTaskMemory->producerWaiting, __ATOMIC_ACQUIRE) &&
+        SPIBytesQueued() <= __atomic_load_n(&spiTaskMemory->producerWakeBytesQueued, __ATOMIC_RELAXED))
+        WakeSPITaskProducer();
+#endif
+}
+
+void ExecuteSPITasks() {
+    SPITask *task;
+    while ((task = GetTask())) {
+#ifdef GPIO_TFT_TEARING_EFFECT
+        WaitUntilTearFree(task);
+#endif
+        RunSPITask(task);
+        DoneTask(task);
+    }
+}
+
+void ResetSPITaskQueue() {
+    spiTaskMemory->queueHead = spiTaskMemory->queueTail = 0;
+    spiTaskMemory->spiBytesCommitted = spiTaskMemory->spiBytesDone = 0;
+    spiTaskMemory->producerWaiting = spiTaskMemory->producerWakeBytesQueued = spiTaskMemory->producerStalls = 0;
+    spiTaskMemory->producerStallUsecs = 0;
+    spiTaskMemory->spiBytesSuperseded = spiTaskMemory->spiBytesSkipped = 0;
+    memset(&spiTaskProducer, 0, sizeof(spiTaskProducer));
+    spiTaskConsumerCachedTail = 0;
+}
+
+void AttachSPITaskProducer() {
+    memset(&spiTaskProducer, 0, sizeof(spiTaskProducer));
+    spiTaskProducer.tail = spiTaskProducer.readyTail = spiTaskProducer.publishedTail =
+        __atomic_load_n(&spiTaskMemory->queueTail, __ATOMIC_RELAXED);
+    spiTaskProducer.bytesCommitted = spiTaskProducer.readyBytesCommitted =
+        __atomic_load_n(&spiTaskMemory->spiBytesCommitted, __ATOMIC_RELAXED);
+    spiTaskProducer.cachedHead = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE);
+}
+
+#ifndef KERNEL_MODULE_RUNS_SPI_TASKS
+static volatile bool displayInitialized = false;
+
+// Brings up the display controller, clears its GRAM at the bus speed that the display updates run at, and leaves the bus ready to
+// run tasks. Runs on the SPI thread with FAST_BOOT, see InitSPIInBackground().
+static void InitDisplay() {
+    printf("Initializing display\n");
+    InitILI9486();
+
+    // Display initialization runs at a conservative low bus speed, switch to the configured speed for the actual display updates.
+    spi->clk = SPI_BUS_CLOCK_DIVISOR;
+
+    // We will be running SPI tasks continuously, so keep SPI Transfer Active throughout the lifetime of the driver.
+    BEGIN_SPI_COMMUNICATION();
+
+    // The display GRAM contains garbage after reset
+    BeginBootPhase(BOOT_GRAM_CLEAR);
+    ClearGRAM();
+    EndBootPhase(BOOT_GRAM_CLEAR);
+
+#ifdef GPIO_TFT_TEARING_EFFECT
+    BeginBootPhase(BOOT_TEARING_EFFECT_CALIBRATION);
+    InitTearingEffectSync(GPIO_TFT_TEARING_EFFECT);
+    EndBootPhase(BOOT_TEARING_EFFECT_CALIBRATION);
+#endif
+    __atomic_store_n(&displayInitialized, true, __ATOMIC_RELEASE);
+}
+#endif
+
+#if !defined(KERNEL_MODULE) && !defined(KERNEL_MODULE_RUNS_SPI_TASKS)
+#define SPI_THREAD
+
+pthread_t spiThread;
+static volatile bool spiThreadFinished = false; // Set by the SPI thread as the last thing it does, acknowledging the quit request
+
+// Runs tasks as the main thread commits them to the queue, so that the main thread can prepare the next frame while the bus is
+// busy sending the previous one. Sleeps on the queueTail futex whenever the queue is empty, see PublishTasks().
+void *SPIThread(void *unused) {
+#ifdef FAST_BOOT
+    InitDisplay();
+#endif
+    while (programRunning) {
+        ExecuteSPITasks();
+        // GetTask() found the queue empty at this head. If a task is published after that, queueTail no longer equals head and
+        // the wait returns immediately.
+        uint32_t head = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED);
+        syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, head, 0, 0, 0);
+    }
+    spiThreadFinished = true;
     __sync_synchronize();
+    return 0;
 }
 
-int InitSPI() {
+// Asks the SPI thread to quit and waits until it has. The quit signal and the futex wake of ProgramInterruptHandler() can both
+// land just before the SPI thread goes to sleep on the queue, so keep waking it up until it acknowledges.
+static void StopSPIThread() {
+    programRunning = false;
+    __sync_synchronize();
+    while (!spiThreadFinished) {
+        syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0);
+        usleep(1000);
+    }
+    pthread_join(spiThread, NULL);
+
+    // Run any tasks that were committed while the thread was on its way out, e.g. by DeinitSPIDisplay().
+    ExecuteSPITasks();
+}
+#endif
+
+#ifdef KERNEL_MODULE_CLIENT
+int spiKernelModuleFd = -1;
+
+// Maps the SPI task queue of the kernel module to spiTaskMemory, instead of allocating one.
+static void MapKernelModuleTaskQueue() {
+    spiKernelModuleFd = open("/proc/" SPI_BUS_PROC_ENTRY_FILENAME, O_RDWR | O_SYNC);
+    if (spiKernelModuleFd < 0)
+        FATAL_ERROR("can't open /proc/" SPI_BUS_PROC_ENTRY_FILENAME ", is the kernel module bcm2835_spi_display.ko loaded? (see kernel/start_kernel_module.sh)");
+    void *mem = mmap(NULL, SHARED_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, spiKernelModuleFd, 0);
+    if (mem == MAP_FAILED) FATAL_ERROR("mapping the SPI task queue of the kernel module failed");
+    spiTaskMemory = (SharedMemory *) mem;
+    printf("Mapped SPI task queue of the kernel module from /proc/" SPI_BUS_PROC_ENTRY_FILENAME ", %u bytes at bus address %p\n",
+           (uint32_t) SHARED_MEMORY_SIZE, (void *) spiTaskMemory->sharedMemoryBaseInPhysMemory);
+}
+
+static void UnmapKernelModuleTaskQueue() {
+    if (spiTaskMemory) munmap(spiTaskMemory, SHARED_MEMORY_SIZE);
+    spiTaskMemory = 0;
+    if (spiKernelModuleFd >= 0) {
+        close(spiKernelModuleFd);
+        spiKernelModuleFd = -1;
+    }
+}
+#endif
+
+#ifdef KERNEL_MODULE_RUNS_SPI_TASKS
+
+// The kernel module has already initialized the display, and sends out the tasks from its interrupt handler, so this program
+// never touches the SPI or GPIO registers, and only needs the task queue.
+int InitSPIInBackground() {
+    MapKernelModuleTaskQueue();
+    AttachSPITaskProducer();
+    spiTaskMemory->producerWaiting = spiTaskMemory->producerWakeBytesQueued = spiTaskMemory->producerStalls = 0;
+    spiTaskMemory->producerStallUsecs = 0;
+    return 0;
+}
+
+void WaitForDisplay() {
+}
+
+void DeinitSPI() {
+    DeinitSPIDisplay();
+    UnmapKernelModuleTaskQueue();
+}
+
+#else
 
+int InitSPIInBackground() {
+    BeginBootPhase(BOOT_PERIPHERALS);
+
+#ifdef SPI_EMULATION
+    // Drive a software model of the peripherals instead, see spi_emulation.h
+    ResetSPIEmulation();
+    spi = &emulatedSPIRegisters;
+    gpio = &emulatedGPIORegisters;
+    printf("Running against emulated SPI0 and GPIO peripherals, SPI bus clocked at %.2f MHz\n",
+           EMULATED_CORE_FREQUENCY_HZ / 1e6 / SPI_BUS_CLOCK_DIVISOR);
+#else
     // Memory map GPIO and SPI peripherals for direct access
     mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
     if (mem_fd < 0) FATAL_ERROR("can't open /dev/mem (run as sudo)");
@@ -125,6 +368,7 @@ int InitSPI() {
     systemTimerRegister = (volatile uint64_t *) ((uintptr_t) bcm2835 + BCM2835_TIMER_BASE +
                                                  0x04); // Generates an unaligned 64-bit pointer, but seems to be fine.
     // TODO: On graceful shutdown, (ctrl-c signal?) close(mem_fd)
+#endif
 
     // Estimate how many microseconds transferring a single byte over the SPI bus takes?
 
@@ -148,26 +392,73 @@ int InitSPI() {
 
     // Initialize SPI thread task buffer memory
 
+#ifdef USE_DMA_TRANSFERS
+    InitDMA();
+#endif
+#if defined(KERNEL_MODULE)
+    // One physically contiguous block that user space maps in one go, and that is coherent with DMA without cache maintenance.
+    spiTaskMemoryDevice = platform_device_register_simple("bcm2835_spi_display", -1, NULL, 0);
+    if (IS_ERR(spiTaskMemoryDevice)) {
+        spiTaskMemoryDevice = 0;
+        FATAL_ERROR("Failed to register SPI display platform device!");
+    }
+    if (dma_coerce_mask_and_coherent(&spiTaskMemoryDevice->dev, DMA_BIT_MASK(32)))
+        FATAL_ERROR("Failed to set DMA mask of SPI display platform device!");
+    spiTaskMemory = (SharedMemory *) dma_alloc_coherent(&spiTaskMemoryDevice->dev, SHARED_MEMORY_SIZE, &spiTaskMemoryBusAddress,
+                                                        GFP_KERNEL);
+    if (!spiTaskMemory) FATAL_ERROR("Failed to allocate SPI task queue!");
+    spiTaskMemory->sharedMemoryBaseInPhysMemory = spiTaskMemoryBusAddress;
+#elif defined(KERNEL_MODULE_CLIENT)
+    // Debugging mode (KERNEL_MODULE_CLIENT_DRIVES): run the tasks here, but in the queue of the kernel module.
+    MapKernelModuleTaskQueue();
+#elif defined(USE_DMA_TRANSFERS)
+    // DMA transfers read pixel data straight out of the task queue, so it needs to live in memory that the DMA controller sees.
+    spiTaskMemoryBlock = AllocateUncachedGpuMemory(SHARED_MEMORY_SIZE, "spi.cpp shared task memory");
+    spiTaskMemory = (SharedMemory *) spiTaskMemoryBlock.virtualAddr;
+    spiTaskMemory->sharedMemoryBaseInPhysMemory = spiTaskMemoryBlock.busAddress;
+#else
     spiTaskMemory = (SharedMemory *) Malloc(SHARED_MEMORY_SIZE, "spi.cpp shared task memory");
+    spiTaskMemory->sharedMemoryBaseInPhysMemory = 0;
+#endif
 
-    spiTaskMemory->queueHead = spiTaskMemory->queueTail = spiTaskMemory->spiBytesQueued = 0;
+    ResetSPITaskQueue();
 
     // Enable fast 8 clocks per byte transfer mode, instead of slower 9 clocks per byte.
     UNLOCK_FAST_8_CLOCKS_SPI();
 
-    printf("Initializing display\n");
-    InitILI9486();
+    // The controller is about to be reset, so whatever cursor window a previous run of the driver left behind no longer applies
+    InvalidateDisplayCursor(&displayCursor);
+    displayInitialized = false;
+    EndBootPhase(BOOT_PERIPHERALS);
 
-    // We will be running SPI tasks continuously from the main thread, so keep SPI Transfer Active throughout the lifetime of the driver.
-    BEGIN_SPI_COMMUNICATION();
+#if !defined(FAST_BOOT) || !defined(SPI_THREAD)
+    InitDisplay();
+#endif
 
-    DeinitSPI();
+#ifdef SPI_THREAD
+    spiThreadFinished = false;
+    int rc = pthread_create(&spiThread, NULL, SPIThread, NULL);
+    if (rc != 0) FATAL_ERROR("Failed to create SPI thread!");
+#endif
 
     return 0;
 }
 
+void WaitForDisplay() {
+#ifdef SPI_THREAD
+    while (!__atomic_load_n(&displayInitialized, __ATOMIC_ACQUIRE)) usleep(1000);
+#endif
+}
+
 void DeinitSPI() {
+#ifdef KERNEL_MODULE
+    // User space clients have produced into the queue since the display was initialized, pick up from where they left it.
+    AttachSPITaskProducer();
+#endif
     DeinitSPIDisplay();
+#ifdef SPI_THREAD
+    StopSPIThread();
+#endif
 
     spi->cs = BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
 
@@ -178,16 +469,41 @@ void DeinitSPI() {
     SET_GPIO_MODE(GPIO_SPI0_MOSI, 0);
     SET_GPIO_MODE(GPIO_SPI0_CLK, 0);
 
+    // The task ring is released through the VideoCore mailbox and DeinitDMA() resets the DMA channels through the peripheral
+    // mapping, so both need to happen before the mailbox and the mapping are closed below.
+#if defined(KERNEL_MODULE)
+    if (spiTaskMemory) dma_free_coherent(&spiTaskMemoryDevice->dev, SHARED_MEMORY_SIZE, spiTaskMemory, spiTaskMemoryBusAddress);
+    if (spiTaskMemoryDevice) platform_device_unregister(spiTaskMemoryDevice);
+    spiTaskMemoryDevice = 0;
+#elif defined(KERNEL_MODULE_CLIENT)
+    UnmapKernelModuleTaskQueue();
+#elif defined(USE_DMA_TRANSFERS)
+    FreeUncachedGpuMemory(spiTaskMemoryBlock);
+#else
+    free(spiTaskMemory);
+#endif
+    spiTaskMemory = 0;
+#ifdef USE_DMA_TRANSFERS
+    DeinitDMA();
+#endif
+
+#ifndef SPI_EMULATION
     if (bcm2835) {
         munmap((void *) bcm2835, bcm_host_get_peripheral_size());
         bcm2835 = 0;
     }
+#endif
 
     if (mem_fd >= 0) {
         close(mem_fd);
         mem_fd = -1;
     }
+}
 
-    free(spiTaskMemory);
-    spiTaskMemory = 0;
+#endif
+
+int InitSPI() {
+    const int rc = InitSPIInBackground();
+    WaitForDisplay();
+    return rc;
 }
@@ -4,20 +4,29 @@
 #include <sys/syscall.h>
 
 #include <linux/futex.h>
+#include <linux/ioctl.h>
 
 #include "display.h"
 #include "tick.h"
-#include "display.h"
+#include "util.h"
 
 #define BCM2835_GPIO_BASE                    0x200000   // Address to GPIO register file
 #define BCM2835_SPI0_BASE                    0x204000   // Address to SPI0 register file
 #define BCM2835_TIMER_BASE                   0x3000     // Address to System Timer register file
 
+// The kernel module exposes its SPI task queue to user space as this file under /proc
+#define SPI_BUS_PROC_ENTRY_FILENAME "bcm2835_spi_display_bus"
+
+// ioctl() on the proc entry to tell the kernel module that tasks were committed to an empty queue, see spi_pump.h
+#define SPI_BUS_IOCTL_KICK _IO('s', 1)
+
 #define BCM2835_SPI0_CS_RXF                  0x00100000 // Receive FIFO is full
 #define BCM2835_SPI0_CS_RXR                  0x00080000 // FIFO needs reading
 #define BCM2835_SPI0_CS_TXD                  0x00040000 // TXD TX FIFO can accept Data
 #define BCM2835_SPI0_CS_RXD                  0x00020000 // RXD RX FIFO contains Data
 #define BCM2835_SPI0_CS_DONE                 0x00010000 // Done transfer Done
+#define BCM2835_SPI0_CS_INTR                 0x00000400 // Interrupt on RXR
+#define BCM2835_SPI0_CS_INTD                 0x00000200 // Interrupt on Done
 #define BCM2835_SPI0_CS_TA                   0x00000080 // Transfer Active
 #define BCM2835_SPI0_CS_CLEAR                0x00000030 // Clear FIFO Clear RX and TX
 #define BCM2835_SPI0_CS_CLEAR_RX             0x00000020 // Clear FIFO Clear RX
@@ -30,24 +39,31 @@
 
 extern volatile void *bcm2835;
 
+#ifdef SPI_EMULATION
+// Off-target builds access a software model of the peripherals instead of the memory mapped registers, see spi_emulation.h
+#include "spi_emulation.h"
+#else
 typedef struct GPIORegisterFile {
     uint32_t gpfsel[6], reserved0; // GPIO Function Select registers, 3 bits per pin, 10 pins in an uint32_t
     uint32_t gpset[2], reserved1; // GPIO Pin Output Set registers, write a 1 to bit at index I to set the pin at index I high
     uint32_t gpclr[2], reserved2; // GPIO Pin Output Clear registers, write a 1 to bit at index I to set the pin at index I low
     uint32_t gplev[2];
 } GPIORegisterFile;
-extern volatile GPIORegisterFile *gpio;
-
-#define SET_GPIO_MODE(pin, mode) gpio->gpfsel[(pin)/10] = (gpio->gpfsel[(pin)/10] & ~(0x7 << ((pin) % 10) * 3)) | ((mode) << ((pin) % 10) * 3)
-#define SET_GPIO(pin) gpio->gpset[0] = 1 << (pin) // Pin must be (0-31)
-#define CLEAR_GPIO(pin) gpio->gpclr[0] = 1 << (pin) // Pin must be (0-31)
-
 typedef struct SPIRegisterFile {
     uint32_t cs;   // SPI Master Control and Status register
     uint32_t fifo; // SPI Master TX and RX FIFOs
     uint32_t clk;  // SPI Master Clock Divider
     uint32_t dlen; // SPI Master Number of DMA Bytes to Write
 } SPIRegisterFile;
+#endif
+
+extern volatile GPIORegisterFile *gpio;
+
+#define SET_GPIO_MODE(pin, mode) gpio->gpfsel[(pin)/10] = (gpio->gpfsel[(pin)/10] & ~(0x7 << ((pin) % 10) * 3)) | ((mode) << ((pin) % 10) * 3)
+#define SET_GPIO(pin) gpio->gpset[0] = 1 << (pin) // Pin must be (0-31)
+#define CLEAR_GPIO(pin) gpio->gpclr[0] = 1 << (pin) // Pin must be (0-31)
+#define GET_GPIO(pin) ((gpio->gplev[(pin) / 32] >> ((pin) % 32)) & 1) // Level of an input pin, 0 or 1
+
 extern volatile SPIRegisterFile *spi;
 
 // Defines the size of the SPI task memory buffer in bytes. This memory buffer can contain two frames worth of tasks at maximum,
@@ -57,8 +73,15 @@ extern volatile SPIRegisterFile *spi;
 #define SHARED_MEMORY_SIZE (DISPLAY_DRAWABLE_WIDTH*DISPLAY_DRAWABLE_HEIGHT*SPI_BYTESPERPIXEL*3)
 #define SPI_QUEUE_SIZE (SHARED_MEMORY_SIZE - sizeof(SharedMemory))
 
+// Values of SPITask::state. The consumer claims each task as it gets to it, and the producer can supersede a task that a newer one
+// makes redundant up until then, see SupersedeTask().
+#define SPI_TASK_QUEUED 0
+#define SPI_TASK_STARTED 1
+#define SPI_TASK_SUPERSEDED 2
+
 typedef struct __attribute__((packed)) SPITask {
     uint32_t size; // Size, including both 8-bit and 9-bit tasks
+    uint8_t state; // SPI_TASK_*, accessed with __atomic builtins
     uint8_t cmd;
     uint8_t data[]; // Contains both 8-bit and 9-bit tasks back to back, 8-bit first, then 9-bit.
 
@@ -83,93 +106,376 @@ typedef struct __attribute__((packed)) SPITask {
 
 // A convenience for defining and dispatching SPI task bytes inline
 #define SPI_TRANSFER(command, ...) do { \
-    char data_buffer[] = { __VA_ARGS__ }; \
+    uint8_t data_buffer[] = { __VA_ARGS__ }; \
     SPITask *t = AllocTask(sizeof(data_buffer)); \
     t->cmd = (command); \
     memcpy(t->data, data_buffer, sizeof(data_buffer)); \
     CommitTask(t); \
+    t = GetTask(); /* Runs the task right away, with the queue otherwise empty and no SPI thread running */ \
     RunSPITask(t); \
     DoneTask(t); \
   } while(0)
 
 #define QUEUE_SPI_TRANSFER(command, ...) do { \
-    char data_buffer[] = { __VA_ARGS__ }; \
+    uint8_t data_buffer[] = { __VA_ARGS__ }; \
     SPITask *t = AllocTask(sizeof(data_buffer)); \
     t->cmd = (command); \
     memcpy(t->data, data_buffer, sizeof(data_buffer)); \
     CommitTask(t); \
   } while(0)
 
+// The task queue is a single producer, single consumer ring buffer. Only the producer (the main thread) stores queueTail and
+// spiBytesCommitted, and only the consumer (the SPI thread, or the interrupt handler of the kernel module) stores queueHead and
+// spiBytesDone. The indices are accessed with the GCC __atomic builtins rather than std::atomic, since the struct is shared with
+// the C kernel module, and mapped across processes. Tasks are written before a release store of queueTail publishes them, and the
+// consumer is done with them before a release store of queueHead hands their memory back to the producer.
 typedef struct SharedMemory {
-    volatile uint32_t queueHead;
-    volatile uint32_t queueTail;
-    volatile uint32_t spiBytesQueued; // Number of actual payload bytes in the queue
+    // Written by the consumer
+    uint32_t queueHead; // Byte offset of the next task to run in buffer
+    uint32_t spiBytesDone; // Number of payload bytes (counting the command byte) that the consumer has sent, wraps around
+    uint32_t spiBytesSkipped; // Of spiBytesDone, the bytes of superseded tasks that were skipped rather than sent, wraps around
     volatile uint32_t interruptsRaised;
+    // Keeps the fields that the producer writes on a cache line of their own, so that the two sides do not keep stealing the line
+    // from each other. (Padding rather than alignment, since not every allocation of the queue is cache line aligned)
+    uint8_t consumerCacheLinePadding[64 - 4 * sizeof(uint32_t)];
+
+    // Written by the producer
+    uint32_t queueTail; // Byte offset one past the last published task in buffer
+    uint32_t spiBytesCommitted; // Number of payload bytes (counting the command byte) that have been published, wraps around
+    uint32_t spiBytesSuperseded; // Of spiBytesCommitted, the bytes of the tasks that were superseded (see SupersedeTask()), wraps around
+    uint32_t producerWaiting; // Nonzero while the main thread sleeps on the queueHead futex, waiting for the queue to have room
+    uint32_t producerWakeBytesQueued; // The sleeping main thread is woken up when SPIBytesQueued() drops to this value
+    volatile uint32_t producerStalls; // Number of times the main thread had to wait for room in the queue
+    volatile uint64_t producerStallUsecs; // Total time the main thread has spent waiting for room in the queue
     volatile uintptr_t sharedMemoryBaseInPhysMemory;
     volatile uint8_t buffer[];
 } SharedMemory;
 
 extern SharedMemory *spiTaskMemory;
 
+// Size at which a batch of tasks (see BeginTaskBatch()) gets published even though it has not ended yet.
+#ifndef SPI_TASK_BATCH_PUBLISH_BYTES
+#define SPI_TASK_BATCH_PUBLISH_BYTES 4096
+#endif
+
+// Task command that marks the end of the used part of the ring: the task at offset 0 of the buffer is the next one. AllocTask()
+// places it when a task would not fit contiguously at the end of the buffer, tasks are never split in two.
+#define SPI_TASK_WRAP_MARKER 0x00
+
+// Task command of a compound task, which holds several small commands that the consumer sends back to back, saving the per task
+// work of taking them from the queue and handing them back one by one. The payload lists the commands in the encoding of command
+// tables (see command_table.h): the number of parameter bytes, the command byte, and the parameter bytes. No display controller
+// that the driver supports has a command 0xFF. See BeginCompoundTask().
+#define SPI_TASK_COMPOUND 0xFF
+
+// Private state of the producer side of the queue. AllocTask() and CommitTask() only advance the local tail, PublishTasks() makes
+// everything committed so far visible to the consumer with a single release store of queueTail.
+typedef struct SPITaskProducer {
+    uint32_t tail; // End of the last committed task
+    uint32_t readyTail; // End of the tasks that PublishTasks() publishes. Same as tail, except while tasks are reserved.
+    uint32_t readyBytesCommitted; // Value of bytesCommitted at readyTail
+    uint32_t publishedTail; // Value of queueTail last stored by the producer
+    uint32_t cachedHead; // Last queueHead loaded by the producer. The head only moves towards the tail, so a stale value is safe,
+                         // it just shows less room than there is. Reloaded only when the queue looks too full for a new task.
+    uint32_t bytesCommitted; // Value of spiBytesCommitted including the staged bytes
+    uint32_t stagedBytes; // Payload bytes of the tasks committed after the last publish
+    int batchDepth; // Nesting depth of BeginTaskBatch(), CommitTask() does not publish while nonzero
+    int reserving; // Nonzero between BeginTaskReservation() and EndTaskReservation()
+    SPITask *compound; // Compound task that commands are being packed into, see BeginCompoundTask()
+} SPITaskProducer;
+
+// End of a range of reserved tasks, see EndTaskReservation()
+typedef struct SPITaskReservation {
+    uint32_t tail;
+    uint32_t bytesCommitted;
+} SPITaskReservation;
+
+extern SPITaskProducer spiTaskProducer;
+
+// Last queueTail loaded by the consumer. Reloaded only when the consumer catches up with it.
+extern uint32_t spiTaskConsumerCachedTail;
+
+// Number of payload bytes in the queue, published or in the middle of being sent, not counting superseded tasks. Only an estimate,
+// since the other side keeps going in the meanwhile.
+static inline uint32_t SPIBytesQueued() {
+    // Skipped bytes are counted as done first, so with the skipped count loaded before the done count, a superseded task can only
+    // be subtracted twice, never left in. Clamp the rare negative result from that.
+    const uint32_t skipped = __atomic_load_n(&spiTaskMemory->spiBytesSkipped, __ATOMIC_ACQUIRE);
+    const int32_t queued = (int32_t) (__atomic_load_n(&spiTaskMemory->spiBytesCommitted, __ATOMIC_RELAXED) -
+                                      __atomic_load_n(&spiTaskMemory->spiBytesDone, __ATOMIC_RELAXED) -
+                                      (__atomic_load_n(&spiTaskMemory->spiBytesSuperseded, __ATOMIC_RELAXED) - skipped));
+    return (queued > 0) ? (uint32_t) queued : 0;
+}
+
+// How long clocking out one byte takes on the SPI bus at SPI_BUS_CLOCK_DIVISOR, in usecs. Bytes take 8 clocks with DMA or DLEN=2,
+// and the SPI clock is core_freq/CDIV, with core_freq=400 of Pi 3B and Zero W turbo (also what the emulated bus runs at).
+#define NOMINAL_SPI_USECS_PER_BYTE (8.0 * SPI_BUS_CLOCK_DIVISOR / 400.0)
+
+// Returns whether the consumer has run every task that has been published.
+static inline bool SPITaskQueueDrained() {
+    return __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE) ==
+           __atomic_load_n(&spiTaskMemory->queueTail, __ATOMIC_ACQUIRE);
+}
+
 extern int mem_fd;
 
+#ifdef KERNEL_MODULE_RUNS_SPI_TASKS
+#include <sys/ioctl.h>
+
+// The proc entry of the kernel module, opened by InitSPI()
+extern int spiKernelModuleFd;
+#endif
+
+// Called on main thread after publishing a new queueTail to a queue that was empty, to get the consumer of the queue running again.
+static inline void WakeSPITaskConsumer() {
+#if defined(KERNEL_MODULE)
+    // The display initialization thread of the kernel module kicks the pump itself once it has queued up a batch of tasks
+#elif defined(KERNEL_MODULE_RUNS_SPI_TASKS)
+    ioctl(spiKernelModuleFd, SPI_BUS_IOCTL_KICK); // Restart the interrupt driven pump of the kernel module, see spi_pump.h
+#else
+    syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
+#endif
+}
+
+// Called on the consumer side when it has freed room in the queue, wakes the main thread if it is blocked in AllocTask().
+// Clears the flag so that only one task pays for the syscall.
+static inline void WakeSPITaskProducer() {
+#ifndef KERNEL_MODULE
+    __atomic_store_n(&spiTaskMemory->producerWaiting, 0, __ATOMIC_RELAXED);
+    syscall(SYS_futex, &spiTaskMemory->queueHead, FUTEX_WAKE, 1, 0, 0, 0);
+#endif
+}
+
+// Blocks until the SPI thread has advanced queueHead away from the given value, called on main thread when the queue is full.
+static inline void WaitForQueueHeadToMove(uint32_t head) {
+    uint64_t t0 = tick();
+#ifdef KERNEL_MODULE_RUNS_SPI_TASKS
+    // The kernel module runs the tasks and does not wake user space futexes, so poll instead.
+    while (__atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE) == head) usleep(100);
+#else
+    // Sleep until room for about one more full pixel task has been freed (or half of what is queued, if the queue is full of
+    // small tasks), rather than waking up for every small task the SPI thread finishes.
+    uint32_t bytesQueued = SPIBytesQueued();
+    __atomic_store_n(&spiTaskMemory->producerWakeBytesQueued, bytesQueued - MIN(SPI_MAX_PIXEL_TASK_BYTES, bytesQueued / 2),
+                     __ATOMIC_RELAXED);
+
+    // Register as a waiter before rechecking the head. The consumer advances the head before it checks for waiters, and always
+    // checks once more after a full barrier before it runs out of tasks, so either we see the new head here, or the consumer sees
+    // the waiter and wakes us up (and if that wake comes before we get to sleep, the futex value no longer equals head and the wait
+    // returns right away).
+    __atomic_store_n(&spiTaskMemory->producerWaiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_SEQ_CST) == head)
+        syscall(SYS_futex, &spiTaskMemory->queueHead, FUTEX_WAIT, head, 0, 0, 0);
+    __atomic_store_n(&spiTaskMemory->producerWaiting, 0, __ATOMIC_RELAXED);
+#endif
+    ++spiTaskMemory->producerStalls;
+    spiTaskMemory->producerStallUsecs += tick() - t0;
+}
+
+// Makes all tasks committed so far visible to the consumer, with one release store of queueTail. Returns true if the consumer had
+// run out of tasks, in which case it has been woken up. Called on main thread.
+static inline bool PublishTasks() {
+    SPITaskProducer *p = &spiTaskProducer;
+    if (p->readyTail == p->publishedTail) return false;
+    const uint32_t previousTail = p->publishedTail;
+    __atomic_store_n(&spiTaskMemory->spiBytesCommitted, p->readyBytesCommitted, __ATOMIC_RELAXED);
+    __atomic_store_n(&spiTaskMemory->queueTail, p->readyTail, __ATOMIC_RELEASE);
+    p->publishedTail = p->readyTail;
+    p->stagedBytes = 0;
+
+    // An idle consumer sits at the previous tail. The full barrier pairs with the one the consumer runs before it goes idle (see
+    // GetTask()), so that either it sees the new tail, or we see that it has run out of tasks.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED) != previousTail) return false;
+    WakeSPITaskConsumer();
+    return true;
+}
+
+// Reloads the producer's copy of queueHead. Acquire, so that the consumer is done reading the tasks before they are overwritten.
+static inline uint32_t RefreshCachedQueueHead() {
+    return spiTaskProducer.cachedHead = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_ACQUIRE);
+}
+
 static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new SPI task block, called on main thread
 {
-
-    uint32_t bytesToAllocate = sizeof(SPITask) + bytes;// + totalBytesFor9BitTask;
-    uint32_t tail = spiTaskMemory->queueTail;
+    SPITaskProducer *p = &spiTaskProducer;
+    uint32_t bytesToAllocate = sizeof(SPITask) + bytes;
+    uint32_t tail = p->tail;
     uint32_t newTail = tail + bytesToAllocate;
     // Is the new task too large to write contiguously into the ring buffer, that it's split into two parts? We never split,
-    // but instead write a sentinel at the end of the ring buffer, and jump the tail back to the beginning of the buffer and
+    // but instead write a wrap marker at the end of the ring buffer, and jump the tail back to the beginning of the buffer and
     // allocate the new task there. However in doing so, we must make sure that we don't write over the head marker.
-    if (newTail + sizeof(SPITask)/*Add extra SPITask size so that there will always be room for eob marker*/ >=
+    if (newTail + sizeof(SPITask)/*Add extra SPITask size so that there will always be room for the wrap marker*/ >=
         SPI_QUEUE_SIZE) {
-        uint32_t head = spiTaskMemory->queueHead;
-        // Write a sentinel, but wait for the head to advance first so that it is safe to write.
-        while (head > tail || head == 0/*Head must move > 0 so that we don't stomp on it*/) {
-            head = spiTaskMemory->queueHead;
+        // Wait for the head to be behind the tail, and off the start of the buffer, so that the task at the start is not in use.
+        uint32_t head = p->cachedHead;
+        while (head > tail || head == 0) {
+            head = RefreshCachedQueueHead();
+            if (head > tail || head == 0) {
+                PublishTasks(); // The consumer must be able to get through the committed tasks for the head to move
+                WaitForQueueHeadToMove(head);
+            }
         }
         SPITask *endOfBuffer = (SPITask *) (spiTaskMemory->buffer + tail);
-        endOfBuffer->cmd = 0; // Use cmd=0x00 to denote "end of buffer, wrap to beginning"
-        __sync_synchronize();
-        spiTaskMemory->queueTail = 0;
-        __sync_synchronize();
-        if (spiTaskMemory->queueHead == tail)
-            syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0,
-                    0); // Wake the SPI thread if it was sleeping to get new tasks
-        tail = 0;
+        endOfBuffer->cmd = SPI_TASK_WRAP_MARKER; // Published along with the tasks that follow it
+        tail = p->tail = 0;
         newTail = bytesToAllocate;
     }
 
     // If the SPI task queue is full, wait for the SPI thread to process some tasks. This throttles the main thread to not run too fast.
-    uint32_t head = spiTaskMemory->queueHead;
+    uint32_t head = p->cachedHead;
     while (head > tail && head <= newTail) {
-        usleep(100); // Since the SPI queue is full, we can afford to sleep a bit on the main thread without introducing lag.
-        head = spiTaskMemory->queueHead;
+        head = RefreshCachedQueueHead();
+        if (head > tail && head <= newTail) {
+            PublishTasks();
+            WaitForQueueHeadToMove(head);
+        }
     }
 
     SPITask *task = (SPITask *) (spiTaskMemory->buffer + tail);
     task->size = bytes;
+    task->state = SPI_TASK_QUEUED;
     return task;
 }
 
 static inline void
 CommitTask(SPITask *task) // Advertises the given SPI task from main thread to worker, called on main thread
 {
-    __sync_synchronize();
-    uint32_t tail = spiTaskMemory->queueTail;
-    spiTaskMemory->queueTail = (uint32_t) ((uint8_t *) task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
-    __atomic_fetch_add(&spiTaskMemory->spiBytesQueued, task->PayloadSize() + 1, __ATOMIC_RELAXED);
-    __sync_synchronize();
-    if (spiTaskMemory->queueHead == tail)
-        syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0,
-                0); // Wake the SPI thread if it was sleeping to get new tasks
+    SPITaskProducer *p = &spiTaskProducer;
+    p->tail = (uint32_t) ((uint8_t *) task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
+    p->bytesCommitted += task->PayloadSize() + 1;
+    if (p->reserving) return;
+    p->readyTail = p->tail;
+    p->readyBytesCommitted = p->bytesCommitted;
+    p->stagedBytes += task->PayloadSize() + 1;
+    if (!p->batchDepth || p->stagedBytes >= SPI_TASK_BATCH_PUBLISH_BYTES) PublishTasks();
+}
+
+// Tasks committed between BeginTaskBatch() and EndTaskBatch() are published together when the batch ends, which saves the
+// consumer from waking up, and from refetching the cache line of queueTail, for each small task. Batches nest. A batch is
+// published early once it holds SPI_TASK_BATCH_PUBLISH_BYTES, so that the bus does not sit idle while a long batch (e.g. a whole
+// frame) is being produced, and AllocTask() publishes the batch so far if it has to wait for room.
+static inline void BeginTaskBatch() {
+    ++spiTaskProducer.batchDepth;
+}
+
+// Returns the value of PublishTasks() for the outermost batch, false otherwise.
+static inline bool EndTaskBatch() {
+    return --spiTaskProducer.batchDepth == 0 && PublishTasks();
+}
+
+// Tasks committed between BeginTaskReservation() and EndTaskReservation() are reserved instead of published, so that their
+// payloads can be filled in afterwards, e.g. by worker threads (see pipeline.h), while the main thread goes on to reserve more.
+// Reserved tasks take their place in the queue in the order they were reserved in, and PublishReservedTasks() publishes them in
+// that same order once they are ready. Nothing else may be committed until all reservations have been published.
+static inline void BeginTaskReservation() {
+    spiTaskProducer.reserving = 1;
+}
+
+static inline SPITaskReservation EndTaskReservation() {
+    spiTaskProducer.reserving = 0;
+    SPITaskReservation r = {spiTaskProducer.tail, spiTaskProducer.bytesCommitted};
+    return r;
+}
+
+// Publishes the reserved tasks up to the end of the given reservation, returns the value of PublishTasks(). Called on main thread,
+// after the threads that filled in the tasks have synchronized with it.
+static inline bool PublishReservedTasks(SPITaskReservation r) {
+    spiTaskProducer.readyTail = r.tail;
+    spiTaskProducer.readyBytesCommitted = r.bytesCommitted;
+    return PublishTasks();
+}
+
+// Turns a published task that the consumer has not yet started into a no-op that it skips, e.g. a pixel write that a newer one
+// overwrites. Returns false if the consumer has already started, or finished, the task, and so every task before it. Called on
+// main thread, and only for tasks that are known to still be in the queue, i.e. whose memory has not yet been handed back.
+static inline bool SupersedeTask(SPITask *task) {
+    uint8_t queued = SPI_TASK_QUEUED;
+    if (!__atomic_compare_exchange_n(&task->state, &queued, SPI_TASK_SUPERSEDED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return false;
+    __atomic_store_n(&spiTaskMemory->spiBytesSuperseded, spiTaskMemory->spiBytesSuperseded + task->PayloadSize() + 1,
+                     __ATOMIC_RELAXED);
+    return true;
+}
+
+void DoneTask(SPITask *task);
+
+// Reloads the consumer's copy of queueTail once it has caught up with it, and returns whether there are tasks after the given head.
+static inline bool RefreshCachedQueueTail(uint32_t head) {
+    // Pairs with the full barrier in PublishTasks(), so that the producer sees that we ran out of tasks if we miss its new tail.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    spiTaskConsumerCachedTail = __atomic_load_n(&spiTaskMemory->queueTail, __ATOMIC_ACQUIRE);
+    if (spiTaskConsumerCachedTail != head) return true;
+#ifndef KERNEL_MODULE
+    // About to run out of tasks, so catch a producer that registered as a waiter after DoneTask() last looked.
+    if (__atomic_load_n(&spiTaskMemory->producerWaiting, __ATOMIC_RELAXED)) WakeSPITaskProducer();
+#endif
+    return false;
+}
+
+static inline SPITask *GetTask() // Returns the first task in the queue, or null if the queue is empty. Called on the thread that runs SPI tasks
+{
+    for (;;) {
+        uint32_t head = __atomic_load_n(&spiTaskMemory->queueHead, __ATOMIC_RELAXED);
+        if (head == spiTaskConsumerCachedTail && !RefreshCachedQueueTail(head)) return 0;
+        SPITask *task = (SPITask *) (spiTaskMemory->buffer + head);
+        if (task->cmd == SPI_TASK_WRAP_MARKER) // Wrapped around to the beginning of the ring buffer?
+        {
+            __atomic_store_n(&spiTaskMemory->queueHead, 0, __ATOMIC_RELEASE);
+#ifndef KERNEL_MODULE
+            // The main thread may be waiting in AllocTask() for the head to wrap so that it can write its own wrap marker
+            if (__atomic_load_n(&spiTaskMemory->producerWaiting, __ATOMIC_RELAXED)) WakeSPITaskProducer();
+#endif
+            if (spiTaskConsumerCachedTail == 0 && !RefreshCachedQueueTail(0)) return 0;
+            task = (SPITask *) spiTaskMemory->buffer;
+        }
+        // Claim the task, so that the producer can no longer supersede it, or skip it if it already has
+        if (__atomic_exchange_n(&task->state, SPI_TASK_STARTED, __ATOMIC_RELAXED) != SPI_TASK_SUPERSEDED) return task;
+        const uint32_t bytes = task->PayloadSize() + 1;
+        DoneTask(task);
+        __atomic_store_n(&spiTaskMemory->spiBytesSkipped, spiTaskMemory->spiBytesSkipped + bytes, __ATOMIC_RELEASE);
+    }
 }
 
+// Cleared when the program is shutting down. Defined by the program that links in the driver.
+extern volatile bool programRunning;
+
+// Sets up the SPI and GPIO peripherals and the task queue, and brings up the display, ready to run the tasks that are queued.
 int InitSPI(void);
 
+// Same as InitSPI(), but with FAST_BOOT, returns as soon as tasks can be queued, and leaves bringing up the display to the SPI
+// thread, so that the reset and wake up delays of the display controller pass while the caller goes on with its own setup. The
+// tasks queued meanwhile run once the display is up.
+int InitSPIInBackground(void);
+
+// Returns once the display has been brought up, see InitSPIInBackground()
+void WaitForDisplay(void);
+
 void DeinitSPI(void);
 
 void RunSPITask(SPITask *task);
 
-void DoneTask(SPITask *task);
+// Sends the commands of an encoded command table (see command_table.h) straight to the bus with polled SPI, waiting out its delays,
+// and returns once the last byte has been sent. Only to be called while nothing else runs tasks, e.g. during display initialization.
+void RunCommandTable(const uint8_t *table, uint32_t size);
+
+// Sends the given command followed by size parameter bytes of the same value, e.g. a pixel write that fills GRAM with one color,
+// straight to the bus like RunCommandTable() does.
+void RunFillCommand(uint8_t cmd, uint8_t value, uint32_t size);
+
+// Whether BeginCompoundTask() packs the small commands that follow into a compound task. On by default, cleared to compare against.
+extern bool packCompoundTasks;
+
+// Parameter byte count that marks a delay in an encoded command table
+#define COMMAND_TABLE_DELAY 0xFF
+
+// Empties the queue and resets the state of both of its ends. Only to be called while nothing is producing or consuming tasks.
+void ResetSPITaskQueue(void);
+
+// Sets up the producer state of this program to continue producing into a queue that another producer has been filling, e.g. after
+// mapping the queue of the kernel module.
+void AttachSPITaskProducer(void);
+
+// Runs all tasks currently in the queue, returns when the queue has been drained. Only to be called while the SPI thread is not
+// running (before InitSPI() starts it), since the SPI thread is the sole consumer of the queue.
+void ExecuteSPITasks(void);
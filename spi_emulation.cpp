@@ -0,0 +1,427 @@
+#include "config.h"
+
+#ifdef SPI_EMULATION
+
+#include <time.h>
+#include <math.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "spi.h"
+#include "dma.h"
+#include "util.h"
+
+GPIORegisterFile emulatedGPIORegisters;
+SPIRegisterFile emulatedSPIRegisters;
+DMAChannelRegisterFile emulatedDMARegisters[EMULATED_DMA_CHANNELS];
+EmulatedSPIStatistics emulatedSPIStatistics;
+
+static uint64_t coreFrequencyHz = EMULATED_CORE_FREQUENCY_HZ;
+
+static uint32_t gpioLevels[2]; // Levels of the pins that the model drives, see EMULATED_GPIO_LEV for the simulated inputs
+
+// Simulated panel refresh, see SetEmulatedTearingEffect()
+static int tearingEffectPin = -1;
+static uint64_t refreshOriginNsecs = 0;
+static double refreshPeriodNsecs = 0, vblankNsecs = 0;
+
+// Internal state of the SPI0 block that is not directly visible in the registers.
+static uint32_t csReg = 0; // Writable bits of the CS register (TA and the drive settings)
+static uint32_t clkReg = 0;
+static uint32_t dlenReg = 0;
+static uint32_t txFifoCount = 0;
+static uint32_t rxFifoCount = 0;
+static uint64_t shiftStartNsecs = 0; // Timestamp at which the byte at the front of the TX FIFO started clocking out
+static uint64_t modelNowNsecs = 0; // Time that the model was last advanced to
+static uint32_t dmaTransferBytesLeft = 0; // In DMA mode, bytes left of the DLEN bytes set by the header word, 0 when not transferring
+
+// Memory regions registered with RegisterEmulatedBusMemory()
+typedef struct EmulatedBusMemory {
+    uint8_t *ptr;
+    uint32_t busAddress;
+    uint32_t size;
+} EmulatedBusMemory;
+
+#define EMULATED_MAX_BUS_MEMORY_REGIONS 16
+static EmulatedBusMemory busMemory[EMULATED_MAX_BUS_MEMORY_REGIONS];
+static uint32_t nextBusAddress = 0xC1000000;
+
+// State of a DMA channel that is not visible in its registers.
+typedef struct EmulatedDMAChannel {
+    bool active;
+    bool end;
+    uint32_t cbAddr; // CONBLK_AD register
+    DMAControlBlock cb; // Control block being run
+    uint32_t src, dst, bytesLeft; // Progress through the control block
+} EmulatedDMAChannel;
+
+static EmulatedDMAChannel dmaChannels[EMULATED_DMA_CHANNELS];
+
+static uint64_t NowNsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+double EmulatedNsecsPerByte() {
+    if (!coreFrequencyHz) return 0.0;
+    // A CDIV value of zero means a divisor of 65536. Odd divisors are rounded down.
+    uint32_t divisor = clkReg ? (clkReg & ~1u) : 65536;
+    if (!divisor) divisor = 2;
+    // See UNLOCK_FAST_8_CLOCKS_SPI() in spi.cpp: with DLEN > 1 bytes clock out in 8 cycles, otherwise with an idle 9th cycle.
+    uint32_t clocksPerByte = (dlenReg > 1) ? 8 : 9;
+    return 1e9 * divisor * clocksPerByte / coreFrequencyHz;
+}
+
+// In DMA mode the FIFO entries are 32-bit words, each carrying four bytes
+static uint32_t FifoCapacityBytes() {
+    return EMULATED_SPI_FIFO_DEPTH * ((csReg & BCM2835_SPI0_CS_DMAEN) ? 4 : 1);
+}
+
+uint32_t RegisterEmulatedBusMemory(void *ptr, uint32_t bytes) {
+    for (int i = 0; i < EMULATED_MAX_BUS_MEMORY_REGIONS; ++i)
+        if (!busMemory[i].ptr) {
+            busMemory[i].ptr = (uint8_t *) ptr;
+            busMemory[i].busAddress = nextBusAddress;
+            busMemory[i].size = bytes;
+            nextBusAddress += ALIGN_UP(bytes, 4096);
+            return busMemory[i].busAddress;
+        }
+    FATAL_ERROR("Too many emulated DMA memory regions!");
+}
+
+void UnregisterEmulatedBusMemory(void *ptr) {
+    for (int i = 0; i < EMULATED_MAX_BUS_MEMORY_REGIONS; ++i)
+        if (busMemory[i].ptr == ptr) busMemory[i].ptr = 0;
+}
+
+static uint8_t *BusToVirtual(uint32_t busAddress, uint32_t bytes) {
+    for (int i = 0; i < EMULATED_MAX_BUS_MEMORY_REGIONS; ++i)
+        if (busMemory[i].ptr && busAddress >= busMemory[i].busAddress &&
+            busAddress + bytes <= busMemory[i].busAddress + busMemory[i].size)
+            return busMemory[i].ptr + (busAddress - busMemory[i].busAddress);
+    fprintf(stderr, "DMA accessed bus address 0x%08X, which is not in registered memory\n", busAddress);
+    FATAL_ERROR("Emulated DMA memory access fault!");
+}
+
+static bool DataControlLineHigh() {
+    return (gpioLevels[GPIO_TFT_DATA_CONTROL / 32] & (1u << (GPIO_TFT_DATA_CONTROL % 32))) != 0;
+}
+
+static void WriteGPIOLevel(uint32_t index, uint32_t bits, bool high) {
+    bool dataControlWasHigh = DataControlLineHigh();
+    if (high) gpioLevels[index] |= bits;
+    else gpioLevels[index] &= ~bits;
+    if (dataControlWasHigh != DataControlLineHigh()) ++emulatedSPIStatistics.dataControlToggles;
+}
+
+static void ServiceDMA();
+
+// Advances the model up to the current wall clock time, moving bytes from TX FIFO through the shift register to RX FIFO, with
+// active DMA channels refilling the TX FIFO and draining the RX FIFO as the bytes flow.
+static void AdvanceBus() {
+    uint64_t now = modelNowNsecs = NowNsecs();
+    for (;;) {
+        ServiceDMA();
+        if (!(csReg & BCM2835_SPI0_CS_TA) || txFifoCount == 0 || rxFifoCount >= FifoCapacityBytes()) {
+            // Bus is stalled, so nothing has been progressing since the last time we looked.
+            shiftStartNsecs = now;
+            return;
+        }
+
+        double nsecsPerByte = EmulatedNsecsPerByte();
+        uint32_t maxBytes = MIN(txFifoCount, FifoCapacityBytes() - rxFifoCount);
+        if (dmaTransferBytesLeft) maxBytes = MIN(maxBytes, dmaTransferBytesLeft);
+        uint32_t bytes = (nsecsPerByte > 0.0) ? (uint32_t) MIN((double) maxBytes, (now - shiftStartNsecs) / nsecsPerByte)
+                                              : maxBytes;
+        if (bytes == 0) return;
+
+        txFifoCount -= bytes;
+        rxFifoCount += bytes; // SPI is full duplex, so every byte clocked out clocks a byte in
+        uint64_t elapsed = (uint64_t) (bytes * nsecsPerByte);
+        shiftStartNsecs += elapsed;
+
+        emulatedSPIStatistics.bytesClocked += bytes;
+        if (!DataControlLineHigh()) emulatedSPIStatistics.commandBytesClocked += bytes;
+        emulatedSPIStatistics.busActiveNsecs += elapsed;
+
+        // With ADCS, the peripheral ends the transfer by itself once DLEN bytes have been sent in DMA mode.
+        if (dmaTransferBytesLeft) {
+            dmaTransferBytesLeft -= bytes;
+            if (!dmaTransferBytesLeft && (csReg & BCM2835_SPI0_CS_ADCS)) csReg &= ~BCM2835_SPI0_CS_TA;
+        }
+
+        // Ran out of time before running out of bytes? Otherwise DMA may have more bytes to feed in.
+        if (bytes < maxBytes) return;
+    }
+}
+
+// In DMA mode with TA clear, a word written to the FIFO sets DLEN and CS[7:0] instead of being sent.
+static bool FifoWriteIsDMAHeader() {
+    return (csReg & BCM2835_SPI0_CS_DMAEN) && !(csReg & BCM2835_SPI0_CS_TA);
+}
+
+static void ApplyDMAHeader(uint32_t header) {
+    dlenReg = header >> 16;
+    csReg = (csReg & ~0xFFu) | (header & 0xFF);
+    dmaTransferBytesLeft = dlenReg;
+    shiftStartNsecs = modelNowNsecs;
+}
+
+static void LoadControlBlock(EmulatedDMAChannel &ch, uint32_t cbAddr) {
+    if ((cbAddr & 31)) FATAL_ERROR("DMA control block address is not 32-byte aligned!");
+    memcpy(&ch.cb, BusToVirtual(cbAddr, sizeof(DMAControlBlock)), sizeof(DMAControlBlock));
+    ch.cbAddr = cbAddr;
+    ch.src = ch.cb.src;
+    ch.dst = ch.cb.dst;
+    ch.bytesLeft = ch.cb.len;
+}
+
+// Runs a control block that is not paced by a peripheral: a memory copy, or a write to the GPIO set/clear registers.
+static void RunUnpacedControlBlock(EmulatedDMAChannel &ch) {
+    if (!(ch.cb.ti & BCM2835_DMA_TI_DEST_IGNORE)) {
+        const uint8_t *src = BusToVirtual(ch.src, ch.bytesLeft);
+        if (ch.dst == BCM2835_GPIO_SET0_BUS_ADDRESS || ch.dst == BCM2835_GPIO_CLR0_BUS_ADDRESS) {
+            uint32_t bits;
+            memcpy(&bits, src, sizeof(bits));
+            WriteGPIOLevel(0, bits, ch.dst == BCM2835_GPIO_SET0_BUS_ADDRESS);
+        } else
+            memcpy(BusToVirtual(ch.dst, ch.bytesLeft), src, ch.bytesLeft);
+    }
+    ch.bytesLeft = 0;
+}
+
+// Lets each active DMA channel move as much data as the FIFOs allow right now.
+static void ServiceDMA() {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (int i = 0; i < EMULATED_DMA_CHANNELS; ++i) {
+            EmulatedDMAChannel &ch = dmaChannels[i];
+            if (!ch.active) continue;
+            const uint32_t ti = ch.cb.ti;
+            const uint32_t permap = (ti >> BCM2835_DMA_TI_PERMAP_SHIFT) & 0x1F;
+            if ((ti & BCM2835_DMA_TI_DEST_DREQ) && permap == BCM2835_DMA_DREQ_SPI_TX) {
+                // Word writes to the TX FIFO, paced by the FIFO having room
+                while (ch.bytesLeft > 0) {
+                    const uint32_t bytes = MIN(ch.bytesLeft, 4u);
+                    uint32_t word = 0;
+                    memcpy(&word, BusToVirtual(ch.src, bytes), bytes);
+                    if (FifoWriteIsDMAHeader()) ApplyDMAHeader(word);
+                    else if (txFifoCount + bytes <= FifoCapacityBytes()) {
+                        txFifoCount += bytes;
+                        emulatedSPIStatistics.dmaBytesToFIFO += bytes;
+                    } else break;
+                    if ((ti & BCM2835_DMA_TI_SRC_INC)) ch.src += 4;
+                    ch.bytesLeft -= bytes;
+                    progress = true;
+                }
+            } else if ((ti & BCM2835_DMA_TI_SRC_DREQ) && permap == BCM2835_DMA_DREQ_SPI_RX) {
+                // Reads from the RX FIFO, paced by the FIFO having data. MISO is not connected, so the data is all zeroes.
+                const uint32_t bytes = MIN(ch.bytesLeft, rxFifoCount);
+                if (bytes > 0) {
+                    rxFifoCount -= bytes;
+                    if (!(ti & BCM2835_DMA_TI_DEST_IGNORE)) {
+                        memset(BusToVirtual(ch.dst, bytes), 0, bytes);
+                        if ((ti & BCM2835_DMA_TI_DEST_INC)) ch.dst += bytes;
+                    }
+                    ch.bytesLeft -= bytes;
+                    progress = true;
+                }
+            } else if (ch.bytesLeft > 0) {
+                RunUnpacedControlBlock(ch);
+                progress = true;
+            }
+
+            if (ch.bytesLeft == 0) {
+                ++emulatedSPIStatistics.dmaControlBlocks;
+                if (ch.cb.next) LoadControlBlock(ch, ch.cb.next);
+                else {
+                    ch.active = false;
+                    ch.end = true;
+                }
+                progress = true;
+            }
+        }
+    }
+}
+
+static uint32_t ReadDMACS(uint32_t channel) {
+    AdvanceBus();
+    const EmulatedDMAChannel &ch = dmaChannels[channel];
+    return (ch.active ? BCM2835_DMA_CS_ACTIVE : 0) | (ch.end ? BCM2835_DMA_CS_END : 0);
+}
+
+static void WriteDMACS(uint32_t channel, uint32_t value) {
+    AdvanceBus();
+    EmulatedDMAChannel &ch = dmaChannels[channel];
+    if ((value & (BCM2835_DMA_CS_RESET | BCM2835_DMA_CS_ABORT))) {
+        ch.active = ch.end = false;
+        return;
+    }
+    if ((value & BCM2835_DMA_CS_END)) ch.end = false; // Write 1 to clear
+    if ((value & BCM2835_DMA_CS_ACTIVE) && !ch.active && ch.cbAddr) {
+        LoadControlBlock(ch, ch.cbAddr);
+        ch.active = true;
+        AdvanceBus();
+    }
+}
+
+static uint32_t ReadCS() {
+    AdvanceBus();
+    uint32_t cs = csReg;
+    if (txFifoCount < FifoCapacityBytes()) cs |= BCM2835_SPI0_CS_TXD;
+    if (rxFifoCount > 0) cs |= BCM2835_SPI0_CS_RXD;
+    if (rxFifoCount >= FifoCapacityBytes() * 3 / 4) cs |= BCM2835_SPI0_CS_RXR;
+    if (rxFifoCount >= FifoCapacityBytes()) cs |= BCM2835_SPI0_CS_RXF;
+    if ((csReg & BCM2835_SPI0_CS_TA) && txFifoCount == 0) cs |= BCM2835_SPI0_CS_DONE;
+    return cs;
+}
+
+static void WriteCS(uint32_t value) {
+    AdvanceBus();
+    if ((value & (BCM2835_SPI0_CS_CLEAR & ~BCM2835_SPI0_CS_CLEAR_RX))) txFifoCount = dmaTransferBytesLeft = 0;
+    if ((value & BCM2835_SPI0_CS_CLEAR_RX)) rxFifoCount = 0;
+    // CLEAR bits are self-resetting, and status bits are read-only.
+    csReg = value & ~(BCM2835_SPI0_CS_CLEAR | BCM2835_SPI0_CS_RXF | BCM2835_SPI0_CS_RXR | BCM2835_SPI0_CS_TXD |
+                      BCM2835_SPI0_CS_RXD | BCM2835_SPI0_CS_DONE);
+    shiftStartNsecs = NowNsecs();
+}
+
+static void WriteFIFO(uint32_t value) {
+    AdvanceBus();
+    if (FifoWriteIsDMAHeader()) {
+        ApplyDMAHeader(value);
+        return;
+    }
+    if (txFifoCount >= FifoCapacityBytes()) {
+        ++emulatedSPIStatistics.fifoOverruns;
+        return;
+    }
+    if (txFifoCount == 0) shiftStartNsecs = NowNsecs();
+    ++txFifoCount;
+    (void) value;
+}
+
+static uint32_t ReadFIFO() {
+    AdvanceBus();
+    if (rxFifoCount > 0) --rxFifoCount;
+    return 0; // Displays are write-only, MISO is not connected.
+}
+
+// Time into the current refresh of the simulated panel
+static double RefreshPhaseNsecs(uint64_t nsecs) {
+    return fmod((double) (nsecs - refreshOriginNsecs), refreshPeriodNsecs);
+}
+
+static uint32_t ReadGPIOLevels(uint32_t index) {
+    uint32_t levels = gpioLevels[index];
+    if (tearingEffectPin >= 0 && (uint32_t) tearingEffectPin / 32 == index && RefreshPhaseNsecs(NowNsecs()) < vblankNsecs)
+        levels |= 1u << (tearingEffectPin % 32);
+    return levels;
+}
+
+uint32_t EmulatedRegisterRead(int reg, uint32_t index) {
+    switch (reg) {
+        case EMULATED_SPI_CS:
+            return ReadCS();
+        case EMULATED_SPI_FIFO:
+            return ReadFIFO();
+        case EMULATED_SPI_CLK:
+            return clkReg;
+        case EMULATED_SPI_DLEN:
+            return dlenReg;
+        case EMULATED_DMA_CS:
+            return ReadDMACS(index);
+        case EMULATED_DMA_CONBLK_AD:
+            return dmaChannels[index].cbAddr;
+        case EMULATED_GPIO_LEV:
+            return ReadGPIOLevels(index);
+        default:
+            return 0; // GPSET and GPCLR are write-only
+    }
+}
+
+void EmulatedRegisterWrite(int reg, uint32_t index, uint32_t value) {
+    switch (reg) {
+        case EMULATED_SPI_CS:
+            WriteCS(value);
+            break;
+        case EMULATED_SPI_FIFO:
+            WriteFIFO(value);
+            break;
+        case EMULATED_SPI_CLK:
+            AdvanceBus();
+            clkReg = value & 0xFFFF;
+            break;
+        case EMULATED_SPI_DLEN:
+            AdvanceBus();
+            dlenReg = value & 0xFFFF;
+            break;
+        case EMULATED_GPIO_SET:
+            AdvanceBus(); // Account bytes already clocked out to the Data/Control level they were sent with
+            WriteGPIOLevel(index, value, true);
+            break;
+        case EMULATED_GPIO_CLR:
+            AdvanceBus();
+            WriteGPIOLevel(index, value, false);
+            break;
+        case EMULATED_DMA_CS:
+            WriteDMACS(index, value);
+            break;
+        case EMULATED_DMA_CONBLK_AD:
+            dmaChannels[index].cbAddr = value;
+            break;
+    }
+}
+
+bool EmulatedSPIInterruptPending() {
+    const uint32_t cs = ReadCS();
+    return ((cs & BCM2835_SPI0_CS_INTD) && (cs & BCM2835_SPI0_CS_DONE)) ||
+           ((cs & BCM2835_SPI0_CS_INTR) && (cs & BCM2835_SPI0_CS_RXR));
+}
+
+void SetEmulatedTearingEffect(int gpioPin, double refreshHz, uint32_t vblankUsecs) {
+    tearingEffectPin = (refreshHz > 0) ? gpioPin : -1;
+    refreshOriginNsecs = NowNsecs();
+    refreshPeriodNsecs = (refreshHz > 0) ? 1e9 / refreshHz : 0;
+    vblankNsecs = vblankUsecs * 1e3;
+}
+
+int EmulatedPanelScanline(uint64_t usecs) {
+    if (tearingEffectPin < 0) return -1;
+    const double phase = RefreshPhaseNsecs(usecs * 1000);
+    if (phase < vblankNsecs) return -1;
+    return (int) ((phase - vblankNsecs) * DISPLAY_NATIVE_HEIGHT / (refreshPeriodNsecs - vblankNsecs));
+}
+
+void SetEmulatedCoreFrequency(uint64_t frequencyHz) {
+    AdvanceBus();
+    coreFrequencyHz = frequencyHz;
+}
+
+void ResetSPIEmulation() {
+    memset(&emulatedGPIORegisters, 0, sizeof(emulatedGPIORegisters));
+    memset(&emulatedSPIRegisters, 0, sizeof(emulatedSPIRegisters));
+    memset(&emulatedSPIStatistics, 0, sizeof(emulatedSPIStatistics));
+    memset(emulatedDMARegisters, 0, sizeof(emulatedDMARegisters));
+    memset(dmaChannels, 0, sizeof(dmaChannels));
+    memset(gpioLevels, 0, sizeof(gpioLevels));
+    tearingEffectPin = -1;
+    for (uint32_t i = 0; i < 2; ++i) {
+        emulatedGPIORegisters.gpset[i].index = i;
+        emulatedGPIORegisters.gpclr[i].index = i;
+        emulatedGPIORegisters.gplev[i].index = i;
+    }
+    for (uint32_t i = 0; i < EMULATED_DMA_CHANNELS; ++i) {
+        emulatedDMARegisters[i].cs.index = i;
+        emulatedDMARegisters[i].cbAddr.index = i;
+    }
+    csReg = clkReg = dlenReg = dmaTransferBytesLeft = 0;
+    txFifoCount = rxFifoCount = 0;
+    shiftStartNsecs = NowNsecs();
+}
+
+#endif
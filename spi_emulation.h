@@ -0,0 +1,111 @@
+#pragma once
+
+#ifdef SPI_EMULATION
+
+#include <inttypes.h>
+
+// Software model of the BCM2835 SPI0 and GPIO register files. When building with SPI_EMULATION, the register file structs in spi.h
+// are replaced with the ones below, where each register is a proxy that forwards loads and stores to the model. This way all the
+// code that drives the bus (RunSPITask, WaitForPolledSPITransferToFinish, BEGIN/END_SPI_COMMUNICATION, SET_GPIO, ...) runs unmodified
+// on a host machine without /dev/mem, e.g. for benchmarking the driver on an x86 Linux box.
+
+// Identifies which peripheral register a proxy forwards to.
+#define EMULATED_SPI_CS    0
+#define EMULATED_SPI_FIFO  1
+#define EMULATED_SPI_CLK   2
+#define EMULATED_SPI_DLEN  3
+#define EMULATED_GPIO_SET  4
+#define EMULATED_GPIO_CLR  5
+#define EMULATED_DMA_CS    6
+#define EMULATED_DMA_CONBLK_AD 7
+#define EMULATED_GPIO_LEV  8
+
+uint32_t EmulatedRegisterRead(int reg, uint32_t index);
+void EmulatedRegisterWrite(int reg, uint32_t index, uint32_t value);
+
+template<int REG>
+struct EmulatedRegister {
+    uint32_t index; // For register arrays (GPSET0/GPSET1, ...), the index of this register in the array
+
+    inline operator uint32_t() const volatile { return EmulatedRegisterRead(REG, index); }
+
+    inline void operator=(uint32_t value) volatile { EmulatedRegisterWrite(REG, index, value); }
+};
+
+typedef struct GPIORegisterFile {
+    uint32_t gpfsel[6], reserved0; // GPIO Function Select registers, 3 bits per pin, 10 pins in an uint32_t
+    EmulatedRegister<EMULATED_GPIO_SET> gpset[2]; // Writing a 1 to bit I sets pin I high in gplev
+    uint32_t reserved1;
+    EmulatedRegister<EMULATED_GPIO_CLR> gpclr[2]; // Writing a 1 to bit I sets pin I low in gplev
+    uint32_t reserved2;
+    EmulatedRegister<EMULATED_GPIO_LEV> gplev[2]; // Current pin levels, maintained by the model, see SetEmulatedTearingEffect()
+} GPIORegisterFile;
+
+typedef struct SPIRegisterFile {
+    EmulatedRegister<EMULATED_SPI_CS> cs;
+    EmulatedRegister<EMULATED_SPI_FIFO> fifo;
+    EmulatedRegister<EMULATED_SPI_CLK> clk;
+    EmulatedRegister<EMULATED_SPI_DLEN> dlen;
+} SPIRegisterFile;
+
+// Register file of one DMA channel. Only the CS and CONBLK_AD registers are modeled, the rest of the registers mirror the active
+// control block on hardware and are not maintained here.
+typedef struct DMAChannelRegisterFile {
+    EmulatedRegister<EMULATED_DMA_CS> cs;
+    EmulatedRegister<EMULATED_DMA_CONBLK_AD> cbAddr;
+    uint32_t ti, sourceAddr, destAddr, len, stride, nextConBk, debug;
+} DMAChannelRegisterFile;
+
+// Number of DMA channels in the model. (Channel 15 lives at a different address on hardware, and is not used)
+#define EMULATED_DMA_CHANNELS 15
+
+// Depth of the SPI0 TX and RX FIFOs, in FIFO entries. In polled mode each entry holds one byte, in DMA mode a 32-bit word.
+#define EMULATED_SPI_FIFO_DEPTH 16
+
+// Core clock frequency that the SPI clock divider (spi->clk) divides down to get the bus speed. Pi 3B and Zero W default to
+// core_freq=400 when running in turbo mode.
+#define EMULATED_CORE_FREQUENCY_HZ 400000000ULL
+
+typedef struct EmulatedSPIStatistics {
+    uint64_t bytesClocked; // Total number of bytes shifted out on MOSI
+    uint64_t commandBytesClocked; // Number of bytes shifted out while the Data/Control line was low
+    uint64_t dataControlToggles; // Number of times the Data/Control line changed level
+    uint64_t fifoOverruns; // Number of bytes written to a full TX FIFO, which the hardware would have dropped
+    uint64_t busActiveNsecs; // Time the bus was spent clocking bytes out
+    uint64_t dmaBytesToFIFO; // Number of bytes that DMA channels wrote to the TX FIFO (not counting DLEN+CS header words)
+    uint64_t dmaControlBlocks; // Number of DMA control blocks that ran to completion
+} EmulatedSPIStatistics;
+
+extern GPIORegisterFile emulatedGPIORegisters;
+extern SPIRegisterFile emulatedSPIRegisters;
+extern DMAChannelRegisterFile emulatedDMARegisters[EMULATED_DMA_CHANNELS];
+extern EmulatedSPIStatistics emulatedSPIStatistics;
+
+// DMA control blocks refer to memory by VideoCore bus addresses. Memory that the DMA model is to access must be registered here
+// first, which assigns it an address in the uncached 0xC0000000 bus alias, like VideoCore mailbox allocated memory would have.
+uint32_t RegisterEmulatedBusMemory(void *ptr, uint32_t bytes);
+void UnregisterEmulatedBusMemory(void *ptr);
+
+// Returns whether the SPI0 interrupt line would be asserted right now: INTD is set and the transfer is DONE, or INTR is set and the
+// RX FIFO needs reading (RXR). There is no interrupt controller in the model, so harnesses poll this to run interrupt handlers.
+bool EmulatedSPIInterruptPending(void);
+
+// Resets the register model to power-on state. Called by InitSPI().
+void ResetSPIEmulation(void);
+
+// Specifies the core clock that the bus speed is derived from (bus speed=coreFrequencyHz/spi->clk). Pass 0 to model an infinitely
+// fast bus, in which case each byte is clocked out the moment it is written to the FIFO, and benchmarks measure pure CPU overhead.
+void SetEmulatedCoreFrequency(uint64_t coreFrequencyHz);
+
+// Returns the number of nanoseconds that clocking out one byte takes with the current clk and dlen register settings.
+double EmulatedNsecsPerByte(void);
+
+// Simulates the tearing effect (TE) output of a panel that refreshes at refreshHz, on the given GPIO pin: the pin is high for the
+// first vblankUsecs of each refresh, after which the panel scans out its DISPLAY_NATIVE_HEIGHT native rows top to bottom, evenly
+// over the rest of the refresh. Pass refreshHz=0 to disconnect the pin.
+void SetEmulatedTearingEffect(int gpioPin, double refreshHz, uint32_t vblankUsecs);
+
+// Returns the native row that the simulated panel scans out at the given tick() time, or -1 if it is in vertical blanking.
+int EmulatedPanelScanline(uint64_t usecs);
+
+#endif
@@ -0,0 +1,132 @@
+#pragma once
+
+#ifndef KERNEL_MODULE
+#include <string.h> // memset
+#endif
+
+#include "spi.h"
+
+// Interrupt driven SPI task pump: sends the tasks in the queue out over the bus without ever waiting on the SPI peripheral. Each call
+// to SPIPumpService() does as much as the FIFO allows right away, and leaves the SPI0 interrupts (INTD/INTR) enabled for the event
+// that it needs next to make progress:
+//  - while sending the command bytes of a task, INTD, so that the Data/Control line can be raised once they have clocked out,
+//  - while sending the payload, INTR, which fires when the RX FIFO is 3/4 full, i.e. while the TX FIFO still has bytes left to send,
+//    so that it gets refilled before the bus runs dry, and INTD in case the TX FIFO empties before RXR triggers,
+//  - after the last payload byte, INTD, to finish the task and start the next one.
+// The commands of a compound task (SPI_TASK_COMPOUND) go through the same phases one after the other.
+// When the queue runs empty, the interrupts are disabled, and the pump idles until SPIPumpKick() is called after new tasks have been
+// committed to the empty queue.
+//
+// The kernel module runs this from its SPI interrupt handler and its SPI_BUS_IOCTL_KICK ioctl, and "bench kpump" runs it against
+// the emulated SPI peripheral. Callers serialize the calls with a lock.
+
+typedef struct SPIPump {
+    SPITask *task; // Task being sent, or 0 when idle
+    uint8_t *next, *end; // Payload bytes of the command that have not yet been written to the FIFO
+    uint8_t *nextCommand, *commandsEnd; // Commands of a compound task that have not been started yet
+    int sendingPayload; // 0 while the command bytes are being sent, 1 while the payload is
+
+    uint64_t idleSince; // Timestamp when the pump last ran out of tasks
+    uint64_t idleUsecs; // Total time spent with the queue empty, i.e. with the bus idle
+    uint32_t kicks; // Number of times SPIPumpKick() was called
+    uint32_t kicksWhileIdle; // ... of which found the pump idle, and got it running again
+    uint32_t tasksDone;
+    uint64_t bytesSent; // Bytes written to the TX FIFO: the 16-bit command word of each command, plus its payload
+} SPIPump;
+
+static inline void SPIPumpInit(SPIPump *pump, uint64_t now) {
+    memset(pump, 0, sizeof(*pump));
+    pump->idleSince = now;
+}
+
+static inline void SPIPumpStartCommand(SPIPump *pump, uint8_t cmd, uint8_t *payload, uint32_t size) {
+    pump->sendingPayload = 0;
+    pump->next = payload;
+    pump->end = payload + size;
+    // On e.g. the ILI9486, all commands are 16-bit, see RunSPITask()
+    CLEAR_GPIO(GPIO_TFT_DATA_CONTROL);
+    spi->fifo = 0x00;
+    spi->fifo = cmd;
+    pump->bytesSent += 2;
+    spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | BCM2835_SPI0_CS_INTD | DISPLAY_SPI_DRIVE_SETTINGS;
+}
+
+// Starts the next command of the compound task being sent
+static inline void SPIPumpStartNextCommand(SPIPump *pump) {
+    uint8_t *p = pump->nextCommand;
+    pump->nextCommand = p + 2 + p[0];
+    SPIPumpStartCommand(pump, p[1], p + 2, p[0]);
+}
+
+static inline void SPIPumpStartTask(SPIPump *pump, SPITask *task) {
+    pump->task = task;
+    if (task->cmd == SPI_TASK_COMPOUND) {
+        pump->nextCommand = task->data;
+        pump->commandsEnd = task->data + task->size;
+        SPIPumpStartNextCommand(pump);
+    } else {
+        pump->nextCommand = pump->commandsEnd = 0;
+        SPIPumpStartCommand(pump, task->cmd, task->data, task->size);
+    }
+}
+
+// Advances the pump as far as the SPI FIFO allows. Called from the SPI interrupt, and from SPIPumpKick().
+static inline void SPIPumpService(SPIPump *pump, uint64_t now) {
+    for (;;) {
+        if (!pump->task) {
+            SPITask *task = GetTask();
+            if (!task) {
+                // Out of work: silence the interrupts, but keep TA set so that the bus stays ready for the next kick.
+                spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
+                return;
+            }
+            if (pump->idleSince) {
+                pump->idleUsecs += now - pump->idleSince;
+                pump->idleSince = 0;
+            }
+            SPIPumpStartTask(pump, task);
+            return;
+        }
+
+        const uint32_t cs = spi->cs;
+        if (pump->sendingPayload && pump->next < pump->end) {
+            // Refill the TX FIFO. RX bytes are not needed, clearing them restarts the RXR threshold count for the next refill.
+            uint8_t *const first = pump->next;
+            while (pump->next < pump->end && (spi->cs & BCM2835_SPI0_CS_TXD))
+                spi->fifo = *pump->next++;
+            pump->bytesSent += pump->next - first;
+            spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS | BCM2835_SPI0_CS_INTD |
+                      (pump->next < pump->end ? BCM2835_SPI0_CS_INTR : 0);
+            return;
+        }
+
+        // All bytes of the current phase are in the FIFO, wait for them to clock out.
+        if (!(cs & BCM2835_SPI0_CS_DONE)) return;
+
+        if (!pump->sendingPayload && pump->next < pump->end) {
+            SET_GPIO(GPIO_TFT_DATA_CONTROL);
+            pump->sendingPayload = 1;
+            continue;
+        }
+
+        if (pump->nextCommand < pump->commandsEnd) {
+            SPIPumpStartNextCommand(pump);
+            return;
+        }
+
+        ++pump->tasksDone;
+        DoneTask(pump->task);
+        pump->task = 0;
+        if (SPITaskQueueDrained()) pump->idleSince = now;
+    }
+}
+
+// Called after committing tasks to an empty queue, to restart the pump if it had run out of work. The producer checks for the empty
+// queue after publishing the new queueTail, and GetTask() re-reads queueTail behind a full barrier before it reports the queue empty,
+// so at least one of the two sees the other: either the pump picks up the new task by itself, or it gets kicked.
+static inline void SPIPumpKick(SPIPump *pump, uint64_t now) {
+    ++pump->kicks;
+    if (pump->task) return;
+    ++pump->kicksWhileIdle;
+    SPIPumpService(pump, now);
+}
@@ -0,0 +1,273 @@
+#include "config.h"
+#include "tearing.h"
+#include "spi.h"
+#include "tick.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <memory.h>
+
+// How long to watch the TE pin at startup, and how many rising edges it has to show in that time to measure the period from
+#define CALIBRATION_USECS 200000
+#define CALIBRATION_MIN_EDGES 5
+
+// An edge is only timed if the pin was seen low at most this long before it was seen high
+#define EDGE_RESOLUTION_USECS 50
+
+// While holding a write, the pin is polled continuously from this long before the next edge is due until it is seen, to keep the
+// phase estimate from drifting. The rest of the hold is spent sleeping.
+#define EDGE_WINDOW_USECS 1000
+#define SLEEP_SLACK_USECS 200
+
+// Each timed edge corrects the period estimate by this fraction of its prediction error
+#define PERIOD_CORRECTION 0.125
+
+// Without a timed edge for this long, the next write that would run over the next edge waits for the edge first. Without one for
+// RECALIBRATE_USECS, the phase estimate is no longer trusted, and the period is measured again.
+#define RESYNC_USECS 250000
+#define RECALIBRATE_USECS 2000000
+
+// How far off the estimate of the beam may be, from timing, from vertical blanking not being part of the scanout, and from drift.
+// The beam is kept this much further away from the rows being written.
+#define BEAM_MARGIN_USECS 500
+
+TearingEffectStatistics tearingEffectStatistics = {};
+
+static struct {
+    bool enabled;
+    int pin;
+    bool level; // Level of the pin at the previous poll, and the time of that poll
+    uint64_t lastPoll;
+    uint64_t refreshStart; // Start of the latest refresh that was timed
+    double period; // Estimated refresh period, in usecs
+    uint64_t lastResync; // Last time that a write waited for an edge to time it
+    DisplayCursorState cursor; // Address window and write pointer of the controller, as of the tasks sent so far
+    int scrollTop, scrollRows, scrollStart; // Vertical scrolling area and the GRAM row shown at its top, likewise (see scroll.h)
+} te;
+
+// Measures the refresh period by polling the pin continuously for up to CALIBRATION_USECS. Returns false if the edges do not come
+// at a steady rate.
+static bool CalibrateTearingEffect() {
+    uint64_t edges[CALIBRATION_MIN_EDGES];
+    int numEdges = 0;
+    bool level = GET_GPIO(te.pin);
+    const uint64_t start = tick();
+    uint64_t now = start;
+    while (numEdges < CALIBRATION_MIN_EDGES && now - start < CALIBRATION_USECS) {
+        now = tick();
+        const bool high = GET_GPIO(te.pin);
+        if (high && !level) edges[numEdges++] = now;
+        level = high;
+    }
+    if (numEdges < CALIBRATION_MIN_EDGES) return false;
+    const double period = (double) (edges[numEdges - 1] - edges[0]) / (numEdges - 1);
+    for (int i = 1; i < numEdges; ++i)
+        if (fabs(edges[i] - edges[i - 1] - period) > period / 10) return false;
+    te.period = period;
+    te.refreshStart = te.lastPoll = edges[numEdges - 1];
+    te.level = level;
+    return true;
+}
+
+bool InitTearingEffectSync(int gpioPin) {
+    memset(&te, 0, sizeof(te));
+    memset(&tearingEffectStatistics, 0, sizeof(tearingEffectStatistics));
+    te.pin = gpioPin;
+    SET_GPIO_MODE(gpioPin, 0x00); // Input
+    // The cursor state of the controller is not known to us until the producer addresses it in full, which it does after
+    // InvalidateDisplayCursor(&displayCursor)
+    InvalidateDisplayCursor(&te.cursor);
+    te.scrollRows = DISPLAY_NATIVE_HEIGHT;
+    te.enabled = CalibrateTearingEffect();
+    if (te.enabled)
+        printf("Synchronizing display updates to the tearing effect signal on GPIO pin %d, the panel refreshes every %.2f msecs (%.2f Hz)\n",
+               gpioPin, te.period / 1000.0, 1e6 / te.period);
+    else
+        printf("No steady tearing effect signal on GPIO pin %d, display updates are not synchronized to it\n", gpioPin);
+    return te.enabled;
+}
+
+bool TearingEffectSyncEnabled() {
+    return te.enabled;
+}
+
+double TearingEffectRefreshPeriodUsecs() {
+    return te.period;
+}
+
+uint64_t NextRefreshStart(uint64_t now) {
+    if (now < te.refreshStart) return te.refreshStart;
+    return te.refreshStart + (uint64_t) (ceil((now - te.refreshStart) / te.period) * te.period);
+}
+
+// Polls the TE pin, and if it just went high, takes the time as the start of a refresh.
+static void PollTearingEffect(uint64_t now) {
+    const bool high = GET_GPIO(te.pin);
+    if (high && !te.level && now - te.lastPoll <= EDGE_RESOLUTION_USECS) {
+        const uint64_t edge = te.lastPoll + (now - te.lastPoll) / 2;
+        const double sinceLast = (double) (edge - te.refreshStart);
+        const double refreshes = round(sinceLast / te.period);
+        // An edge that is far off the prediction is more likely noise than drift, keep the estimate as it was
+        if (refreshes >= 1 && fabs(sinceLast - refreshes * te.period) < te.period / 10) {
+            te.period += (sinceLast - refreshes * te.period) / refreshes * PERIOD_CORRECTION;
+            te.refreshStart = edge;
+            __atomic_store_n(&tearingEffectStatistics.edges, tearingEffectStatistics.edges + 1, __ATOMIC_RELAXED);
+        }
+    }
+    te.level = high;
+    te.lastPoll = now;
+}
+
+// Waits until the given time, polling the pin continuously around the edges that are due in the meanwhile, and sleeping otherwise.
+static void WaitUntil(uint64_t deadline) {
+    for (;;) {
+        const uint64_t now = tick();
+        PollTearingEffect(now);
+        if (now >= deadline) return;
+        const uint64_t edgeWindowStart = NextRefreshStart(now - EDGE_WINDOW_USECS) - EDGE_WINDOW_USECS;
+        const uint64_t wake = MIN(deadline, edgeWindowStart);
+        if (wake > now + SLEEP_SLACK_USECS) usleep(wake - now - SLEEP_SLACK_USECS);
+    }
+}
+
+// Returns how many usecs from now a write to native rows a..b that takes the given time to send has to wait so that the beam does
+// not cross it, or 0 if it can start right away.
+static uint64_t TearFreeDelay(uint64_t now, int a, int b, double usecs) {
+    const double period = te.period, rowUsecs = period / DISPLAY_NATIVE_HEIGHT;
+#ifdef TEARING_EFFECT_WRITES_CROSS_SCAN_ORDER
+    const double rowsUsecs = (b - a + 1) * rowUsecs; // Time the beam spends on the rows
+#else
+    const double rowsUsecs = 0; // The beam may be on the rows when the write starts, as it runs ahead of the write
+#endif
+    // Time since the beam was at row a, and then the write can start if the beam is off the rows, and does not come around to
+    // row a before the write is done.
+    const double sinceRowA = fmod(fmod((double) (now - te.refreshStart) - a * rowUsecs, period) + period, period);
+    if (sinceRowA >= rowsUsecs + BEAM_MARGIN_USECS && period - sinceRowA >= usecs + BEAM_MARGIN_USECS) return 0;
+    if (rowsUsecs + usecs + 2 * BEAM_MARGIN_USECS > period) {
+        __atomic_store_n(&tearingEffectStatistics.writesTooLong, tearingEffectStatistics.writesTooLong + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    // Wait for the beam to pass the rows
+    return (uint64_t) fmod(rowsUsecs + BEAM_MARGIN_USECS - sinceRowA + period, period);
+}
+
+static inline int CursorCoordinate(const uint8_t *data, int i) {
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+    return (data[4 * i + 1] << 8) | data[4 * i + 3];
+#else
+    return (data[2 * i] << 8) | data[2 * i + 1];
+#endif
+}
+
+#ifdef HARDWARE_VERTICAL_SCROLLING
+// Row of the screen that the given GRAM row is shown on
+static inline int ScreenRowOfGRAMRow(int row) {
+    const int i = row - te.scrollTop;
+    if (i < 0 || i >= te.scrollRows) return row;
+    return te.scrollTop + (i - (te.scrollStart - te.scrollTop) + te.scrollRows) % te.scrollRows;
+}
+#endif
+
+// Follows a cursor or scroll command like the controller does
+static void TrackCommand(uint8_t cmd, const uint8_t *data, uint32_t size) {
+    DisplayCursorState &c = te.cursor;
+    const uint32_t coordinateBytes = SPI_BYTES_PER_COMMAND_WORD * 4;
+    if (cmd == DISPLAY_SET_CURSOR_X && size >= coordinateBytes) {
+        c.x0 = CursorCoordinate(data, 0);
+        c.x1 = CursorCoordinate(data, 1);
+    }
+    if (cmd == DISPLAY_SET_CURSOR_Y && size >= coordinateBytes) {
+        c.y0 = CursorCoordinate(data, 0);
+        c.y1 = CursorCoordinate(data, 1);
+    }
+#ifdef HARDWARE_VERTICAL_SCROLLING
+    if (cmd == DISPLAY_VERTICAL_SCROLLING_DEFINITION && size >= 3 * coordinateBytes / 2) {
+        te.scrollTop = CursorCoordinate(data, 0);
+        te.scrollRows = CursorCoordinate(data, 1);
+    }
+    if (cmd == DISPLAY_VERTICAL_SCROLLING_START_ADDRESS && size >= coordinateBytes / 2) te.scrollStart = CursorCoordinate(data, 0);
+#endif
+}
+
+// Follows the cursor and scroll commands and pixel writes like the controller does. For a pixel write, returns true and the native rows that
+// it covers.
+static bool TrackCursor(const SPITask *task, int *a, int *b) {
+    DisplayCursorState &c = te.cursor;
+    if (task->cmd == SPI_TASK_COMPOUND) {
+        for (const uint8_t *p = task->data, *end = task->data + task->size; p < end; p += 2 + p[0])
+            TrackCommand(p[1], p + 2, p[0]);
+        return false;
+    }
+    if (task->cmd == DISPLAY_WRITE_PIXELS) {
+        c.writeX = c.x0;
+        c.writeY = c.y0;
+    }
+#ifdef DISPLAY_WRITE_PIXELS_CONTINUE
+    else if (task->cmd != DISPLAY_WRITE_PIXELS_CONTINUE) {
+#else
+    else {
+#endif
+        TrackCommand(task->cmd, task->data, task->size);
+        return false;
+    }
+    if (c.x0 < 0 || c.y0 < 0 || c.writeX < 0 || c.x1 < c.x0) return false;
+
+    // Rows and columns of the display that the pixels go to, then advance the write pointer past them
+    const int width = c.x1 - c.x0 + 1, pixels = task->size / SPI_BYTESPERPIXEL;
+    const int offset = c.writeX - c.x0 + MAX(pixels, 1) - 1;
+    int x0 = c.writeX, x1 = c.writeX + pixels - 1, y0 = c.writeY, y1 = c.writeY + offset / width;
+    if (y1 > y0) {
+        x0 = c.x0;
+        x1 = c.x1;
+    }
+    if (y1 > c.y1) {
+        y0 = c.y0; // Wrapped back to the top of the window
+        y1 = c.y1;
+    }
+    c.writeX = c.x0 + (offset + 1) % width;
+    c.writeY += (offset + 1) / width;
+    if (c.writeY > c.y1) c.writeY = c.y0;
+
+    int r0 = NATIVE_ROW_OF_DISPLAY_PIXEL(x0, y0), r1 = NATIVE_ROW_OF_DISPLAY_PIXEL(x1, y1);
+#ifdef HARDWARE_VERTICAL_SCROLLING
+    // Scrolling only moves rows around within the scrolling area. A write that wraps around its end (the frame path splits writes
+    // there) or runs into it from a fixed area is taken to cover all of it.
+    const int s0 = ScreenRowOfGRAMRow(MIN(r0, r1)), s1 = ScreenRowOfGRAMRow(MAX(r0, r1));
+    const bool contiguous = (s1 - s0 == ABS(r1 - r0));
+    r0 = contiguous ? s0 : MIN(s0, te.scrollTop);
+    r1 = contiguous ? s1 : MAX(s1, te.scrollTop + te.scrollRows - 1);
+#endif
+    *a = MAX(MIN(r0, r1), 0);
+    *b = MIN(MAX(r0, r1), DISPLAY_NATIVE_HEIGHT - 1);
+    return true;
+}
+
+void WaitUntilTearFree(SPITask *task) {
+    int a, b;
+    if (!te.enabled || !TrackCursor(task, &a, &b)) return;
+    uint64_t now = tick();
+    PollTearingEffect(now);
+    const double usecs = (task->PayloadSize() + 1) * NOMINAL_SPI_USECS_PER_BYTE;
+
+    if (now - te.refreshStart > RECALIBRATE_USECS) {
+        if (!CalibrateTearingEffect()) {
+            printf("Lost the tearing effect signal on GPIO pin %d, display updates are no longer synchronized to it\n", te.pin);
+            te.enabled = false;
+            return;
+        }
+        now = tick();
+    } else if (now - te.refreshStart > RESYNC_USECS && now - te.lastResync > RESYNC_USECS &&
+               NextRefreshStart(now) < now + (uint64_t) usecs) {
+        // This write would run over the next edge, and leave it untimed. Time it first.
+        te.lastResync = now;
+        WaitUntil(NextRefreshStart(now) + EDGE_WINDOW_USECS);
+        now = tick();
+    }
+
+    const uint64_t delay = TearFreeDelay(now, a, b, usecs);
+    if (!delay) return;
+    WaitUntil(now + delay);
+    __atomic_store_n(&tearingEffectStatistics.writesHeld, tearingEffectStatistics.writesHeld + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&tearingEffectStatistics.heldUsecs, tearingEffectStatistics.heldUsecs + (tick() - now), __ATOMIC_RELAXED);
+}
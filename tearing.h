@@ -0,0 +1,63 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "display.h"
+
+// Tearing effect (TE) sync: the panel raises its TE output at the start of each refresh (vertical blanking), and then scans out its
+// native rows top to bottom until the next one. With the TE line wired to a GPIO pin (-DGPIO_TFT_TEARING_EFFECT=<pin>), the thread
+// that runs the SPI tasks times the rising edges with tick() to estimate the refresh period and the row that the panel is reading
+// (the beam) at any moment, and holds each pixel write back until the beam will not cross the rows that it writes while it is
+// being sent. Rather than waiting for vertical blanking and sending a whole frame at once (which the SPI bus is too slow for at
+// these resolutions anyway), each write starts right behind the beam, "racing" it: the bus keeps sending most of the time, and
+// each write lands on the screen whole, within a refresh.
+//
+// A write that takes longer to send than the beam takes to come around tears regardless, and is sent without holding it. Writes
+// are shorter the smaller SPI_MAX_PIXEL_TASK_BYTES is. Only for the SPI thread of this program, not the kernel module.
+
+// The native rows of the panel that a display pixel is on. With DISPLAY_FLIP_ORIENTATION_IN_HARDWARE the controller writes display
+// rows along native columns, so the native rows are display columns.
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_HARDWARE
+#define NATIVE_ROW_OF_DISPLAY_PIXEL_UNROTATED(x, y) (x)
+#else
+#define NATIVE_ROW_OF_DISPLAY_PIXEL_UNROTATED(x, y) (y)
+#endif
+#ifdef DISPLAY_ROTATE_180_DEGREES_IN_HARDWARE
+#define NATIVE_ROW_OF_DISPLAY_PIXEL(x, y) (DISPLAY_NATIVE_HEIGHT - 1 - NATIVE_ROW_OF_DISPLAY_PIXEL_UNROTATED(x, y))
+#else
+#define NATIVE_ROW_OF_DISPLAY_PIXEL(x, y) NATIVE_ROW_OF_DISPLAY_PIXEL_UNROTATED(x, y)
+#endif
+
+// Pixel writes advance through their native rows in the same direction as the beam only if display rows are native rows in the
+// same order. The beam is faster than the bus, so such a write can only be crossed by the beam entering its rows from the top.
+// Other writes sweep across all of their rows again and again, and the beam has to stay out of their rows altogether.
+#if defined(DISPLAY_FLIP_ORIENTATION_IN_HARDWARE) || defined(DISPLAY_ROTATE_180_DEGREES_IN_HARDWARE)
+#define TEARING_EFFECT_WRITES_CROSS_SCAN_ORDER
+#endif
+
+typedef struct TearingEffectStatistics {
+    uint32_t edges; // Rising edges of TE that were timed
+    uint32_t writesHeld; // Pixel writes that were held back until the beam was clear of their rows, and the time spent holding them
+    uint64_t heldUsecs;
+    uint32_t writesTooLong; // Pixel writes that take too long to send to avoid the beam, and were sent right away
+} TearingEffectStatistics;
+
+// Written by the thread that runs the SPI tasks, read with __atomic_load_n().
+extern TearingEffectStatistics tearingEffectStatistics;
+
+// Starts following the TE output of the panel on the given GPIO pin. Watches the pin for a few refreshes to measure the refresh
+// period, which blocks for up to a fifth of a second. Returns false and leaves the sync off if the pin shows no steady signal.
+// Called before the SPI tasks start to run, on the thread that runs them with FAST_BOOT. The producer is to address the cursor in
+// full with the next write, see InvalidateDisplayCursor().
+bool InitTearingEffectSync(int gpioPin);
+
+// Whether pixel writes are being synchronized to TE. Turns off by itself if the signal is lost.
+bool TearingEffectSyncEnabled(void);
+
+// Estimated refresh period of the panel in usecs, and the time of the start of the next refresh after the given tick() time.
+double TearingEffectRefreshPeriodUsecs(void);
+uint64_t NextRefreshStart(uint64_t now);
+
+// Called for every task by the thread that runs the SPI tasks, right before it sends it. Follows the cursor commands to know which
+// rows each pixel write covers, and if it is a pixel write, waits until it can be sent without the beam crossing it.
+void WaitUntilTearFree(struct SPITask *task);
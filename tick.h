@@ -4,9 +4,21 @@
 #include <inttypes.h>
 #include <unistd.h>
 
+#if defined(SPI_EMULATION) || defined(KERNEL_MODULE_RUNS_SPI_TASKS)
+#include <time.h>
+
+// There is no system timer peripheral to read off-target, and clients of the kernel module do not map /dev/mem, so count
+// microseconds from the monotonic clock instead.
+static inline uint64_t tick() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+#else
 // Initialized in spi.cpp along with the rest of the BCM2835 peripheral:
 extern volatile uint64_t *systemTimerRegister;
 #define tick() (*systemTimerRegister)
+#endif
 
 #endif
 